@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+
+#include "admission.h"
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "log.h"
+#include "metrics.h"
+
+static struct {
+    admission_limits_t limits;
+    uint64_t target_ns;
+    uint64_t interval_ns;
+    char reject[160]; /* whole 503 of a connection refused at accept */
+    int reject_len;
+    unsigned inflight;
+    /* CoDel, updated by whichever thread gets there first */
+    uint64_t interval_end_ns; /* 0 until the first request */
+    uint64_t min_delay_ns; /* shortest queueing delay of the current interval, UINT64_MAX for none */
+    int overloaded; /* the last interval had no short delay */
+} g_admission = { .min_delay_ns = UINT64_MAX };
+
+void admission_init(admission_limits_t const* limits)
+{
+    g_admission.limits = *limits;
+    g_admission.target_ns = (uint64_t)limits->target_ms * 1000000u;
+    g_admission.interval_ns = (uint64_t)limits->interval_ms * 1000000u;
+    g_admission.reject_len = snprintf(g_admission.reject, sizeof(g_admission.reject),
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: %u\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        limits->retry_after_sec);
+}
+
+int admission_accept(int fd)
+{
+    unsigned const max = g_admission.limits.max_conns;
+    if (max == 0 || conn_live() < max)
+        return 0;
+    // fresh socket, the reply fits its buffer; a client that can't take it gets a reset anyway
+    if (send(fd, g_admission.reject, g_admission.reject_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        LOG_DEBUG("[admission] 503 on %d not sent", fd);
+    close(fd);
+    metrics_count(METRIC_SHED_CONNECTIONS, 1);
+    LOG_INFO("[admission] %u connections open, refused %d", max, fd);
+    return -1;
+}
+
+/* closes the interval that ended at end when no other thread did, sets the next one */
+static void codel_roll(uint64_t end, uint64_t now_ns)
+{
+    if (!__atomic_compare_exchange_n(&g_admission.interval_end_ns, &end, now_ns + g_admission.interval_ns,
+            0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    uint64_t const min = __atomic_exchange_n(&g_admission.min_delay_ns, UINT64_MAX, __ATOMIC_RELAXED);
+    // an interval without requests had no queue either
+    int const overloaded = min != UINT64_MAX && min > g_admission.target_ns;
+    if (overloaded != __atomic_load_n(&g_admission.overloaded, __ATOMIC_RELAXED)) {
+        LOG_WARNING("[admission] queueing delay %s target, %s", overloaded ? "above" : "back under",
+            overloaded ? "shedding" : "no longer shedding");
+        __atomic_store_n(&g_admission.overloaded, overloaded, __ATOMIC_RELAXED);
+    }
+}
+
+/* 1 when a request that waited queued_ns is to be shed */
+static int codel_drop(uint64_t now_ns, uint64_t queued_ns)
+{
+    uint64_t const end = __atomic_load_n(&g_admission.interval_end_ns, __ATOMIC_RELAXED);
+    if (now_ns >= end)
+        codel_roll(end, now_ns);
+
+    uint64_t min = __atomic_load_n(&g_admission.min_delay_ns, __ATOMIC_RELAXED);
+    while (queued_ns < min
+        && !__atomic_compare_exchange_n(&g_admission.min_delay_ns, &min, queued_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    uint64_t const limit = __atomic_load_n(&g_admission.overloaded, __ATOMIC_RELAXED)
+        ? g_admission.target_ns
+        : g_admission.interval_ns;
+    return queued_ns > limit;
+}
+
+int admission_enter(uint64_t now_ns, uint64_t queued_ns)
+{
+    metrics_record(METRIC_QUEUE, queued_ns);
+    if (g_admission.target_ns > 0 && codel_drop(now_ns, queued_ns))
+        goto HANDLE_ERROR;
+
+    unsigned const n = __atomic_add_fetch(&g_admission.inflight, 1, __ATOMIC_RELAXED);
+    unsigned const max = g_admission.limits.max_inflight;
+    if (max > 0 && n > max) {
+        __atomic_sub_fetch(&g_admission.inflight, 1, __ATOMIC_RELAXED);
+        goto HANDLE_ERROR;
+    }
+    return 0;
+
+HANDLE_ERROR:
+    metrics_count(METRIC_SHED_REQUESTS, 1);
+    return -1;
+}
+
+void admission_leave(void)
+{
+    __atomic_sub_fetch(&g_admission.inflight, 1, __ATOMIC_RELAXED);
+}
+
+unsigned admission_retry_after(void)
+{
+    return g_admission.limits.retry_after_sec;
+}
@@ -0,0 +1,48 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+/* CoDel defaults: a standing queue of more than 5ms for 100ms means overload */
+#define ADMISSION_TARGET_MS 5
+#define ADMISSION_INTERVAL_MS 100
+/* what a shed client is told to wait before it tries again */
+#define ADMISSION_RETRY_AFTER_SEC 1
+
+/* when the server stops taking work, 0 turns a limit off */
+typedef struct {
+    unsigned max_conns; /* open connections */
+    unsigned max_inflight; /* requests being served at once, over all threads */
+    unsigned target_ms; /* queueing delay a request may see, 0 turns CoDel off */
+    unsigned interval_ms; /* how long the delay may stay above target_ms */
+    unsigned retry_after_sec;
+} admission_limits_t;
+
+/* before serving, limits is copied */
+void admission_init(admission_limits_t const* limits);
+
+/*
+ * whether fd, just accepted, may stay: 0, or -1 once max_conns connections
+ * are open, after a short 503 was written to fd and it was closed
+ */
+int admission_accept(int fd);
+
+/*
+ * Whether a request that waited queued_ns since its bytes were seen by the
+ * loop may be served now: 0, to be paired with admission_leave(), or -1
+ * when it is to be shed with 503.
+ *
+ * Shedding on queueing delay follows CoDel as servers use it: when even the
+ * shortest delay of the last interval stayed above target, the queue is a
+ * standing one, and from then on requests that waited longer than target
+ * are refused until an interval sees a short one again. Otherwise only
+ * those that waited longer than a whole interval are, their client has
+ * likely given up already.
+ */
+int admission_enter(uint64_t now_ns, uint64_t queued_ns);
+void admission_leave(void);
+
+/* Retry-After of a shed request, in seconds */
+unsigned admission_retry_after(void);
+
+#endif // ADMISSION_H
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+
+#include "compress.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "request.h"
+
+/* the cpu load compress_level() looks at is sampled at most this often */
+#define LOAD_SAMPLE_NS (250 * 1000 * 1000ull)
+/* process cpu use (percent of all cores) from which compression backs off */
+#define LOAD_BUSY_PCT 60
+#define LOAD_SATURATED_PCT 90
+
+/* a pooled stream remembers its level, deflateParams() only runs on a change */
+typedef struct {
+    z_stream zs; /* first, the z_stream* handed out points here */
+    int level;
+} compress_stream_t;
+
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+
+typedef struct {
+    int num;
+    compress_stream_t* streams[COMPRESS_POOL_SIZE];
+    ZSTD_CCtx* zstd; /* one per thread, reused by every zstd response */
+} compress_pool_t;
+
+/* the part of libzstd's API we use, bound by dlopen(3): no build dependency on it */
+static struct {
+    ZSTD_CCtx* (*create_cctx)(void);
+    size_t (*free_cctx)(ZSTD_CCtx* cctx);
+    size_t (*compress_cctx)(ZSTD_CCtx* cctx, void* dst, size_t dst_cap, void const* src, size_t src_size, int level);
+    size_t (*compress_bound)(size_t src_size);
+    unsigned (*is_error)(size_t code);
+} g_zstd;
+
+/* likewise for libbrotlienc's one-shot encoder, its enums as plain ints */
+#define BR_DEFAULT_WINDOW 22
+#define BR_MODE_GENERIC 0
+
+static struct {
+    int (*compress)(int quality, int lgwin, int mode, size_t input_size, uint8_t const* input, size_t* encoded_size,
+        uint8_t* encoded);
+    size_t (*max_compressed_size)(size_t input_size);
+} g_br;
+
+static struct {
+    pthread_once_t once;
+    pthread_key_t key; /* only for its destructor, frees an exiting thread's pool */
+    long cpus;
+    int available; /* ENCODING_TYPE_* bits */
+    /* last load sample, taken by whichever thread finds it stale */
+    uint64_t sample_ns;
+    uint64_t sample_cpu_ns;
+    int load_pct;
+} g_compress = { .once = PTHREAD_ONCE_INIT };
+
+static __thread compress_pool_t* t_pool;
+
+/*** pool ***/
+
+static void stream_free(compress_stream_t* s)
+{
+    deflateEnd(&s->zs);
+    free(s);
+}
+
+static void pool_release(void* arg)
+{
+    compress_pool_t* pool = arg;
+    t_pool = NULL;
+    for (int i = 0; i < pool->num; ++i)
+        stream_free(pool->streams[i]);
+    if (pool->zstd != NULL)
+        g_zstd.free_cctx(pool->zstd);
+    free(pool);
+}
+
+static void zstd_load(void)
+{
+    void* lib = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        LOG_INFO("[compress] no zstd: %s", dlerror());
+        return;
+    }
+    *(void**)&g_zstd.create_cctx = dlsym(lib, "ZSTD_createCCtx");
+    *(void**)&g_zstd.free_cctx = dlsym(lib, "ZSTD_freeCCtx");
+    *(void**)&g_zstd.compress_cctx = dlsym(lib, "ZSTD_compressCCtx");
+    *(void**)&g_zstd.compress_bound = dlsym(lib, "ZSTD_compressBound");
+    *(void**)&g_zstd.is_error = dlsym(lib, "ZSTD_isError");
+    if (g_zstd.create_cctx == NULL || g_zstd.free_cctx == NULL || g_zstd.compress_cctx == NULL
+        || g_zstd.compress_bound == NULL || g_zstd.is_error == NULL) {
+        LOG_WARNING("[compress] libzstd.so.1 lacks a symbol, no zstd");
+        dlclose(lib);
+        return;
+    }
+    // stays loaded for the life of the process
+    g_compress.available |= ENCODING_TYPE_ZSTD;
+}
+
+static void br_load(void)
+{
+    void* lib = dlopen("libbrotlienc.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        LOG_INFO("[compress] no brotli: %s", dlerror());
+        return;
+    }
+    *(void**)&g_br.compress = dlsym(lib, "BrotliEncoderCompress");
+    *(void**)&g_br.max_compressed_size = dlsym(lib, "BrotliEncoderMaxCompressedSize");
+    if (g_br.compress == NULL || g_br.max_compressed_size == NULL) {
+        LOG_WARNING("[compress] libbrotlienc.so.1 lacks a symbol, no brotli");
+        dlclose(lib);
+        return;
+    }
+    // stays loaded for the life of the process
+    g_compress.available |= ENCODING_TYPE_BR;
+}
+
+static void compress_init(void)
+{
+    pthread_key_create(&g_compress.key, pool_release);
+    long const n = sysconf(_SC_NPROCESSORS_ONLN);
+    g_compress.cpus = n > 0 ? n : 1;
+    g_compress.available = ENCODING_TYPE_GZIP;
+    br_load();
+    zstd_load();
+}
+
+static compress_pool_t* pool_self(void)
+{
+    if (t_pool != NULL)
+        return t_pool;
+    pthread_once(&g_compress.once, compress_init);
+    compress_pool_t* pool = calloc(1, sizeof(compress_pool_t));
+    if (pool == NULL)
+        return NULL;
+    pthread_setspecific(g_compress.key, pool);
+    t_pool = pool;
+    return pool;
+}
+
+z_stream* compress_stream_get(int level)
+{
+    compress_pool_t* const pool = pool_self();
+    if (pool != NULL && pool->num > 0) {
+        compress_stream_t* s = pool->streams[--pool->num];
+        if (s->level != level) {
+            // a reset stream has no pending output, the switch is free
+            if (deflateParams(&s->zs, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+                stream_free(s);
+                return NULL;
+            }
+            s->level = level;
+        }
+        return &s->zs;
+    }
+
+    compress_stream_t* s = malloc(sizeof(compress_stream_t));
+    if (s == NULL)
+        return NULL;
+    s->zs = (z_stream) { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+    if (deflateInit2(&s->zs, level, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(s);
+        return NULL;
+    }
+    s->level = level;
+    return &s->zs;
+}
+
+void compress_stream_put(z_stream* zs)
+{
+    if (zs == NULL)
+        return;
+    compress_stream_t* s = (compress_stream_t*)zs;
+    compress_pool_t* const pool = pool_self();
+    if (pool == NULL || pool->num == COMPRESS_POOL_SIZE || deflateReset(zs) != Z_OK) {
+        stream_free(s);
+        return;
+    }
+    pool->streams[pool->num++] = s;
+}
+
+/*** codecs ***/
+
+/* zlib's 1..9 to brotli quality and zstd level, each about as much effort */
+static int const g_br_quality[10] = { 0, 1, 2, 3, 4, 4, 5, 6, 7, 9 };
+static int const g_zstd_level[10] = { 0, 1, 1, 2, 2, 3, 3, 6, 9, 15 };
+
+/* tie breaks of compress_pick(), cheapest per byte saved first */
+static int const g_codec_order[] = { ENCODING_TYPE_ZSTD, ENCODING_TYPE_BR, ENCODING_TYPE_GZIP };
+
+int compress_available(void)
+{
+    pthread_once(&g_compress.once, compress_init);
+    return g_compress.available;
+}
+
+char const* compress_name(int encoding)
+{
+    switch (encoding) {
+    case ENCODING_TYPE_GZIP:
+        return "gzip";
+    case ENCODING_TYPE_BR:
+        return "br";
+    case ENCODING_TYPE_ZSTD:
+        return "zstd";
+    }
+    return "identity";
+}
+
+char const* compress_ext(int encoding)
+{
+    switch (encoding) {
+    case ENCODING_TYPE_GZIP:
+        return ".gz";
+    case ENCODING_TYPE_BR:
+        return ".br";
+    case ENCODING_TYPE_ZSTD:
+        return ".zst";
+    }
+    return "";
+}
+
+int compress_pick(int accept, unsigned short const* accept_q, int offered)
+{
+    int best = ENCODING_TYPE_UNDEF;
+    unsigned best_q = 0;
+    int const usable = accept & offered & compress_available();
+    for (size_t i = 0; i < sizeof(g_codec_order) / sizeof(g_codec_order[0]); ++i) {
+        int const encoding = g_codec_order[i];
+        unsigned const q = accept_q[__builtin_ctz(encoding)];
+        if ((usable & encoding) && q > best_q) {
+            best = encoding;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+size_t compress_bound(int encoding, size_t len)
+{
+    switch (encoding) {
+    case ENCODING_TYPE_BR:
+        if (compress_available() & ENCODING_TYPE_BR) {
+            size_t const bound = g_br.max_compressed_size(len);
+            return bound != 0 ? bound : len + len / 2 + 1024;
+        }
+        break;
+    case ENCODING_TYPE_ZSTD:
+        if (compress_available() & ENCODING_TYPE_ZSTD)
+            return g_zstd.compress_bound(len);
+        break;
+    }
+    return compressBound(len) + 32; // + gzip header and trailer
+}
+
+static int encode_gzip(const char* input, size_t input_size, char* output, size_t output_size, int level)
+{
+    z_stream* zs = compress_stream_get(level);
+    if (zs == NULL)
+        return -1;
+    zs->avail_in = (uInt)input_size;
+    zs->next_in = (Bytef*)input;
+    zs->avail_out = (uInt)output_size;
+    zs->next_out = (Bytef*)output;
+    int const status = deflate(zs, Z_FINISH);
+    int const len = status == Z_STREAM_END ? (int)zs->total_out : -1;
+    compress_stream_put(zs);
+    return len;
+}
+
+static int encode_zstd(const char* input, size_t input_size, char* output, size_t output_size, int level)
+{
+    if (!(compress_available() & ENCODING_TYPE_ZSTD))
+        return -1;
+    compress_pool_t* const pool = pool_self();
+    if (pool == NULL)
+        return -1;
+    if (pool->zstd == NULL && (pool->zstd = g_zstd.create_cctx()) == NULL)
+        return -1;
+    size_t const len = g_zstd.compress_cctx(pool->zstd, output, output_size, input, input_size, g_zstd_level[level]);
+    return g_zstd.is_error(len) ? -1 : (int)len;
+}
+
+int compress_encode(int encoding, const char* input, size_t input_size, char* output, size_t output_size, int level)
+{
+    if (level == Z_DEFAULT_COMPRESSION)
+        level = 6;
+    level = level < 1 ? 1 : level > 9 ? 9 : level;
+    uint64_t const t_beg = metrics_now_ns();
+    int len = -1;
+    switch (encoding) {
+    case ENCODING_TYPE_GZIP:
+        len = encode_gzip(input, input_size, output, output_size, level);
+        break;
+    case ENCODING_TYPE_BR: {
+        // one-shot: brotli has no state worth keeping between calls
+        size_t out_len = output_size;
+        if ((compress_available() & ENCODING_TYPE_BR)
+            && g_br.compress(g_br_quality[level], BR_DEFAULT_WINDOW, BR_MODE_GENERIC, input_size,
+                (uint8_t const*)input, &out_len, (uint8_t*)output)) {
+            len = (int)out_len;
+        }
+        break;
+    }
+    case ENCODING_TYPE_ZSTD:
+        len = encode_zstd(input, input_size, output, output_size, level);
+        break;
+    }
+    metrics_record(METRIC_COMPRESS, metrics_now_ns() - t_beg);
+    return len;
+}
+
+/*** policy ***/
+
+int compress_worthwhile(size_t size, char const* content_type)
+{
+    // media and archive formats carry their own compression
+    static char const* const prefixes[] = {
+        "image/png", "image/jpeg", "image/gif", "image/webp", "image/avif",
+        "video/", "audio/", "font/woff",
+        "application/gzip", "application/zip", "application/zstd", "application/x-7z", "application/x-xz",
+        "application/x-bzip2", "application/pdf",
+    };
+    if (size < COMPRESS_MIN_SIZE)
+        return 0;
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i) {
+        if (strncasecmp(content_type, prefixes[i], strlen(prefixes[i])) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* cpu the whole process used since the previous sample, in percent of all cores */
+static int load_pct(void)
+{
+    uint64_t const now = metrics_now_ns();
+    uint64_t last = __atomic_load_n(&g_compress.sample_ns, __ATOMIC_RELAXED);
+    if (now - last >= LOAD_SAMPLE_NS
+        && __atomic_compare_exchange_n(&g_compress.sample_ns, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        uint64_t const cpu_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        uint64_t const prev_cpu_ns = __atomic_exchange_n(&g_compress.sample_cpu_ns, cpu_ns, __ATOMIC_RELAXED);
+        if (last != 0) {
+            pthread_once(&g_compress.once, compress_init);
+            uint64_t const pct = (cpu_ns - prev_cpu_ns) * 100 / ((now - last) * g_compress.cpus);
+            __atomic_store_n(&g_compress.load_pct, pct > 100 ? 100 : (int)pct, __ATOMIC_RELAXED);
+        }
+    }
+    return __atomic_load_n(&g_compress.load_pct, __ATOMIC_RELAXED);
+}
+
+int compress_level(size_t size, int level)
+{
+    if (level == Z_DEFAULT_COMPRESSION)
+        level = 6;
+    int const load = load_pct();
+    int cap = 9;
+    if (load >= LOAD_SATURATED_PCT)
+        cap = Z_BEST_SPEED;
+    else if (load >= LOAD_BUSY_PCT || size >= COMPRESS_LARGE_SIZE)
+        cap = 3;
+    return level < cap ? level : cap;
+}
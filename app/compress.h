@@ -0,0 +1,64 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+/* shorter bodies are sent as they are, gzip framing alone is 18 bytes */
+#define COMPRESS_MIN_SIZE 256
+/* per-request compression of longer bodies is kept to a fast level */
+#define COMPRESS_LARGE_SIZE (1024 * 1024)
+/* deflate contexts a thread keeps for reuse */
+#define COMPRESS_POOL_SIZE 2
+
+/*
+ * Content codings, encoding is one ENCODING_TYPE_* bit of request.h.
+ * gzip is linked in (zlib); br and zstd are optional, used when
+ * libbrotlienc.so.1 and libzstd.so.1 can be loaded at run time, see
+ * compress_available(). Levels are given on zlib's 1..9 scale and mapped
+ * to each codec's own.
+ */
+
+/* ENCODING_TYPE_* bits the server can produce */
+int compress_available(void);
+
+/* the Content-Encoding token of encoding */
+char const* compress_name(int encoding);
+
+/* file name suffix of a precompressed sibling in encoding, ".gz" */
+char const* compress_ext(int encoding);
+
+/*
+ * the encoding to send among offered, given the client's ENCODING_TYPE_*
+ * accept bits and q-values (thousandths, indexed by bit number): the
+ * highest q, ties going to the cheaper codec. ENCODING_TYPE_UNDEF for
+ * identity.
+ */
+int compress_pick(int accept, unsigned short const* accept_q, int offered);
+
+/* output room that always takes len bytes in encoding */
+size_t compress_bound(int encoding, size_t len);
+
+/* encode input into output, returns the compressed size or -1 when output is too small */
+int compress_encode(int encoding, const char* input, size_t input_size, char* output, size_t output_size, int level);
+
+/*
+ * A gzip deflate stream at level, reset and ready for input. Streams come
+ * from a small per-thread pool, so the ~256K of zlib state is set up once
+ * per thread instead of once per response. NULL on failure.
+ */
+z_stream* compress_stream_get(int level);
+
+/* back to the calling thread's pool (any thread may return it), or freed when that is full */
+void compress_stream_put(z_stream* zs);
+
+/* 0 when a body of size bytes of content_type is not worth compressing: tiny, or compressed already */
+int compress_worthwhile(size_t size, char const* content_type);
+
+/*
+ * level to compress a size bytes body with per request, given the level
+ * the caller would like: large bodies and a busy cpu get a faster one
+ */
+int compress_level(size_t size, int level);
+
+#endif // COMPRESS_H
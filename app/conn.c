@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+
+#include "conn.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+
+static unsigned g_conn_live;
+
+/* append a segment with data_cap bytes of room, the caller fills it in */
+static conn_seg_t* out_push(conn_t* c, size_t data_cap)
+{
+    conn_seg_t* seg = malloc(sizeof(conn_seg_t) + data_cap);
+    if (seg == NULL) {
+        LOG_ERROR("[conn_write] malloc for conn_seg_t failed!");
+        return NULL;
+    }
+    seg->next = NULL;
+    seg->file_fd = -1;
+    seg->release = NULL;
+    seg->release_arg = NULL;
+    seg->ref = NULL;
+    seg->fill = NULL;
+    seg->cap = data_cap;
+    seg->off = 0;
+    seg->len = 0;
+    if (c->out_tail)
+        c->out_tail->next = seg;
+    else
+        c->out_head = seg;
+    c->out_tail = seg;
+    return seg;
+}
+
+static void out_pop(conn_t* c)
+{
+    conn_seg_t* seg = c->out_head;
+    c->out_head = seg->next;
+    if (c->out_head == NULL)
+        c->out_tail = NULL;
+    if (seg->release != NULL)
+        seg->release(seg->release_arg);
+    else if (seg->file_fd != -1)
+        close(seg->file_fd);
+    free(seg);
+}
+
+conn_t* conn_new(int fd)
+{
+    conn_t* c = malloc(sizeof(conn_t));
+    if (c == NULL) {
+        LOG_ERROR("[conn_new] malloc for conn_t failed!");
+        return NULL;
+    }
+    c->fd = fd;
+    c->closing = 0;
+    c->loop = NULL;
+    c->revents = 0;
+    c->interest = 0;
+    c->io = NULL;
+    c->send_file = NULL;
+    c->recv_len = 0;
+    c->recv_cap = BUFFER_SIZE;
+    c->recv_buf = malloc(c->recv_cap + 1);
+    if (c->recv_buf == NULL) {
+        LOG_ERROR("[conn_new] malloc for recv_buf failed!");
+        free(c);
+        return NULL;
+    }
+    c->recv_buf[0] = '\0';
+    http_parser_reset(&c->parser);
+    c->sink = NULL;
+    c->sink_release = NULL;
+    c->out_head = NULL;
+    c->out_tail = NULL;
+    c->corked = 0;
+    c->batch_len = 0;
+    c->requests = 0;
+    c->ready_ns = 0;
+    c->head_since = 0;
+    c->deadline = 0;
+    c->timer.prev = c->timer.next = NULL;
+    __atomic_add_fetch(&g_conn_live, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+void conn_free(conn_t* c)
+{
+    if (c == NULL)
+        return;
+    if (c->fd != -1)
+        close(c->fd);
+    while (c->out_head != NULL)
+        out_pop(c);
+    if (c->sink != NULL && c->sink_release != NULL)
+        c->sink_release(c->sink);
+    free(c->recv_buf);
+    free(c);
+    __atomic_sub_fetch(&g_conn_live, 1, __ATOMIC_RELAXED);
+}
+
+unsigned conn_live(void)
+{
+    return __atomic_load_n(&g_conn_live, __ATOMIC_RELAXED);
+}
+
+/* room behind recv_len, growing recv_buf when full, -1 with ENOBUFS at MAX_RECV_SIZE */
+static int recv_reserve(conn_t* c)
+{
+    if (c->recv_len < c->recv_cap)
+        return 0;
+    size_t new_cap = c->recv_cap * 2;
+    if (new_cap > MAX_RECV_SIZE)
+        new_cap = MAX_RECV_SIZE;
+    char* p = new_cap > c->recv_cap ? realloc(c->recv_buf, new_cap + 1) : NULL;
+    if (p == NULL) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    c->recv_buf = p;
+    c->recv_cap = new_cap;
+    return 0;
+}
+
+ssize_t conn_recv(conn_t* c)
+{
+    if (recv_reserve(c) != 0)
+        return -1;
+
+    ssize_t n;
+    do {
+        n = recv(c->fd, c->recv_buf + c->recv_len, c->recv_cap - c->recv_len, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        c->recv_len += n;
+        c->recv_buf[c->recv_len] = '\0';
+        metrics_count(METRIC_BYTES_RECEIVED, n);
+    }
+    return n;
+}
+
+ssize_t conn_append(conn_t* c, void const* data, size_t len)
+{
+    if (recv_reserve(c) != 0)
+        return -1;
+    size_t const n = len < c->recv_cap - c->recv_len ? len : c->recv_cap - c->recv_len;
+    memcpy(c->recv_buf + c->recv_len, data, n);
+    c->recv_len += n;
+    c->recv_buf[c->recv_len] = '\0';
+    metrics_count(METRIC_BYTES_RECEIVED, n);
+    return n;
+}
+
+ssize_t conn_read(conn_t* c, void* buf, size_t len)
+{
+    if (c->io != NULL) {
+        // a pending receive of the loop would get bytes ahead of ours
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t n;
+    do {
+        n = recv(c->fd, buf, len, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0)
+        metrics_count(METRIC_BYTES_RECEIVED, n);
+    return n;
+}
+
+void conn_consume(conn_t* c, size_t n)
+{
+    if (n == 0)
+        return;
+    memmove(c->recv_buf, c->recv_buf + n, c->recv_len - n);
+    c->recv_len -= n;
+    c->recv_buf[c->recv_len] = '\0';
+
+    // give back what one large request needed
+    if (c->recv_len <= BUFFER_SIZE && c->recv_cap > BUFFER_SIZE) {
+        char* p = realloc(c->recv_buf, BUFFER_SIZE + 1);
+        if (p != NULL) {
+            c->recv_buf = p;
+            c->recv_cap = BUFFER_SIZE;
+        }
+    }
+}
+
+/* push one segment as far as the socket takes it: 0 done, 1 would block, -1 error */
+static int seg_send(conn_t* c, conn_seg_t* seg)
+{
+    while (1) {
+        if (seg->len == 0) {
+            if (seg->fill == NULL)
+                return 0;
+            ssize_t const n = seg->fill(seg->release_arg, seg->data, seg->cap);
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                return 0;
+            seg->off = 0;
+            seg->len = n;
+        }
+        if (seg->file_fd != -1 && c->send_file != NULL) {
+            int const ret = c->send_file(c, seg);
+            if (ret != CONN_FILE_FALLBACK)
+                return ret;
+        }
+        ssize_t n;
+        if (seg->file_fd == -1)
+            n = send(c->fd, (seg->ref ? seg->ref : seg->data) + seg->off, seg->len, MSG_NOSIGNAL);
+        else
+            n = sendfile(c->fd, seg->file_fd, &seg->off, seg->len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            LOG_WARNING("[conn] send failed: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            // file shrank under us, the promised Content-Length can't be kept
+            LOG_ERROR("[conn_sendfile] unexpected end of file");
+            return -1;
+        }
+        if (seg->file_fd == -1)
+            seg->off += n;
+        seg->len -= n;
+        metrics_count(METRIC_BYTES_SENT, n);
+    }
+}
+
+/* 1 when output is to be queued only, -1 when sending a batch that grew too long failed */
+static int out_held(conn_t* c)
+{
+    if (!c->corked)
+        return 0;
+    if (c->batch_len >= CONN_BATCH_MAX) {
+        c->batch_len = 0;
+        if (conn_flush(c) < 0)
+            return -1;
+    }
+    return 1;
+}
+
+/* room for len more bytes at the end of the output, packed behind the last segment while corked */
+static char* out_reserve(conn_t* c, size_t len)
+{
+    conn_seg_t* seg = c->out_tail;
+    if (!c->corked || seg == NULL || seg->file_fd != -1 || seg->ref != NULL || seg->fill != NULL
+        || seg->cap - seg->off - seg->len < len) {
+        seg = out_push(c, c->corked && len < CONN_BATCH_SEG_SIZE ? CONN_BATCH_SEG_SIZE : len);
+        if (seg == NULL)
+            return NULL;
+    }
+    char* const p = seg->data + seg->off + seg->len;
+    seg->len += len;
+    if (c->corked)
+        c->batch_len += len;
+    return p;
+}
+
+/* send what the socket takes right now, returns bytes sent or -1 */
+static ssize_t send_now(conn_t* c, char const* p, size_t len)
+{
+    size_t sent = 0;
+
+    int const held = out_held(c);
+    if (held != 0)
+        return held < 0 ? -1 : 0;
+    // keep ordering: anything queued earlier has to leave first
+    if (conn_has_pending(c))
+        return 0;
+    while (sent < len) {
+        ssize_t n = send(c->fd, p + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            LOG_WARNING("[conn] send failed: %s", strerror(errno));
+            return -1;
+        }
+        sent += n;
+    }
+    if (sent > 0)
+        metrics_count(METRIC_BYTES_SENT, sent);
+    return sent;
+}
+
+int conn_write(conn_t* c, void const* data, size_t len)
+{
+    ssize_t const sent = send_now(c, data, len);
+    if (sent < 0)
+        return -1;
+    if ((size_t)sent == len)
+        return 0;
+    char* const p = out_reserve(c, len - sent);
+    if (p == NULL)
+        return -1;
+    memcpy(p, (char const*)data + sent, len - sent);
+    return 0;
+}
+
+int conn_write_ref(conn_t* c, void const* data, size_t len, void (*release)(void*), void* release_arg)
+{
+    ssize_t const sent = send_now(c, data, len);
+    conn_seg_t* seg = NULL;
+    if (sent >= 0 && (size_t)sent < len) {
+        seg = out_push(c, 0);
+        if (seg != NULL) {
+            seg->release = release;
+            seg->release_arg = release_arg;
+            seg->ref = data;
+            seg->off = sent;
+            seg->len = len - sent;
+            return 0;
+        }
+    }
+    if (release != NULL)
+        release(release_arg);
+    return (sent < 0 || (seg == NULL && (size_t)sent < len)) ? -1 : 0;
+}
+
+/* sendmsg(2) what the socket takes of iov right now, returns bytes sent or -1 */
+static ssize_t sendv_now(conn_t* c, struct iovec const* iov, int iovcnt)
+{
+    int const held = out_held(c);
+    if (held != 0)
+        return held < 0 ? -1 : 0;
+    if (conn_has_pending(c))
+        return 0;
+    struct msghdr msg = { .msg_iov = (struct iovec*)iov, .msg_iovlen = iovcnt };
+    ssize_t n;
+    do {
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        LOG_WARNING("[conn] sendmsg failed: %s", strerror(errno));
+        return -1;
+    }
+    metrics_count(METRIC_BYTES_SENT, n);
+    return n;
+}
+
+/* queue copies of what is left of iov[0, iovcnt) once sent bytes went out, as one segment */
+static int out_push_rest(conn_t* c, struct iovec const* iov, int iovcnt, size_t sent)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+    if (sent >= total)
+        return 0;
+    char* p = out_reserve(c, total - sent);
+    if (p == NULL)
+        return -1;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(p, (char const*)iov[i].iov_base + sent, iov[i].iov_len - sent);
+        p += iov[i].iov_len - sent;
+        sent = 0;
+    }
+    return 0;
+}
+
+int conn_writev(conn_t* c, struct iovec const* iov, int iovcnt)
+{
+    ssize_t const sent = sendv_now(c, iov, iovcnt);
+    if (sent < 0)
+        return -1;
+    return out_push_rest(c, iov, iovcnt, sent);
+}
+
+int conn_writev_ref(conn_t* c, struct iovec const* iov, int iovcnt, void (*release)(void*), void* release_arg)
+{
+    struct iovec const* const last = &iov[iovcnt - 1];
+    ssize_t sent = sendv_now(c, iov, iovcnt);
+    if (sent < 0 || out_push_rest(c, iov, iovcnt - 1, sent) != 0)
+        goto HANDLE_ERROR;
+
+    size_t head_len = 0;
+    for (int i = 0; i < iovcnt - 1; ++i)
+        head_len += iov[i].iov_len;
+    size_t const last_sent = (size_t)sent > head_len ? sent - head_len : 0;
+    if (last_sent == last->iov_len) {
+        if (release != NULL)
+            release(release_arg);
+        return 0;
+    }
+    conn_seg_t* seg = out_push(c, 0);
+    if (seg == NULL)
+        goto HANDLE_ERROR;
+    seg->release = release;
+    seg->release_arg = release_arg;
+    seg->ref = last->iov_base;
+    seg->off = last_sent;
+    seg->len = last->iov_len - last_sent;
+    return 0;
+
+HANDLE_ERROR:
+    if (release != NULL)
+        release(release_arg);
+    return -1;
+}
+
+/* send a freshly queued segment right away when nothing is ahead of it */
+static int out_kick(conn_t* c, conn_seg_t* seg)
+{
+    if (seg != c->out_head || c->corked)
+        return 0;
+    int const ret = seg_send(c, seg);
+    if (ret == 0)
+        out_pop(c);
+    return ret < 0 ? -1 : 0;
+}
+
+int conn_sendfile(conn_t* c, int file_fd, off_t off, size_t len, void (*release)(void*), void* release_arg)
+{
+    conn_seg_t* seg = out_push(c, 0);
+    if (seg == NULL) {
+        if (release != NULL)
+            release(release_arg);
+        else
+            close(file_fd);
+        return -1;
+    }
+    seg->file_fd = file_fd;
+    seg->release = release;
+    seg->release_arg = release_arg;
+    seg->off = off;
+    seg->len = len;
+    return out_kick(c, seg);
+}
+
+int conn_stream(conn_t* c, conn_fill_fn fill, size_t buf_size, void (*release)(void*), void* release_arg)
+{
+    conn_seg_t* seg = out_push(c, buf_size);
+    if (seg == NULL) {
+        if (release != NULL)
+            release(release_arg);
+        return -1;
+    }
+    seg->fill = fill;
+    seg->release = release;
+    seg->release_arg = release_arg;
+    return out_kick(c, seg);
+}
+
+static int seg_is_memory(conn_seg_t const* seg)
+{
+    return seg->file_fd == -1 && seg->fill == NULL;
+}
+
+/* the memory segments at the head of the output, one sendmsg(2): 0 sent, 1 would block, -1 error */
+static int out_send_memory(conn_t* c)
+{
+    struct iovec iov[CONN_FLUSH_IOV];
+    int num_iov = 0;
+    conn_seg_t* seg = c->out_head;
+    for (; seg != NULL && seg_is_memory(seg) && num_iov < CONN_FLUSH_IOV; seg = seg->next) {
+        iov[num_iov].iov_base = (char*)(seg->ref ? seg->ref : seg->data) + seg->off;
+        iov[num_iov].iov_len = seg->len;
+        ++num_iov;
+    }
+    // a file or stream behind is sent next, let its first bytes fill up the packet
+    int const flags = MSG_NOSIGNAL | (seg != NULL && !seg_is_memory(seg) ? MSG_MORE : 0);
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = num_iov };
+    ssize_t n;
+    do {
+        n = sendmsg(c->fd, &msg, flags);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        LOG_WARNING("[conn] sendmsg failed: %s", strerror(errno));
+        return -1;
+    }
+    metrics_count(METRIC_BYTES_SENT, n);
+
+    size_t sent = n;
+    while (c->out_head != NULL && seg_is_memory(c->out_head) && sent >= c->out_head->len) {
+        sent -= c->out_head->len;
+        out_pop(c);
+    }
+    if (sent > 0) {
+        c->out_head->off += sent;
+        c->out_head->len -= sent;
+    }
+    return 0;
+}
+
+int conn_flush(conn_t* c)
+{
+    while (conn_has_pending(c)) {
+        conn_seg_t* const seg = c->out_head;
+        if (seg_is_memory(seg)) {
+            int const ret = out_send_memory(c);
+            if (ret != 0)
+                return ret;
+            continue;
+        }
+        int const ret = seg_send(c, seg);
+        if (ret != 0)
+            return ret;
+        out_pop(c);
+    }
+    return 0;
+}
+
+void conn_cork(conn_t* c)
+{
+    c->corked = 1;
+    c->batch_len = 0;
+}
+
+/* 1 when a file or stream has more output behind it, sendfile(2) and send(2) would end its packet early */
+static int out_needs_cork(conn_t const* c)
+{
+    for (conn_seg_t const* seg = c->out_head; seg != NULL && seg->next != NULL; seg = seg->next) {
+        if (!seg_is_memory(seg))
+            return 1;
+    }
+    return 0;
+}
+
+int conn_uncork(conn_t* c)
+{
+    c->corked = 0;
+    c->batch_len = 0;
+    if (!out_needs_cork(c))
+        return conn_flush(c);
+
+    // only full packets leave until the cork is pulled, which pushes the rest
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    int const ret = conn_flush(c);
+    on = 0;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    return ret;
+}
+
+uint64_t conn_deadline(conn_t* c, conn_timeouts_t const* t, uint64_t now_ms)
+{
+    int const in_head = c->sink == NULL && c->parser.state <= HP_STATE_HEADERS;
+    if (!in_head || conn_has_pending(c))
+        return now_ms + t->idle_ms;
+    if (c->recv_len == 0 && c->requests > 0) {
+        c->head_since = 0;
+        return now_ms + t->keepalive_ms;
+    }
+    // the first request, or one partly in: its head has to be complete in time
+    if (c->head_since == 0)
+        c->head_since = now_ms;
+    return c->head_since + t->header_ms;
+}
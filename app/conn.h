@@ -0,0 +1,182 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "http_parser.h"
+#include "timer_wheel.h"
+
+/* safe buffer size of a package */
+#define BUFFER_SIZE 1500
+/* receive buffer never grows past one maximal request */
+#define MAX_RECV_SIZE (MAX_HEADER_SIZE + MAX_BODY_SIZE)
+/* while corked, copied output is packed into segments of at least this size */
+#define CONN_BATCH_SEG_SIZE 4096
+/* a corked batch that copied this much is sent without waiting for conn_uncork() */
+#define CONN_BATCH_MAX (64 * 1024)
+/* most segments one sendmsg(2) of conn_flush() takes */
+#define CONN_FLUSH_IOV 64
+
+/* produces the next bytes of a stream into buf, returns their count, 0 at the end, -1 on error */
+typedef ssize_t (*conn_fill_fn)(void* arg, char* buf, size_t cap);
+
+struct conn_t;
+struct conn_seg_t;
+
+/* a conn_file_fn declines a file segment with this, sendfile(2) sends it then */
+#define CONN_FILE_FALLBACK 2
+
+/*
+ * moves (part of) the file segment seg at the head of the output some
+ * other way than sendfile(2), returns like conn_flush()
+ */
+typedef int (*conn_file_fn)(struct conn_t* c, struct conn_seg_t* seg);
+
+/* how long a connection may go without progress, in milliseconds */
+typedef struct {
+    unsigned header_ms; /* from connect, or the first byte of a request, to the end of its head */
+    unsigned idle_ms; /* between reads or writes while a request or response is underway */
+    unsigned keepalive_ms; /* between requests */
+} conn_timeouts_t;
+
+/* one piece of pending output: bytes we own, a range of an open file, or a stream */
+typedef struct conn_seg_t {
+    struct conn_seg_t* next;
+    int file_fd; /* -1 for a memory segment */
+    void (*release)(void*); /* called with release_arg once sent, NULL closes file_fd */
+    void* release_arg;
+    char const* ref; /* memory segment borrowing the caller's bytes instead of data[] */
+    conn_fill_fn fill; /* stream: refills data[] (cap bytes) with release_arg once it is sent */
+    size_t cap;
+    off_t off; /* next file offset, or bytes of memory already sent */
+    size_t len; /* bytes still to send */
+    char data[];
+} conn_seg_t;
+
+/* per-connection state, shared by the threaded and the reactor front ends */
+typedef struct conn_t {
+    int fd;
+    int closing; /* close once the pending output is flushed */
+
+    /* event loop bookkeeping */
+    void* loop;
+    unsigned revents;
+    unsigned interest;
+    void* io; /* completion loop state: the socket is read only by that loop, bytes come in by conn_append() */
+    conn_file_fn send_file; /* takes over file segments when set */
+
+    /* receive side, recv_buf[recv_len] is always '\0' */
+    char* recv_buf;
+    size_t recv_len;
+    size_t recv_cap;
+    http_parser_t parser; /* framing state of the request at recv_buf[0] */
+    void* sink; /* handler state of a body streamed past recv_buf, NULL otherwise */
+    void (*sink_release)(void*); /* drops sink when the connection dies first */
+
+    /* pending output that the socket did not accept yet, in order */
+    conn_seg_t* out_head;
+    conn_seg_t* out_tail;
+    int corked; /* output is queued only, conn_uncork() sends it */
+    size_t batch_len; /* bytes copied into the output since conn_cork() */
+
+    /* keep-alive bookkeeping */
+    unsigned requests; /* served so far */
+    uint64_t ready_ns; /* metrics_now_ns() the loop saw the buffered bytes at, 0 when it does not tell */
+    uint64_t head_since; /* a request head is due since then, 0 when none is */
+    uint64_t deadline; /* timer_now_ms() the connection times out at */
+    timer_node_t timer; /* in the wheel of the reactor */
+} conn_t;
+
+conn_t* conn_new(int fd);
+void conn_free(conn_t* c);
+
+/* connections between conn_new() and conn_free(), over all threads */
+unsigned conn_live(void);
+
+/*
+ * read what the socket has into recv_buf, growing it when full, returns
+ * recv(2) result (-1 with ENOBUFS once MAX_RECV_SIZE is reached)
+ */
+ssize_t conn_recv(conn_t* c);
+
+/*
+ * copy bytes a completion loop received into recv_buf, growing it, returns
+ * how many fit (-1 with ENOBUFS when none do once MAX_RECV_SIZE is reached)
+ */
+ssize_t conn_append(conn_t* c, void const* data, size_t len);
+
+/*
+ * recv(2) straight into buf, bypassing recv_buf, for bodies handled as they
+ * arrive; -1 with EAGAIN under a completion loop, which owns the reads
+ */
+ssize_t conn_read(conn_t* c, void* buf, size_t len);
+
+/* drop the first n bytes of recv_buf, they were handled */
+void conn_consume(conn_t* c, size_t n);
+
+/* queue bytes for the client, trying to send them right away */
+int conn_write(conn_t* c, void const* data, size_t len);
+
+/*
+ * like conn_write(), but what the socket does not take right away is not
+ * copied: the bytes must stay valid until release(release_arg) is called
+ */
+int conn_write_ref(conn_t* c, void const* data, size_t len, void (*release)(void*), void* release_arg);
+
+/* conn_write() of several pieces with one sendmsg(2), what the socket does not take is copied */
+int conn_writev(conn_t* c, struct iovec const* iov, int iovcnt);
+
+/*
+ * like conn_writev(), but the last piece is borrowed as with conn_write_ref():
+ * it must stay valid until release(release_arg) is called
+ */
+int conn_writev_ref(conn_t* c, struct iovec const* iov, int iovcnt, void (*release)(void*), void* release_arg);
+
+/*
+ * queue len bytes of file_fd from offset off, sent with sendfile(2) without
+ * passing through user space. Once the range is sent (or the connection
+ * dies) release(release_arg) is called; with release == NULL the
+ * connection owns file_fd and closes it.
+ */
+int conn_sendfile(conn_t* c, int file_fd, off_t off, size_t len, void (*release)(void*), void* release_arg);
+
+/*
+ * queue a body produced on demand: fill(release_arg, ...) is asked for at
+ * most buf_size bytes each time the previous piece left the socket, so a
+ * slow client never makes the stream buffer more than that. Once fill()
+ * returns 0 (or the connection dies) release(release_arg) is called.
+ */
+int conn_stream(conn_t* c, conn_fill_fn fill, size_t buf_size, void (*release)(void*), void* release_arg);
+
+/*
+ * when c times out if nothing happens from now_ms on: a due request head
+ * gets header_ms in total, a request or response underway idle_ms per
+ * step, and a connection between requests keepalive_ms
+ */
+uint64_t conn_deadline(conn_t* c, conn_timeouts_t const* t, uint64_t now_ms);
+
+/*
+ * 0 when everything is sent, 1 when the socket would block, -1 on error;
+ * memory segments in a row leave with one sendmsg(2), with MSG_MORE when a
+ * file or a stream follows so its first bytes share their packet
+ */
+int conn_flush(conn_t* c);
+
+/*
+ * Hold output back until conn_uncork(): the replies to the pipelined
+ * requests of one read are queued, small ones packed together, and leave
+ * in as few sendmsg(2) calls and packets as conn_flush() makes of them.
+ */
+void conn_cork(conn_t* c);
+
+/* end the batch, returns like conn_flush() */
+int conn_uncork(conn_t* c);
+
+static inline int conn_has_pending(conn_t const* c)
+{
+    return c->out_head != NULL;
+}
+
+#endif // CONN_H
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+
+#include "file_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define FILE_CACHE_SHARDS 16
+/* without inotify, entries are re-stat()ed at most this often (seconds) */
+#define FILE_CACHE_TTL 1
+
+typedef struct {
+    pthread_mutex_t lock;
+    file_entry_t** buckets;
+    size_t mask;
+    file_entry_t* lru_head; /* most recently used */
+    file_entry_t* lru_tail;
+    size_t count;
+    size_t capacity;
+    unsigned long gen; /* bumped by every invalidation */
+} file_shard_t;
+
+static struct {
+    char* dir_path;
+    size_t capacity;
+    int inotify_fd; /* -1: fall back to FILE_CACHE_TTL checks */
+    size_t variant_bytes; /* held by all variants */
+    pthread_t watcher;
+    file_shard_t shards[FILE_CACHE_SHARDS];
+} g_cache = { .inotify_fd = -1 };
+
+/*** helpers ***/
+
+static unsigned long hash_name(char const* name)
+{
+    unsigned long h = 1469598103934665603UL; // FNV-1a
+    for (; *name; ++name) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static time_t now_coarse(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/* names stay inside the directory: no absolute paths, no ".." segments */
+int file_cache_name_is_safe(char const* name)
+{
+    if (name[0] == '\0' || name[0] == '/')
+        return 0;
+    for (char const* p = name; *p; ++p) {
+        if ((p == name || p[-1] == '/') && p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+    }
+    return 1;
+}
+
+static char const* content_type_of(char const* name)
+{
+    static struct {
+        char const* ext;
+        char const* type;
+    } const types[] = {
+        { "html", "text/html" },
+        { "htm", "text/html" },
+        { "txt", "text/plain" },
+        { "css", "text/css" },
+        { "js", "text/javascript" },
+        { "json", "application/json" },
+        { "xml", "application/xml" },
+        { "svg", "image/svg+xml" },
+        { "png", "image/png" },
+        { "jpg", "image/jpeg" },
+        { "jpeg", "image/jpeg" },
+        { "gif", "image/gif" },
+        { "webp", "image/webp" },
+        { "pdf", "application/pdf" },
+        { "gz", "application/gzip" },
+        { "zip", "application/zip" },
+        { "zst", "application/zstd" },
+    };
+    char const* const p_dot = strrchr(name, '.');
+    if (p_dot != NULL && strchr(p_dot, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+            if (strcasecmp(p_dot + 1, types[i].ext) == 0)
+                return types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+static file_shard_t* shard_of(unsigned long hash)
+{
+    return &g_cache.shards[(hash >> 56) % FILE_CACHE_SHARDS];
+}
+
+static void entry_release(file_entry_t* e)
+{
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (int i = 0; i < FILE_VARIANTS; ++i) {
+            if (e->variants[i] != NULL) {
+                __atomic_sub_fetch(&g_cache.variant_bytes, e->variants[i]->len, __ATOMIC_RELAXED);
+                free(e->variants[i]);
+            }
+        }
+        if (e->fd != -1)
+            close(e->fd);
+        free(e);
+    }
+}
+
+/*** shard ops, lock held ***/
+
+static void lru_unlink(file_shard_t* s, file_entry_t* e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        s->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        s->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(file_shard_t* s, file_entry_t* e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = s->lru_head;
+    if (s->lru_head)
+        s->lru_head->lru_prev = e;
+    s->lru_head = e;
+    if (s->lru_tail == NULL)
+        s->lru_tail = e;
+}
+
+static file_entry_t* shard_find(file_shard_t* s, char const* name, unsigned long hash)
+{
+    for (file_entry_t* e = s->buckets[hash & s->mask]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->name, name) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/* unindex e and drop the cache's reference */
+static void shard_remove(file_shard_t* s, file_entry_t* e)
+{
+    file_entry_t** pp = &s->buckets[e->hash & s->mask];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(s, e);
+    --s->count;
+    entry_release(e);
+}
+
+/*** lookup ***/
+
+/*
+ * entry for name, NULL when there is no such regular file; with
+ * remember_absent that answer is an entry too (fd -1) when name does not
+ * exist at all, and NULL only for other failures
+ */
+static file_entry_t* entry_open(char const* name, unsigned long hash, int remember_absent)
+{
+    size_t const dir_len = strlen(g_cache.dir_path);
+    size_t const name_len = strlen(name);
+    if (dir_len + name_len >= PATH_MAX)
+        return NULL;
+    char sz_full_path[PATH_MAX];
+    memcpy(sz_full_path, g_cache.dir_path, dir_len);
+    memcpy(sz_full_path + dir_len, name, name_len + 1);
+
+    struct stat st = { 0 };
+    int fd = open(sz_full_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (!remember_absent || (errno != ENOENT && errno != ENOTDIR))
+            return NULL;
+    } else if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    file_entry_t* e = malloc(sizeof(file_entry_t) + name_len + 1);
+    if (e == NULL) {
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    *e = (file_entry_t) {
+        .fd = fd,
+        .size = st.st_size,
+        .mtime = st.st_mtim,
+        .ino = st.st_ino,
+        .content_type = content_type_of(name),
+        .hash = hash,
+        .checked = now_coarse(),
+        .refs = 1,
+    };
+    memcpy(e->name, name, name_len + 1);
+    // a rewrite in place changes the mtime, a replacement by rename() the inode
+    unsigned long long const mtime_ns = (unsigned long long)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    snprintf(e->etag, sizeof(e->etag), "\"%lx-%zx-%llx\"", (unsigned long)st.st_ino, e->size, mtime_ns);
+    http_date_format(e->last_modified, st.st_mtim.tv_sec);
+    return e;
+}
+
+/* without inotify, make sure the path still names the file we hold open (or still nothing) */
+static int entry_still_valid(file_entry_t* e)
+{
+    if (g_cache.inotify_fd != -1 && strchr(e->name, '/') == NULL)
+        return 1;
+    time_t const now = now_coarse();
+    if (now - e->checked < FILE_CACHE_TTL)
+        return 1;
+
+    char sz_full_path[PATH_MAX];
+    if (snprintf(sz_full_path, sizeof(sz_full_path), "%s%s", g_cache.dir_path, e->name) >= (int)sizeof(sz_full_path))
+        return 0;
+    struct stat st;
+    int const exists = stat(sz_full_path, &st) == 0;
+    if (e->fd == -1) {
+        // remembered as absent
+        if (exists)
+            return 0;
+    } else if (!exists || st.st_ino != e->ino || (size_t)st.st_size != e->size
+        || st.st_mtim.tv_sec != e->mtime.tv_sec || st.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+        return 0;
+    }
+    e->checked = now;
+    return 1;
+}
+
+/* file_cache_get(), file_cache_probe() with remember_absent */
+static file_entry_t* cache_get(char const* name, int remember_absent)
+{
+    if (g_cache.dir_path == NULL || !file_cache_name_is_safe(name))
+        return NULL;
+
+    unsigned long const hash = hash_name(name);
+    if (g_cache.capacity == 0)
+        return entry_open(name, hash, 0);
+
+    file_shard_t* s = shard_of(hash);
+    pthread_mutex_lock(&s->lock);
+    file_entry_t* e = shard_find(s, name, hash);
+    if (e != NULL) {
+        if (entry_still_valid(e)) {
+            lru_unlink(s, e);
+            lru_push_front(s, e);
+            if (e->fd == -1) {
+                pthread_mutex_unlock(&s->lock);
+                return NULL;
+            }
+            __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&s->lock);
+            return e;
+        }
+        shard_remove(s, e);
+    }
+    unsigned long const gen = s->gen;
+    pthread_mutex_unlock(&s->lock);
+
+    // miss: open outside the lock
+    e = entry_open(name, hash, remember_absent);
+    if (e == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&s->lock);
+    file_entry_t* other = shard_find(s, name, hash);
+    if (other != NULL) {
+        // somebody raced us here, keep theirs
+        if (other->fd != -1)
+            __atomic_add_fetch(&other->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&s->lock);
+        entry_release(e);
+        return other->fd != -1 ? other : NULL;
+    }
+    if (gen != s->gen) {
+        // invalidated while we opened it, hand it out uncached
+        pthread_mutex_unlock(&s->lock);
+        if (e->fd == -1) {
+            entry_release(e);
+            return NULL;
+        }
+        return e;
+    }
+    // the cache's and the caller's, an absent file only has the cache's
+    int const absent = e->fd == -1;
+    e->refs = absent ? 1 : 2;
+    file_entry_t** bucket = &s->buckets[hash & s->mask];
+    e->hnext = *bucket;
+    *bucket = e;
+    lru_push_front(s, e);
+    ++s->count;
+    while (s->count > s->capacity)
+        shard_remove(s, s->lru_tail);
+    pthread_mutex_unlock(&s->lock);
+    return absent ? NULL : e;
+}
+
+file_entry_t* file_cache_get(char const* name)
+{
+    return cache_get(name, 0);
+}
+
+file_entry_t* file_cache_probe(char const* name)
+{
+    return cache_get(name, 1);
+}
+
+void file_cache_ref(file_entry_t* e)
+{
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+}
+
+void file_cache_put(void* entry)
+{
+    if (entry != NULL)
+        entry_release(entry);
+}
+
+file_variant_t const* file_cache_variant(file_entry_t* e, int i)
+{
+    return __atomic_load_n(&e->variants[i], __ATOMIC_ACQUIRE);
+}
+
+file_variant_t const* file_cache_set_variant(file_entry_t* e, int i, file_variant_t* v)
+{
+    if (__atomic_add_fetch(&g_cache.variant_bytes, v->len, __ATOMIC_RELAXED) > VARIANT_CACHE_BYTES) {
+        __atomic_sub_fetch(&g_cache.variant_bytes, v->len, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    file_variant_t* expected = NULL;
+    if (!__atomic_compare_exchange_n(&e->variants[i], &expected, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_sub_fetch(&g_cache.variant_bytes, v->len, __ATOMIC_RELAXED);
+        free(v);
+        return expected;
+    }
+    return v;
+}
+
+void file_cache_invalidate(char const* name)
+{
+    if (g_cache.capacity == 0)
+        return;
+    unsigned long const hash = hash_name(name);
+    file_shard_t* s = shard_of(hash);
+    pthread_mutex_lock(&s->lock);
+    ++s->gen;
+    file_entry_t* e = shard_find(s, name, hash);
+    if (e != NULL)
+        shard_remove(s, e);
+    pthread_mutex_unlock(&s->lock);
+}
+
+char* file_cache_snapshot(size_t* p_len)
+{
+    char* text = NULL;
+    FILE* out = open_memstream(&text, p_len);
+    if (out == NULL)
+        return NULL;
+    for (int i = 0; g_cache.capacity != 0 && i < FILE_CACHE_SHARDS; ++i) {
+        file_shard_t* s = &g_cache.shards[i];
+        pthread_mutex_lock(&s->lock);
+        for (file_entry_t* e = s->lru_tail; e != NULL; e = e->lru_prev) {
+            if (e->fd == -1)
+                continue;
+            unsigned mask = 0;
+            for (int v = 0; v < FILE_VARIANTS; ++v) {
+                if (file_cache_variant(e, v) != NULL)
+                    mask |= 1u << v;
+            }
+            fprintf(out, "%x %s\n", mask, e->name);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static void file_cache_invalidate_all(void)
+{
+    for (int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        file_shard_t* s = &g_cache.shards[i];
+        pthread_mutex_lock(&s->lock);
+        ++s->gen;
+        while (s->lru_head != NULL)
+            shard_remove(s, s->lru_head);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/*** inotify ***/
+
+static void* file_cache_watch(void* arg)
+{
+    (void)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(g_cache.inotify_fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (char* p = buf; p < buf + n;) {
+            struct inotify_event const* ev = (struct inotify_event const*)p;
+            if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED)) {
+                file_cache_invalidate_all();
+            } else if (ev->len > 0) {
+                file_cache_invalidate(ev->name);
+            }
+            if (ev->mask & IN_IGNORED) {
+                // directory is gone, nothing tells us about changes any more
+                LOG_WARNING("[file_cache] inotify watch lost, fall back to stat checks");
+                __atomic_store_n(&g_cache.inotify_fd, -1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+static void file_cache_start_watch(void)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1) {
+        LOG_WARNING("[file_cache] inotify unavailable (%s), fall back to stat checks", strerror(errno));
+        return;
+    }
+    uint32_t const mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    if (inotify_add_watch(fd, g_cache.dir_path, mask) == -1) {
+        LOG_WARNING("[file_cache] inotify_add_watch failed (%s), fall back to stat checks", strerror(errno));
+        close(fd);
+        return;
+    }
+    g_cache.inotify_fd = fd;
+    if (pthread_create(&g_cache.watcher, NULL, file_cache_watch, NULL) != 0) {
+        LOG_WARNING("[file_cache] watcher thread failed, fall back to stat checks");
+        g_cache.inotify_fd = -1;
+        close(fd);
+        return;
+    }
+    pthread_detach(g_cache.watcher);
+}
+
+/*** lifetime ***/
+
+int file_cache_init(char const* dir_path, size_t capacity)
+{
+    g_cache.dir_path = strdup(dir_path);
+    if (g_cache.dir_path == NULL)
+        return -1;
+    g_cache.capacity = capacity;
+    if (capacity == 0)
+        return 0;
+
+    size_t per_shard = (capacity + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS;
+    size_t nbuckets = 16;
+    while (nbuckets < per_shard * 2)
+        nbuckets <<= 1;
+    for (int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        file_shard_t* s = &g_cache.shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->buckets = calloc(nbuckets, sizeof(file_entry_t*));
+        if (s->buckets == NULL) {
+            LOG_ERROR("[file_cache_init] calloc for buckets failed!");
+            return -1;
+        }
+        s->mask = nbuckets - 1;
+        s->capacity = per_shard;
+    }
+
+    file_cache_start_watch();
+    return 0;
+}
+
+void file_cache_destroy(void)
+{
+    if (g_cache.capacity != 0) {
+        file_cache_invalidate_all();
+        for (int i = 0; i < FILE_CACHE_SHARDS; ++i)
+            free(g_cache.shards[i].buckets);
+    }
+    free(g_cache.dir_path);
+    g_cache.dir_path = NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "validator.h"
+
+#define FILE_CACHE_CAPACITY 512
+/* a quoted entity-tag of three hex numbers and a suffix */
+#define FILE_ETAG_SIZE 64
+/* memory all cached variants may take together */
+#define VARIANT_CACHE_BYTES (64 * 1024 * 1024)
+/* encoded copies one entry can hold, the caller numbers them (one per content coding) */
+#define FILE_VARIANTS 4
+
+/* encoded copy of a file, lives as long as its entry */
+typedef struct {
+    size_t len;
+    unsigned char data[];
+} file_variant_t;
+
+/*
+ * One open file of the --directory store. Entries are reference counted:
+ * the cache holds one reference while the entry is indexed, every caller
+ * of file_cache_get() holds another until file_cache_put(). The fd stays
+ * open as long as someone holds the entry, so in-flight sendfile()s are
+ * not disturbed by eviction or invalidation.
+ */
+typedef struct file_entry_t {
+    int fd; /* -1 for a name file_cache_probe() found absent, never handed out */
+    size_t size;
+    struct timespec mtime;
+    ino_t ino;
+    char const* content_type;
+    char etag[FILE_ETAG_SIZE]; /* strong tag of the content as stored, from inode, size and mtime */
+    char last_modified[HTTP_DATE_SIZE];
+    file_variant_t* variants[FILE_VARIANTS]; /* each set once by file_cache_set_variant() */
+
+    /* cache private */
+    struct file_entry_t* hnext;
+    struct file_entry_t* lru_prev;
+    struct file_entry_t* lru_next;
+    unsigned long hash;
+    time_t checked;
+    int refs;
+    char name[];
+} file_entry_t;
+
+/* 0 on success; capacity 0 disables caching, every get opens the file */
+int file_cache_init(char const* dir_path, size_t capacity);
+void file_cache_destroy(void);
+
+/* 0 for absolute names and names with a `..` segment, which may leave the directory */
+int file_cache_name_is_safe(char const* name);
+
+/* referenced entry for name (relative to the directory), NULL if there is no such regular file */
+file_entry_t* file_cache_get(char const* name);
+
+/*
+ * file_cache_get() for names that mostly don't exist, like precompressed
+ * siblings: their absence is cached too, until the name is invalidated
+ */
+file_entry_t* file_cache_probe(char const* name);
+
+/* take another reference on an entry already held */
+void file_cache_ref(file_entry_t* e);
+
+/* drop a reference; void* so it can be a conn_sendfile() release callback */
+void file_cache_put(void* entry);
+
+/* cached variant number i of e, NULL when none was built yet */
+file_variant_t const* file_cache_variant(file_entry_t* e, int i);
+
+/*
+ * attach a freshly encoded variant number i (malloc'ed, ownership moves to
+ * the cache). Returns the variant to serve, which is another thread's if
+ * it won the race, or NULL when VARIANT_CACHE_BYTES is used up (v is left
+ * to the caller).
+ */
+file_variant_t const* file_cache_set_variant(file_entry_t* e, int i, file_variant_t* v);
+
+/* forget name, the next get opens it again */
+void file_cache_invalidate(char const* name);
+
+/*
+ * the cached names, one "<mask> <name>\n" line each, mask in hex with bit
+ * i set when variant i is built; least recently used first within a shard,
+ * so getting them in order rebuilds the LRU; malloc'ed, NULL on failure
+ */
+char* file_cache_snapshot(size_t* p_len);
+
+#endif // FILE_CACHE_H
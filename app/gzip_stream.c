@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+
+#include "gzip_stream.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "log.h"
+#include "metrics.h"
+
+/* "<hex size>\r\n" in front of a chunk, 32 bit sizes at most */
+#define CHUNK_HEAD_MAX 10
+/* "\r\n" behind a chunk, plus the last-chunk "0\r\n\r\n" */
+#define CHUNK_TAIL_MAX 7
+/* one block plus what deflate adds to it when the data does not compress */
+#define CHUNK_BUF_SIZE (CHUNK_HEAD_MAX + GZIP_STREAM_BLOCK + 64 + CHUNK_TAIL_MAX)
+
+struct gzip_stream_t {
+    z_stream* zs; /* pooled, see compress_stream_get() */
+    int file_fd; /* -1: the input is the copy in in[] */
+    off_t off; /* next input byte to hand to deflate */
+    size_t left; /* input bytes not handed to deflate yet */
+    int pending; /* deflate filled the chunk, call it again with the same flush */
+    int done;
+    void (*release)(void*);
+    void* release_arg;
+    unsigned char in[]; /* GZIP_STREAM_BLOCK read buffer, or the whole input */
+};
+
+gzip_stream_t* gzip_stream_new(int file_fd, void const* data, size_t size, int level,
+    void (*release)(void*), void* release_arg)
+{
+    gzip_stream_t* gs = malloc(sizeof(gzip_stream_t) + (file_fd != -1 ? GZIP_STREAM_BLOCK : size));
+    if (gs == NULL) {
+        LOG_ERROR("[gzip_stream_new] malloc for gzip_stream_t failed!");
+        return NULL;
+    }
+    gs->zs = compress_stream_get(level);
+    if (gs->zs == NULL) {
+        LOG_ERROR("[gzip_stream_new] no deflate stream");
+        free(gs);
+        return NULL;
+    }
+    gs->file_fd = file_fd;
+    gs->off = 0;
+    gs->left = size;
+    gs->pending = 0;
+    gs->done = 0;
+    gs->release = release;
+    gs->release_arg = release_arg;
+    if (file_fd == -1)
+        memcpy(gs->in, data, size);
+    return gs;
+}
+
+void gzip_stream_free(void* arg)
+{
+    gzip_stream_t* gs = arg;
+    if (gs == NULL)
+        return;
+    compress_stream_put(gs->zs);
+    if (gs->release != NULL)
+        gs->release(gs->release_arg);
+    free(gs);
+}
+
+/* hand the next block of input to deflate, 0 or -1 */
+static int gzip_stream_next_block(gzip_stream_t* gs)
+{
+    size_t const n = gs->left < GZIP_STREAM_BLOCK ? gs->left : GZIP_STREAM_BLOCK;
+
+    if (gs->file_fd == -1) {
+        gs->zs->next_in = gs->in + gs->off;
+    } else {
+        size_t got = 0;
+        while (got < n) {
+            ssize_t r = pread(gs->file_fd, gs->in + got, n - got, gs->off + got);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                // the file shrank or broke, the client sees a truncated stream
+                LOG_ERROR("[gzip_stream] read failed: %s", r == 0 ? "unexpected end of file" : strerror(errno));
+                return -1;
+            }
+            got += r;
+        }
+        gs->zs->next_in = gs->in;
+    }
+    gs->zs->avail_in = n;
+    gs->off += n;
+    gs->left -= n;
+    return 0;
+}
+
+/* conn_fill_fn: one chunk, the last one carries the terminating zero-size chunk */
+static ssize_t gzip_stream_fill(void* arg, char* buf, size_t cap)
+{
+    gzip_stream_t* gs = arg;
+    if (gs->done)
+        return 0;
+
+    char* const p_data = buf + CHUNK_HEAD_MAX;
+    gs->zs->next_out = (Bytef*)p_data;
+    gs->zs->avail_out = cap - CHUNK_HEAD_MAX - CHUNK_TAIL_MAX;
+
+    while (1) {
+        if (gs->zs->avail_in == 0 && !gs->pending && gs->left > 0) {
+            if (gzip_stream_next_block(gs) != 0)
+                return -1;
+        }
+        // every block is flushed so the client can start inflating right away
+        uint64_t const t_beg = metrics_now_ns();
+        int const status = deflate(gs->zs, gs->left == 0 ? Z_FINISH : Z_SYNC_FLUSH);
+        metrics_record(METRIC_COMPRESS, metrics_now_ns() - t_beg);
+        if (status == Z_STREAM_END) {
+            gs->done = 1;
+            break;
+        }
+        if (status != Z_OK && status != Z_BUF_ERROR) {
+            LOG_ERROR("[gzip_stream] deflate failed: %d", status);
+            return -1;
+        }
+        gs->pending = gs->zs->avail_out == 0;
+        if (gs->pending || (gs->zs->avail_in == 0 && (char*)gs->zs->next_out > p_data))
+            break;
+    }
+
+    size_t const data_len = (char*)gs->zs->next_out - p_data;
+    size_t len = 0;
+    if (data_len > 0) {
+        char sz_head[2 * sizeof(size_t) + 3];
+        int const head_len = sprintf(sz_head, "%zx\r\n", data_len);
+        memcpy(buf, sz_head, head_len);
+        memmove(buf + head_len, p_data, data_len);
+        memcpy(buf + head_len + data_len, "\r\n", 2);
+        len = head_len + data_len + 2;
+    }
+    if (gs->done) {
+        memcpy(buf + len, "0\r\n\r\n", 5);
+        len += 5;
+    }
+    return len;
+}
+
+int gzip_stream_queue(conn_t* c, gzip_stream_t* gs)
+{
+    return conn_stream(c, gzip_stream_fill, CHUNK_BUF_SIZE, gzip_stream_free, gs);
+}
@@ -0,0 +1,31 @@
+#ifndef GZIP_STREAM_H
+#define GZIP_STREAM_H
+
+#include <stddef.h>
+
+#include "conn.h"
+
+/* input fed to deflate() per Z_SYNC_FLUSH, each block leaves as one chunk */
+#define GZIP_STREAM_BLOCK (16 * 1024)
+
+typedef struct gzip_stream_t gzip_stream_t;
+
+/*
+ * gzip encoder over size bytes of file_fd (read with pread from offset 0),
+ * or over a copy of data when file_fd is -1. release(release_arg) runs
+ * when the stream is freed, e.g. to drop the file cache entry owning the
+ * fd. NULL on failure, release is not called then.
+ */
+gzip_stream_t* gzip_stream_new(int file_fd, void const* data, size_t size, int level,
+    void (*release)(void*), void* release_arg);
+
+/*
+ * queue the stream as a Transfer-Encoding: chunked body behind whatever
+ * was written to c before, the connection owns gs from now on
+ */
+int gzip_stream_queue(conn_t* c, gzip_stream_t* gs);
+
+/* free a stream that was never queued */
+void gzip_stream_free(void* gs);
+
+#endif // GZIP_STREAM_H
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+
+#include "handoff.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define HANDOFF_MAGIC 0x48414e44u /* "HAND" */
+#define HANDOFF_ACK 'k'
+
+/* leads the first message, the fds ride along with it, the snapshot follows */
+typedef struct {
+    uint32_t magic;
+    uint32_t num_fds;
+    uint64_t snapshot_len;
+} handoff_hdr_t;
+
+typedef union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+} handoff_control_t;
+
+static struct {
+    int fd;
+    handoff_fds_fn list_fds;
+    handoff_snapshot_fn snapshot;
+    void (*on_handoff)(void);
+} g_handoff = { .fd = -1 };
+
+/*** helpers ***/
+
+static int unix_addr(char const* path, struct sockaddr_un* addr)
+{
+    size_t const len = strlen(path);
+    if (len >= sizeof(addr->sun_path)) {
+        LOG_ERROR("[handoff] socket path too long: %s", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+    return 0;
+}
+
+static int write_all(int fd, void const* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t const n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (char const*)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t const n = recv(fd, buf, len, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (char*)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*** new process ***/
+
+int handoff_receive(char const* path, handoff_t* h)
+{
+    h->num_fds = 0;
+    h->snapshot = NULL;
+    h->snapshot_len = 0;
+    h->ctl_fd = -1;
+
+    struct sockaddr_un addr;
+    if (unix_addr(path, &addr) != 0)
+        return -1;
+    h->ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (h->ctl_fd == -1) {
+        LOG_ERROR("[handoff] socket failed: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(h->ctl_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        // nobody to take over from, or the file of one that died
+        LOG_INFO("[handoff] no server on %s, start fresh", path);
+        goto HANDLE_ERROR;
+    }
+
+    handoff_hdr_t hdr;
+    handoff_control_t control;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n;
+    do {
+        n = recvmsg(h->ctl_fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    // whatever else is wrong, the fds that came must not leak
+    if (n > 0) {
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (num > (size_t)(HANDOFF_MAX_FDS - h->num_fds))
+                num = HANDOFF_MAX_FDS - h->num_fds;
+            memcpy(h->fds + h->num_fds, CMSG_DATA(cmsg), num * sizeof(int));
+            h->num_fds += num;
+        }
+    }
+    if (n != sizeof(hdr) || hdr.magic != HANDOFF_MAGIC || hdr.num_fds != (uint32_t)h->num_fds
+        || h->num_fds == 0 || (msg.msg_flags & MSG_CTRUNC)) {
+        LOG_ERROR("[handoff] no usable handoff from %s", path);
+        goto HANDLE_ERROR;
+    }
+
+    if (hdr.snapshot_len > 0) {
+        h->snapshot = malloc(hdr.snapshot_len + 1);
+        if (h->snapshot == NULL || read_all(h->ctl_fd, h->snapshot, hdr.snapshot_len) != 0) {
+            LOG_ERROR("[handoff] hot file snapshot lost");
+            goto HANDLE_ERROR;
+        }
+        h->snapshot[hdr.snapshot_len] = '\0';
+        h->snapshot_len = hdr.snapshot_len;
+    }
+    LOG_INFO("[handoff] took over %d listener(s), %zu bytes of hot files", h->num_fds, h->snapshot_len);
+    return 0;
+
+HANDLE_ERROR:
+    for (int i = 0; i < h->num_fds; ++i)
+        close(h->fds[i]);
+    h->num_fds = 0;
+    free(h->snapshot);
+    h->snapshot = NULL;
+    h->snapshot_len = 0;
+    close(h->ctl_fd);
+    h->ctl_fd = -1;
+    return -1;
+}
+
+void handoff_done(handoff_t* h)
+{
+    char const ack = HANDOFF_ACK;
+    if (write_all(h->ctl_fd, &ack, 1) != 0)
+        LOG_WARNING("[handoff] the old process is gone already");
+    close(h->ctl_fd);
+    h->ctl_fd = -1;
+    free(h->snapshot);
+    h->snapshot = NULL;
+    h->snapshot_len = 0;
+}
+
+/*** old process ***/
+
+/* hand everything to the process on ctl_fd, 1 once it confirmed it serves */
+static int handoff_send(int ctl_fd)
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(ctl_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != geteuid()) {
+        LOG_WARNING("[handoff] upgrade by another user refused");
+        return 0;
+    }
+
+    int fds[HANDOFF_MAX_FDS];
+    int const num = g_handoff.list_fds(fds, HANDOFF_MAX_FDS);
+    if (num <= 0) {
+        LOG_WARNING("[handoff] no listener to hand over yet");
+        return 0;
+    }
+    size_t snapshot_len = 0;
+    char* snapshot = g_handoff.snapshot != NULL ? g_handoff.snapshot(&snapshot_len) : NULL;
+    if (snapshot == NULL)
+        snapshot_len = 0;
+
+    handoff_hdr_t hdr = { .magic = HANDOFF_MAGIC, .num_fds = num, .snapshot_len = snapshot_len };
+    handoff_control_t control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * num),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num);
+
+    int taken = 0;
+    ssize_t n;
+    do {
+        n = sendmsg(ctl_fd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n != sizeof(hdr) || write_all(ctl_fd, snapshot, snapshot_len) != 0) {
+        LOG_WARNING("[handoff] sending to the new process failed");
+        goto SAFE_RETURN;
+    }
+
+    // both accept until the new process is warm, without its word this one goes on alone
+    struct timeval tv = { .tv_sec = HANDOFF_ACK_TIMEOUT_SEC };
+    setsockopt(ctl_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char ack = 0;
+    if (read_all(ctl_fd, &ack, 1) == 0 && ack == HANDOFF_ACK) {
+        taken = 1;
+    } else {
+        LOG_WARNING("[handoff] the new process did not take over, keep serving");
+    }
+
+SAFE_RETURN:
+    free(snapshot);
+    return taken;
+}
+
+static void* handoff_serve(void* arg)
+{
+    (void)arg;
+    while (1) {
+        int const ctl_fd = accept4(g_handoff.fd, NULL, NULL, SOCK_CLOEXEC);
+        if (ctl_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            LOG_ERROR("[handoff] accept failed: %s", strerror(errno));
+            return NULL;
+        }
+        int const taken = handoff_send(ctl_fd);
+        close(ctl_fd);
+        if (taken) {
+            // the path is the new process's now, it bound its own socket there
+            close(g_handoff.fd);
+            g_handoff.fd = -1;
+            LOG_INFO("[handoff] the new process took over, drain");
+            g_handoff.on_handoff();
+            return NULL;
+        }
+    }
+}
+
+int handoff_listen(char const* path, handoff_fds_fn list_fds, handoff_snapshot_fn snapshot, void (*on_handoff)(void))
+{
+    struct sockaddr_un addr;
+    if (unix_addr(path, &addr) != 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        LOG_ERROR("[handoff] socket failed: %s", strerror(errno));
+        return -1;
+    }
+    // left by a process that died, or by the one just taken over from
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        LOG_ERROR("[handoff] bind %s failed: %s", path, strerror(errno));
+        goto HANDLE_ERROR;
+    }
+    // the listeners are only for our own user, SO_PEERCRED checks again
+    chmod(path, S_IRUSR | S_IWUSR);
+    if (listen(fd, 4) != 0) {
+        LOG_ERROR("[handoff] listen failed: %s", strerror(errno));
+        goto HANDLE_ERROR;
+    }
+
+    g_handoff.fd = fd;
+    g_handoff.list_fds = list_fds;
+    g_handoff.snapshot = snapshot;
+    g_handoff.on_handoff = on_handoff;
+    pthread_t thread;
+    int const err = pthread_create(&thread, NULL, handoff_serve, NULL);
+    if (err != 0) {
+        LOG_ERROR("[handoff] thread creation failed: %s", strerror(err));
+        g_handoff.fd = -1;
+        goto HANDLE_ERROR;
+    }
+    pthread_detach(thread);
+    LOG_INFO("[handoff] upgrades on %s", path);
+    return 0;
+
+HANDLE_ERROR:
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,45 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+
+/* most listening sockets one upgrade carries, one per shard */
+#define HANDOFF_MAX_FDS 32
+/* how long a new process may take from getting the listeners to confirming it serves */
+#define HANDOFF_ACK_TIMEOUT_SEC 60
+
+/*
+ * Graceful upgrade over a Unix socket. The running server waits on it with
+ * handoff_listen(); a new process started with the same path gets the
+ * listening sockets (SCM_RIGHTS) and a snapshot of the hot files from it
+ * with handoff_receive(), warms up, and confirms with handoff_done(). Only
+ * then the old process stops accepting: both hold the same sockets, so the
+ * listen queue is never dropped and no connection is refused meanwhile.
+ */
+typedef struct {
+    int fds[HANDOFF_MAX_FDS];
+    int num_fds;
+    char* snapshot; /* malloc'ed and NUL-terminated, NULL when none came */
+    size_t snapshot_len;
+    int ctl_fd; /* the old process waits on it for handoff_done() */
+} handoff_t;
+
+/* 0 with h filled when a server on path handed its listeners over, -1 when none did */
+int handoff_receive(char const* path, handoff_t* h);
+
+/* let the old process drain, the snapshot is freed, the fds stay */
+void handoff_done(handoff_t* h);
+
+/* fills fds[max] with the listening sockets to hand over, returns their count */
+typedef int (*handoff_fds_fn)(int* fds, int max);
+/* hot file list to hand over, malloc'ed, NULL for none */
+typedef char* (*handoff_snapshot_fn)(size_t* p_len);
+
+/*
+ * serve upgrades on path from a detached thread; once a new process
+ * confirmed, on_handoff() is called on that thread, it is expected to
+ * drain and end the process
+ */
+int handoff_listen(char const* path, handoff_fds_fn list_fds, handoff_snapshot_fn snapshot, void (*on_handoff)(void));
+
+#endif // HANDOFF_H
@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+
+#include "http_header.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+
+#define HEADER_SLOT_BITS 6
+#define HEADER_SLOTS (1u << HEADER_SLOT_BITS)
+
+static char const* const g_header_names[HTTP_HEADER_ENUM_LENGTH] = {
+    [HTTP_HEADER_HOST] = "Host",
+    [HTTP_HEADER_USER_AGENT] = "User-Agent",
+    [HTTP_HEADER_ACCEPT] = "Accept",
+    [HTTP_HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+    [HTTP_HEADER_CONTENT_TYPE] = "Content-Type",
+    [HTTP_HEADER_CONTENT_LENGTH] = "Content-Length",
+    [HTTP_HEADER_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [HTTP_HEADER_CONNECTION] = "Connection",
+    [HTTP_HEADER_RANGE] = "Range",
+    [HTTP_HEADER_IF_RANGE] = "If-Range",
+    [HTTP_HEADER_IF_NONE_MATCH] = "If-None-Match",
+    [HTTP_HEADER_IF_MODIFIED_SINCE] = "If-Modified-Since",
+};
+
+static struct {
+    pthread_once_t once;
+    uint32_t mul; /* odd multiplier that spreads the names without collision */
+    unsigned char slots[HEADER_SLOTS]; /* HTTP_HEADER by hash, HTTP_HEADER_UNKNOWN when empty */
+    unsigned char lens[HTTP_HEADER_ENUM_LENGTH];
+} g_header = { .once = PTHREAD_ONCE_INIT };
+
+/* length, first, middle and last byte, case folded */
+static inline uint32_t header_key(char const* name, size_t len)
+{
+    return (uint32_t)len | (uint32_t)(name[0] | 0x20) << 8 | (uint32_t)(name[len / 2] | 0x20) << 16
+        | (uint32_t)(name[len - 1] | 0x20) << 24;
+}
+
+static inline unsigned header_slot(uint32_t mul, uint32_t key)
+{
+    return (key * mul) >> (32 - HEADER_SLOT_BITS);
+}
+
+static void header_generate(void)
+{
+    uint32_t mul = 0x9e3779b1u;
+    for (int attempt = 0; attempt < 1 << 16; ++attempt, mul = mul * 1664525u + 1013904223u) {
+        mul |= 1;
+        unsigned char slots[HEADER_SLOTS] = { 0 };
+        int id = HTTP_HEADER_UNKNOWN + 1;
+        for (; id < HTTP_HEADER_ENUM_LENGTH; ++id) {
+            char const* const name = g_header_names[id];
+            unsigned const slot = header_slot(mul, header_key(name, strlen(name)));
+            if (slots[slot] != HTTP_HEADER_UNKNOWN)
+                break;
+            slots[slot] = id;
+        }
+        if (id == HTTP_HEADER_ENUM_LENGTH) {
+            g_header.mul = mul;
+            memcpy(g_header.slots, slots, sizeof(slots));
+            for (id = HTTP_HEADER_UNKNOWN + 1; id < HTTP_HEADER_ENUM_LENGTH; ++id)
+                g_header.lens[id] = strlen(g_header_names[id]);
+            return;
+        }
+    }
+    // every lookup misses; only a grown name list can get here, widen HEADER_SLOT_BITS
+    LOG_ERROR("[http_header] no perfect hash for %d names", HTTP_HEADER_ENUM_LENGTH - 1);
+}
+
+int http_header_lookup(char const* name, size_t len)
+{
+    pthread_once(&g_header.once, header_generate);
+    if (len == 0)
+        return HTTP_HEADER_UNKNOWN;
+    int const id = g_header.slots[header_slot(g_header.mul, header_key(name, len))];
+    if (g_header.lens[id] != len || strncasecmp(name, g_header_names[id], len) != 0)
+        return HTTP_HEADER_UNKNOWN;
+    return id;
+}
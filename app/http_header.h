@@ -0,0 +1,31 @@
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+#include <stddef.h>
+
+/* header names the server understands, everything else is HTTP_HEADER_UNKNOWN */
+typedef enum {
+    HTTP_HEADER_UNKNOWN,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_ACCEPT,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_ENUM_LENGTH,
+} HTTP_HEADER;
+
+/*
+ * Case-insensitive name[0, len) to its HTTP_HEADER: one multiplicative hash
+ * into a collision-free table, which is generated on first use from the
+ * names above, then a single compare.
+ */
+int http_header_lookup(char const* name, size_t len);
+
+#endif // HTTP_HEADER_H
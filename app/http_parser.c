@@ -0,0 +1,122 @@
+#include "http_parser.h"
+
+#include <string.h>
+
+#include "http_header.h"
+
+void http_parser_reset(http_parser_t* p)
+{
+    *p = (http_parser_t) { 0 };
+    p->state = HP_STATE_REQUEST_LINE;
+}
+
+static int parser_fail(http_parser_t* p, int status)
+{
+    p->state = HP_STATE_ERROR;
+    p->error = status;
+    return HTTP_PARSE_ERROR;
+}
+
+/* one header line without its line break, 0 or an HTTP error status */
+static int parser_header_line(http_parser_t* p, char const* line, size_t line_len)
+{
+    char const* const p_colon = memchr(line, ':', line_len);
+    if (p_colon == NULL || p_colon == line)
+        return 400;
+
+    int const header = http_header_lookup(line, p_colon - line);
+    if (header == HTTP_HEADER_CONTENT_LENGTH) {
+        char const* p_val = p_colon + 1;
+        char const* const p_end = line + line_len;
+        while (p_val < p_end && (*p_val == ' ' || *p_val == '\t'))
+            ++p_val;
+        if (p_val == p_end)
+            return 400;
+        size_t value = 0;
+        for (; p_val < p_end && *p_val != ' ' && *p_val != '\t'; ++p_val) {
+            if (*p_val < '0' || *p_val > '9')
+                return 400;
+            value = value * 10 + (*p_val - '0');
+            if (value > MAX_UPLOAD_SIZE)
+                return 413;
+        }
+        // "12 34" is no length, only trailing whitespace may follow
+        while (p_val < p_end && (*p_val == ' ' || *p_val == '\t'))
+            ++p_val;
+        if (p_val != p_end)
+            return 400;
+        // a second, different length leaves the body's end to guesswork
+        if (p->has_content_length && p->content_length != value)
+            return 400;
+        p->content_length = value;
+        p->has_content_length = 1;
+    } else if (header == HTTP_HEADER_TRANSFER_ENCODING) {
+        // chunked request bodies are not supported, refuse rather than misframe
+        return 501;
+    }
+    return 0;
+}
+
+int http_parser_feed(http_parser_t* p, char const* buf, size_t len)
+{
+    if (p->state == HP_STATE_ERROR)
+        return HTTP_PARSE_ERROR;
+    int const had_headers = p->state == HP_STATE_BODY;
+
+    while (p->state == HP_STATE_REQUEST_LINE || p->state == HP_STATE_HEADERS) {
+        // robustness: ignore line breaks left between pipelined requests
+        while (p->state == HP_STATE_REQUEST_LINE && p->pos == p->skip && p->pos < len
+            && (buf[p->pos] == '\r' || buf[p->pos] == '\n')) {
+            p->line_beg = ++p->pos;
+            ++p->skip;
+        }
+
+        char const* const p_nl = memchr(buf + p->pos, '\n', len - p->pos);
+        if (p_nl == NULL) {
+            p->pos = len;
+            if (len - p->skip > MAX_HEADER_SIZE)
+                return parser_fail(p, 431);
+            return HTTP_PARSE_AGAIN;
+        }
+
+        char const* const line = buf + p->line_beg;
+        size_t line_len = p_nl - line;
+        // request lines and headers end in CRLF, a bare LF is refused
+        if (line_len == 0 || line[line_len - 1] != '\r')
+            return parser_fail(p, 400);
+        --line_len;
+        p->pos = p->line_beg = p_nl - buf + 1;
+        if (p->pos - p->skip > MAX_HEADER_SIZE)
+            return parser_fail(p, 431);
+
+        if (p->state == HP_STATE_REQUEST_LINE) {
+            // method SP request-target SP HTTP-version
+            char const* const p_sp = memchr(line, ' ', line_len);
+            if (p_sp == NULL || memchr(p_sp + 1, ' ', line + line_len - p_sp - 1) == NULL)
+                return parser_fail(p, 400);
+            p->state = HP_STATE_HEADERS;
+        } else if (line_len == 0) {
+            p->header_len = p->pos;
+            p->state = HP_STATE_BODY;
+        } else {
+            int const status = parser_header_line(p, line, line_len);
+            if (status != 0)
+                return parser_fail(p, status);
+        }
+    }
+
+    if (p->state == HP_STATE_BODY) {
+        if (len < http_parser_request_len(p)) {
+            p->pos = len;
+            if (!had_headers)
+                return HTTP_PARSE_HEADERS;
+            // nobody took the body over, and it would not fit the receive buffer
+            if (p->content_length > MAX_BODY_SIZE)
+                return parser_fail(p, 413);
+            return HTTP_PARSE_AGAIN;
+        }
+        p->pos = http_parser_request_len(p);
+        p->state = HP_STATE_DONE;
+    }
+    return HTTP_PARSE_DONE;
+}
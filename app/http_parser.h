@@ -0,0 +1,60 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+/* request line plus headers must fit in this many bytes */
+#define MAX_HEADER_SIZE (16 * 1024)
+/* largest Content-Length we agree to buffer */
+#define MAX_BODY_SIZE (16 * 1024 * 1024)
+/* largest Content-Length at all, bodies above MAX_BODY_SIZE have to be streamed */
+#define MAX_UPLOAD_SIZE ((size_t)64 * 1024 * 1024 * 1024)
+
+typedef enum {
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_AGAIN = 0, /* need more bytes */
+    HTTP_PARSE_DONE = 1, /* a whole request is in the buffer */
+    HTTP_PARSE_HEADERS = 2, /* headers just completed, the body did not: the caller may take it over */
+} HTTP_PARSE_STATUS;
+
+typedef enum {
+    HP_STATE_REQUEST_LINE,
+    HP_STATE_HEADERS,
+    HP_STATE_BODY,
+    HP_STATE_DONE,
+    HP_STATE_ERROR,
+} HP_STATE;
+
+/*
+ * Resumable framing of one request. The parser only finds where the request
+ * ends; fields are extracted by parse_request() once the request is complete.
+ * Offsets are relative to the first byte of the current request.
+ */
+typedef struct {
+    int state;
+    size_t pos; /* bytes already scanned */
+    size_t line_beg; /* start of the line being scanned */
+    size_t skip; /* empty lines tolerated in front of the request line */
+    size_t header_len; /* request line + headers + blank line */
+    size_t content_length;
+    int has_content_length; /* a Content-Length was seen, a repeated one must agree */
+    int error; /* HTTP status to answer with on HTTP_PARSE_ERROR */
+} http_parser_t;
+
+void http_parser_reset(http_parser_t* p);
+
+/*
+ * Feed the bytes of the current request seen so far (buf[0, len), always
+ * starting at the same request). Only bytes past the last call are scanned.
+ * HTTP_PARSE_HEADERS is returned once, later calls answer HTTP_PARSE_AGAIN
+ * until the body is complete, or 413 when it can never be buffered.
+ */
+int http_parser_feed(http_parser_t* p, char const* buf, size_t len);
+
+/* total bytes of a finished request, counted from buf[0] */
+static inline size_t http_parser_request_len(http_parser_t const* p)
+{
+    return p->header_len + p->content_length;
+}
+
+#endif // HTTP_PARSER_H
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the flusher collects lines of all rings into one write(2) of up to this */
+#define LOG_BATCH_SIZE (64 * 1024)
+
+/* single producer (the owner thread), single consumer (the flusher) */
+typedef struct log_ring_t {
+    struct log_ring_t* next;
+    unsigned head; /* next line the owner fills, published with release */
+    unsigned tail; /* next line the flusher reads, published with release */
+    unsigned dropped; /* lines lost to a full ring since the last drain */
+    int dead; /* owner thread exited, freed once drained */
+    unsigned short len[LOG_RING_LINES];
+    char lines[LOG_RING_LINES][LOG_LINE_MAX];
+} log_ring_t;
+
+int g_log_level = LOG_LEVEL_WARNING;
+unsigned g_log_access_every = 0;
+
+static struct {
+    int running;
+    pthread_t flusher;
+    sem_t wake;
+    pthread_key_t key; /* only for its destructor, marks the ring of an exiting thread */
+    pthread_mutex_t lock; /* guards rings */
+    log_ring_t* rings;
+    char batch[LOG_BATCH_SIZE];
+    size_t batch_len;
+} g_log = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread log_ring_t* t_ring;
+static __thread unsigned t_access_seq;
+
+static void write_all(char const* p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        p += n;
+        len -= n;
+    }
+}
+
+/*** producer ***/
+
+static void log_ring_release(void* ring)
+{
+    // the thread may still log from later destructors, that gets a new ring
+    t_ring = NULL;
+    __atomic_store_n(&((log_ring_t*)ring)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static log_ring_t* log_ring_self(void)
+{
+    if (t_ring != NULL)
+        return t_ring;
+    log_ring_t* ring = calloc(1, sizeof(log_ring_t));
+    if (ring == NULL)
+        return NULL;
+    pthread_mutex_lock(&g_log.lock);
+    ring->next = g_log.rings;
+    g_log.rings = ring;
+    pthread_mutex_unlock(&g_log.lock);
+    pthread_setspecific(g_log.key, ring);
+    t_ring = ring;
+    return ring;
+}
+
+/* tag, formatted message and '\n' into line (LOG_LINE_MAX bytes), returns the length */
+static size_t log_format(char* line, char const* tag, char const* fmt, va_list ap)
+{
+    size_t const cap = LOG_LINE_MAX - 1; // room for the '\n'
+    size_t len = strlen(tag);
+    memcpy(line, tag, len);
+    int const n = vsnprintf(line + len, cap - len + 1, fmt, ap);
+    if (n > 0) {
+        if ((size_t)n > cap - len) {
+            len = cap;
+            memcpy(line + len - 3, "...", 3);
+        } else {
+            len += n;
+        }
+    }
+    if (line[len - 1] != '\n')
+        line[len++] = '\n';
+    return len;
+}
+
+void log_write(char const* tag, char const* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    log_ring_t* ring = __atomic_load_n(&g_log.running, __ATOMIC_ACQUIRE) ? log_ring_self() : NULL;
+    if (ring == NULL) {
+        char sz_line[LOG_LINE_MAX];
+        size_t const len = log_format(sz_line, tag, fmt, ap);
+        va_end(ap);
+        write_all(sz_line, len);
+        return;
+    }
+
+    unsigned const head = ring->head;
+    unsigned const used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (used == LOG_RING_LINES) {
+        // never wait for the flusher on a request path
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+    unsigned const idx = head % LOG_RING_LINES;
+    ring->len[idx] = log_format(ring->lines[idx], tag, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (used + 1 == LOG_RING_LINES / 2)
+        sem_post(&g_log.wake);
+}
+
+int log_access_sampled(void)
+{
+    return ++t_access_seq % g_log_access_every == 0;
+}
+
+/*** flusher ***/
+
+static void batch_append(char const* p, size_t len)
+{
+    if (g_log.batch_len + len > LOG_BATCH_SIZE) {
+        write_all(g_log.batch, g_log.batch_len);
+        g_log.batch_len = 0;
+    }
+    memcpy(g_log.batch + g_log.batch_len, p, len);
+    g_log.batch_len += len;
+}
+
+static void log_drain(void)
+{
+    pthread_mutex_lock(&g_log.lock);
+    log_ring_t** pp_ring = &g_log.rings;
+    while (*pp_ring != NULL) {
+        log_ring_t* ring = *pp_ring;
+        // dead before head: whatever the owner wrote before exiting is seen now
+        int const dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+        unsigned const head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (unsigned i = ring->tail; i != head; ++i)
+            batch_append(ring->lines[i % LOG_RING_LINES], ring->len[i % LOG_RING_LINES]);
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+        unsigned const dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            char sz_line[64];
+            int const len = snprintf(sz_line, sizeof(sz_line), "[WARNING][log] %u lines dropped\n", dropped);
+            batch_append(sz_line, len);
+        }
+
+        if (dead) {
+            *pp_ring = ring->next;
+            free(ring);
+        } else {
+            pp_ring = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&g_log.lock);
+
+    write_all(g_log.batch, g_log.batch_len);
+    g_log.batch_len = 0;
+}
+
+static void* log_flusher(void* arg)
+{
+    (void)arg;
+    while (__atomic_load_n(&g_log.running, __ATOMIC_ACQUIRE)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+        }
+        sem_timedwait(&g_log.wake, &ts);
+        log_drain();
+    }
+    return NULL;
+}
+
+int log_init(void)
+{
+    if (sem_init(&g_log.wake, 0, 0) != 0)
+        return -1;
+    if (pthread_key_create(&g_log.key, log_ring_release) != 0) {
+        sem_destroy(&g_log.wake);
+        return -1;
+    }
+    __atomic_store_n(&g_log.running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&g_log.flusher, NULL, log_flusher, NULL) != 0) {
+        __atomic_store_n(&g_log.running, 0, __ATOMIC_RELEASE);
+        pthread_key_delete(g_log.key);
+        sem_destroy(&g_log.wake);
+        return -1;
+    }
+    return 0;
+}
+
+void log_shutdown(void)
+{
+    // later lines go straight to stdout, the rings stay for threads still writing;
+    // of two callers (a drain racing a signal) only one joins the flusher
+    if (!__atomic_exchange_n(&g_log.running, 0, __ATOMIC_ACQ_REL))
+        return;
+    sem_post(&g_log.wake);
+    pthread_join(g_log.flusher, NULL);
+    log_drain();
+}
+
+int log_parse_level(char const* name)
+{
+    static char const* const names[] = { "none", "error", "warning", "info", "debug" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strcasecmp(name, names[i]) == 0)
+            return (int)i;
+    }
+    return -1;
+}
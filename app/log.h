@@ -0,0 +1,62 @@
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+/* levels above this are compiled out, e.g. -DLOG_LEVEL_MAX=LOG_LEVEL_WARNING */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+/* per-thread ring, longer lines are cut */
+#define LOG_RING_LINES 256
+#define LOG_LINE_MAX 512
+/* the flusher writes out the rings at least this often */
+#define LOG_FLUSH_MS 100
+
+/* runtime level, lines above it cost one compare */
+extern int g_log_level;
+/* log every n-th request per thread in the access log, 0 turns it off */
+extern unsigned g_log_access_every;
+
+#define LOG_AT(_level, _tag, ...)                                        \
+    do {                                                                 \
+        if ((_level) <= LOG_LEVEL_MAX && (_level) <= g_log_level)        \
+            log_write(_tag, __VA_ARGS__);                                \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, "[ERROR]", __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(LOG_LEVEL_WARNING, "[WARNING]", __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, "[INFO]", __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, "[DEBUG]", __VA_ARGS__)
+
+#define LOG_ACCESS(...)                                                  \
+    do {                                                                 \
+        if (g_log_access_every > 0 && log_access_sampled())              \
+            log_write("[ACCESS]", __VA_ARGS__);                          \
+    } while (0)
+
+/*
+ * Start the flusher thread. From then on every thread formats its lines
+ * into its own lock-free ring and the flusher writes them out in batches;
+ * before (and after log_shutdown()) lines are written to stdout directly.
+ */
+int log_init(void);
+
+/* write out what is buffered and stop the flusher */
+void log_shutdown(void);
+
+/* level by name (none, error, warning, info, debug), -1 when unknown */
+int log_parse_level(char const* name);
+
+/* one line, tag in front and '\n' behind; drops it when the ring is full */
+void log_write(char const* tag, char const* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* 1 for every g_log_access_every-th call on this thread */
+int log_access_sampled(void);
+
+#endif // LOG_H
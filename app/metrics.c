@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum; /* ns */
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_hist_t;
+
+/* everything one thread records, single writer */
+typedef struct metrics_shard_t {
+    uint64_t counters[METRIC_COUNTER_ENUM_LENGTH];
+    metrics_hist_t hists[METRIC_HIST_ENUM_LENGTH];
+    struct metrics_shard_t* next; /* registry, under g_metrics.lock */
+    struct metrics_shard_t* prev;
+} __attribute__((aligned(CACHE_LINE))) metrics_shard_t;
+
+static struct {
+    pthread_mutex_t lock; /* guards shards and retired */
+    pthread_once_t once;
+    pthread_key_t key; /* only for its destructor, folds an exiting thread's shard into retired */
+    metrics_shard_t* shards;
+    metrics_shard_t retired;
+} g_metrics = { .lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+static __thread metrics_shard_t* t_shard;
+
+static char const* const g_counter_names[METRIC_COUNTER_ENUM_LENGTH] = {
+    [METRIC_BYTES_RECEIVED] = "http_received_bytes_total",
+    [METRIC_BYTES_SENT] = "http_sent_bytes_total",
+    [METRIC_SHED_CONNECTIONS] = "http_shed_connections_total",
+    [METRIC_SHED_REQUESTS] = "http_shed_requests_total",
+};
+
+static char const* const g_route_names[METRIC_ROUTE_NONE + 1] = {
+    [METRIC_ROUTE_ROOT] = "/",
+    [METRIC_ROUTE_ECHO] = "/echo/",
+    [METRIC_ROUTE_USER_AGENT] = "/user-agent",
+    [METRIC_ROUTE_FILES] = "/files/",
+    [METRIC_ROUTE_METRICS] = "/metrics",
+    [METRIC_ROUTE_NONE] = "none",
+};
+
+/*** recording ***/
+
+/* *p += n by its only writer, readers may look at any time */
+static inline void add_relaxed(uint64_t* p, uint64_t n)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void shard_merge(metrics_shard_t* into, metrics_shard_t const* from)
+{
+    for (int i = 0; i < METRIC_COUNTER_ENUM_LENGTH; ++i)
+        add_relaxed(&into->counters[i], __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED));
+    for (int h = 0; h < METRIC_HIST_ENUM_LENGTH; ++h) {
+        metrics_hist_t* const dst = &into->hists[h];
+        metrics_hist_t const* const src = &from->hists[h];
+        add_relaxed(&dst->count, __atomic_load_n(&src->count, __ATOMIC_RELAXED));
+        add_relaxed(&dst->sum, __atomic_load_n(&src->sum, __ATOMIC_RELAXED));
+        for (int b = 0; b < METRICS_BUCKETS; ++b)
+            add_relaxed(&dst->buckets[b], __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED));
+    }
+}
+
+static void shard_release(void* arg)
+{
+    metrics_shard_t* shard = arg;
+    t_shard = NULL;
+    pthread_mutex_lock(&g_metrics.lock);
+    shard_merge(&g_metrics.retired, shard);
+    if (shard->prev != NULL)
+        shard->prev->next = shard->next;
+    else
+        g_metrics.shards = shard->next;
+    if (shard->next != NULL)
+        shard->next->prev = shard->prev;
+    pthread_mutex_unlock(&g_metrics.lock);
+    free(shard);
+}
+
+static void metrics_init(void)
+{
+    pthread_key_create(&g_metrics.key, shard_release);
+}
+
+static metrics_shard_t* shard_self(void)
+{
+    if (t_shard != NULL)
+        return t_shard;
+    pthread_once(&g_metrics.once, metrics_init);
+    metrics_shard_t* shard = aligned_alloc(CACHE_LINE, sizeof(metrics_shard_t));
+    if (shard == NULL)
+        return NULL;
+    memset(shard, 0, sizeof(metrics_shard_t));
+    pthread_mutex_lock(&g_metrics.lock);
+    shard->next = g_metrics.shards;
+    if (g_metrics.shards != NULL)
+        g_metrics.shards->prev = shard;
+    g_metrics.shards = shard;
+    pthread_mutex_unlock(&g_metrics.lock);
+    pthread_setspecific(g_metrics.key, shard);
+    t_shard = shard;
+    return shard;
+}
+
+/* log-linear: exact below 2^SUB_BITS, then 2^SUB_BITS buckets per power of two */
+static inline unsigned bucket_of(uint64_t v)
+{
+    if (v < (1u << METRICS_SUB_BITS))
+        return v;
+    unsigned const e = 63 - __builtin_clzll(v);
+    if (e >= METRICS_MAX_BITS)
+        return METRICS_BUCKETS - 1;
+    unsigned const sub = (v >> (e - METRICS_SUB_BITS)) & ((1u << METRICS_SUB_BITS) - 1);
+    return ((e - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+}
+
+/* largest value of bucket b */
+static uint64_t bucket_high(unsigned b)
+{
+    if (b < (1u << METRICS_SUB_BITS))
+        return b;
+    unsigned const e = (b >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    uint64_t const sub = b & ((1u << METRICS_SUB_BITS) - 1);
+    uint64_t const low = ((1ull << METRICS_SUB_BITS) + sub) << (e - METRICS_SUB_BITS);
+    return low + (1ull << (e - METRICS_SUB_BITS)) - 1;
+}
+
+void metrics_count(int counter, uint64_t n)
+{
+    metrics_shard_t* const shard = shard_self();
+    if (shard != NULL)
+        add_relaxed(&shard->counters[counter], n);
+}
+
+void metrics_record(int hist, uint64_t ns)
+{
+    metrics_shard_t* const shard = shard_self();
+    if (shard == NULL)
+        return;
+    metrics_hist_t* const h = &shard->hists[hist];
+    add_relaxed(&h->count, 1);
+    add_relaxed(&h->sum, ns);
+    add_relaxed(&h->buckets[bucket_of(ns)], 1);
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*** exposition ***/
+
+/* smallest bucket bound that at least q of the samples do not exceed, in seconds */
+static double hist_quantile(metrics_hist_t const* h, double q)
+{
+    double const exact_rank = q * h->count;
+    uint64_t rank = (uint64_t)exact_rank;
+    if (rank < exact_rank)
+        ++rank;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < METRICS_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= rank && seen > 0)
+            return bucket_high(b) / 1e9;
+    }
+    return 0;
+}
+
+static void render_summary(FILE* out, char const* label, metrics_hist_t const* h, char const* name)
+{
+    static double const quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+        fprintf(out, "%s{%s%squantile=\"%g\"} ", name, label, *label ? "," : "", quantiles[i]);
+        if (h->count == 0)
+            fprintf(out, "NaN\n");
+        else
+            fprintf(out, "%.9f\n", hist_quantile(h, quantiles[i]));
+    }
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, *label ? "{" : "", label, *label ? "}" : "", h->sum / 1e9);
+    fprintf(out, "%s_count%s%s%s %lu\n", name, *label ? "{" : "", label, *label ? "}" : "", h->count);
+}
+
+char* metrics_render(size_t* p_len)
+{
+    metrics_shard_t* total = aligned_alloc(CACHE_LINE, sizeof(metrics_shard_t));
+    if (total == NULL)
+        return NULL;
+    pthread_mutex_lock(&g_metrics.lock);
+    memcpy(total, &g_metrics.retired, sizeof(metrics_shard_t));
+    for (metrics_shard_t const* shard = g_metrics.shards; shard != NULL; shard = shard->next)
+        shard_merge(total, shard);
+    pthread_mutex_unlock(&g_metrics.lock);
+
+    char* text = NULL;
+    FILE* out = open_memstream(&text, p_len);
+    if (out == NULL) {
+        free(total);
+        return NULL;
+    }
+
+    fprintf(out, "# HELP http_request_duration_seconds From a complete request to its response being queued.\n"
+                 "# TYPE http_request_duration_seconds summary\n");
+    for (int r = 0; r <= METRIC_ROUTE_NONE; ++r) {
+        char label[64];
+        snprintf(label, sizeof(label), "route=\"%s\"", g_route_names[r]);
+        render_summary(out, label, &total->hists[r], "http_request_duration_seconds");
+    }
+    fprintf(out, "# HELP http_parse_duration_seconds Splitting a request into its fields.\n"
+                 "# TYPE http_parse_duration_seconds summary\n");
+    render_summary(out, "", &total->hists[METRIC_PARSE], "http_parse_duration_seconds");
+    fprintf(out, "# HELP http_compress_duration_seconds One gzip call, a whole body or a streamed block.\n"
+                 "# TYPE http_compress_duration_seconds summary\n");
+    render_summary(out, "", &total->hists[METRIC_COMPRESS], "http_compress_duration_seconds");
+    fprintf(out, "# HELP http_queue_duration_seconds From the loop seeing a request's bytes to serving it.\n"
+                 "# TYPE http_queue_duration_seconds summary\n");
+    render_summary(out, "", &total->hists[METRIC_QUEUE], "http_queue_duration_seconds");
+    for (int i = 0; i < METRIC_COUNTER_ENUM_LENGTH; ++i)
+        fprintf(out, "# TYPE %s counter\n%s %lu\n", g_counter_names[i], g_counter_names[i], total->counters[i]);
+
+    free(total);
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
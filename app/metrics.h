@@ -0,0 +1,50 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* linear sub-buckets per power of two, values within 1/16 (6.25%) of a bucket's bounds */
+#define METRICS_SUB_BITS 4
+/* values are nanoseconds, anything from 2^34ns (17s) on lands in the last bucket */
+#define METRICS_MAX_BITS 34
+#define METRICS_BUCKETS (((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS))
+
+typedef enum {
+    METRIC_BYTES_RECEIVED,
+    METRIC_BYTES_SENT,
+    METRIC_SHED_CONNECTIONS, /* refused at accept, too many open */
+    METRIC_SHED_REQUESTS, /* answered 503 by admission control */
+    METRIC_COUNTER_ENUM_LENGTH,
+} METRIC_COUNTER;
+
+/* one latency histogram per route, then the request phases */
+typedef enum {
+    METRIC_ROUTE_ROOT,
+    METRIC_ROUTE_ECHO,
+    METRIC_ROUTE_USER_AGENT,
+    METRIC_ROUTE_FILES,
+    METRIC_ROUTE_METRICS,
+    METRIC_ROUTE_NONE, /* answered 404 without a route */
+    METRIC_PARSE,
+    METRIC_COMPRESS,
+    METRIC_QUEUE, /* from the loop seeing a request's bytes to serving it */
+    METRIC_HIST_ENUM_LENGTH,
+} METRIC_HIST;
+
+/*
+ * Counters and histograms are kept per thread, each set on its own cache
+ * lines and written by its thread only, so recording is a couple of plain
+ * loads and stores. metrics_render() merges all of them (and those of
+ * exited threads) under a lock only a reader ever takes.
+ */
+void metrics_count(int counter, uint64_t n);
+void metrics_record(int hist, uint64_t ns);
+
+/* monotonic clock the durations are taken on */
+uint64_t metrics_now_ns(void);
+
+/* Prometheus text exposition of everything recorded, malloc'ed, NULL on failure */
+char* metrics_render(size_t* p_len);
+
+#endif // METRICS_H
@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+
+#include "range.h"
+
+#include <stdint.h>
+#include <strings.h>
+
+/* digits at *p_cur as a number saturated at SIZE_MAX, -1 when there are none */
+static int parse_pos(char const** p_cur, char const* p_end, size_t* out)
+{
+    char const* p = *p_cur;
+    size_t n = 0;
+    while (p < p_end && *p >= '0' && *p <= '9') {
+        size_t const d = *p - '0';
+        n = n > (SIZE_MAX - d) / 10 ? SIZE_MAX : n * 10 + d;
+        ++p;
+    }
+    if (p == *p_cur)
+        return -1;
+    *p_cur = p;
+    *out = n;
+    return 0;
+}
+
+static char const* skip_ows(char const* p, char const* p_end)
+{
+    while (p < p_end && (*p == ' ' || *p == '\t'))
+        ++p;
+    return p;
+}
+
+int range_parse(char const* value, size_t len, size_t size, byte_range_t* out)
+{
+    char const* p = value;
+    char const* const p_end = value + len;
+    if (len < sizeof("bytes=") - 1 || strncasecmp(p, "bytes", sizeof("bytes") - 1) != 0)
+        return 0;
+    p = skip_ows(p + sizeof("bytes") - 1, p_end);
+    if (p == p_end || *p != '=')
+        return 0;
+
+    int num = 0;
+    int specs = 0;
+    while (p < p_end) {
+        // the list may have empty elements, "bytes=0-1,,2-3"
+        p = skip_ows(p + (*p == '=' || *p == ','), p_end);
+        if (p == p_end)
+            break;
+        if (*p == ',')
+            continue;
+        if (++specs > RANGE_MAX)
+            return 0;
+
+        size_t first, last;
+        if (*p == '-') {
+            // suffix: the last n bytes
+            ++p;
+            if (parse_pos(&p, p_end, &last) != 0)
+                return 0;
+            if (last == 0 || size == 0) {
+                first = SIZE_MAX; // unsatisfiable
+            } else {
+                first = last < size ? size - last : 0;
+                last = size - 1;
+            }
+        } else {
+            if (parse_pos(&p, p_end, &first) != 0 || p == p_end || *p++ != '-')
+                return 0;
+            if (p < p_end && *p >= '0' && *p <= '9') {
+                if (parse_pos(&p, p_end, &last) != 0 || last < first)
+                    return 0;
+            } else {
+                last = SIZE_MAX;
+            }
+            if (last >= size)
+                last = size - 1;
+        }
+        p = skip_ows(p, p_end);
+        if (p < p_end && *p != ',')
+            return 0;
+
+        if (first < size) {
+            out[num].off = first;
+            out[num].len = last - first + 1;
+            ++num;
+        }
+    }
+    if (specs == 0)
+        return 0;
+    return num > 0 ? num : -1;
+}
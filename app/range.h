@@ -0,0 +1,24 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <stddef.h>
+
+/* most ranges one request may ask for, a longer list is ignored (whole file) */
+#define RANGE_MAX 16
+
+/* bytes [off, off + len) of a representation */
+typedef struct {
+    size_t off;
+    size_t len;
+} byte_range_t;
+
+/*
+ * Ranges of a `Range: bytes=...` value against a representation of size
+ * bytes (RFC 9110 14.1.2), clamped to it, in the order they were asked for.
+ * Returns how many were stored in out[RANGE_MAX], 0 when the header is to
+ * be ignored (another unit, malformed, too many ranges) and -1 when none of
+ * them is satisfiable, which is answered with 416.
+ */
+int range_parse(char const* value, size_t len, size_t size, byte_range_t* out);
+
+#endif // RANGE_H
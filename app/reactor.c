@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+
+#include "reactor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "log.h"
+#include "metrics.h"
+
+#define MAX_EVENTS 64
+/* deadline resolution, and how often an otherwise quiet loop wakes up */
+#define TIMER_TICK_MS 100
+/* one lap covers 51.2s, longer timeouts take extra laps */
+#define TIMER_SLOTS 512
+
+typedef struct {
+    int epfd;
+    conn_handler_fn on_data;
+    tpool_t* pool;
+    conn_timeouts_t timeouts;
+    uint64_t now; /* of the current wheel advance */
+    // workers take the lock only to drop a closed connection from the wheel or
+    // to bring a deadline forward; a later one is just stored, the wheel
+    // catches up when the old one fires
+    pthread_mutex_t timer_lock;
+    timer_wheel_t wheel;
+} reactor_t;
+
+/* set once by reactor_drain(), read by every loop */
+static int g_draining;
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void reactor_close(reactor_t* r, conn_t* c)
+{
+    pthread_mutex_lock(&r->timer_lock);
+    timer_wheel_cancel(&r->wheel, &c->timer);
+    pthread_mutex_unlock(&r->timer_lock);
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    LOG_INFO("[reactor] connection %d closed", c->fd);
+    conn_free(c);
+}
+
+static int reactor_watch(reactor_t* r, int op, conn_t* c, unsigned interest)
+{
+    // with a pool every event hands the connection to exactly one worker,
+    // the worker re-arms it once it is done
+    struct epoll_event ev = {
+        .events = interest | EPOLLRDHUP | (r->pool ? EPOLLONESHOT : 0),
+        .data.ptr = c,
+    };
+    if (epoll_ctl(r->epfd, op, c->fd, &ev) == -1) {
+        LOG_ERROR("[reactor] epoll_ctl failed: %s", strerror(errno));
+        return -1;
+    }
+    c->interest = interest;
+    return 0;
+}
+
+static void reactor_accept(reactor_t* r, int listen_fd)
+{
+    while (!reactor_draining()) {
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG_ERROR("[reactor] accept failed: %s", strerror(errno));
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (admission_accept(client_fd) != 0)
+            continue;
+        conn_t* c = conn_new(client_fd);
+        if (c == NULL) {
+            close(client_fd);
+            continue;
+        }
+        c->loop = r;
+        c->deadline = conn_deadline(c, &r->timeouts, timer_now_ms());
+        pthread_mutex_lock(&r->timer_lock);
+        timer_wheel_add(&r->wheel, &c->timer, c->deadline);
+        pthread_mutex_unlock(&r->timer_lock);
+        if (reactor_watch(r, EPOLL_CTL_ADD, c, EPOLLIN) != 0) {
+            reactor_close(r, c);
+            continue;
+        }
+        LOG_INFO("[reactor] client %d connected", client_fd);
+    }
+}
+
+/* returns < 0 when the connection has to go */
+static int reactor_on_readable(reactor_t* r, conn_t* c)
+{
+    ssize_t const recv_numbytes = conn_recv(c);
+    if (recv_numbytes == 0)
+        return -1;
+    if (recv_numbytes == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        LOG_WARNING("[reactor] recv failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (r->on_data(c) < 0)
+        return -1;
+
+    if (!conn_has_pending(c) && c->closing)
+        return -1;
+    return 0;
+}
+
+static int reactor_on_writable(conn_t* c)
+{
+    int ret = conn_flush(c);
+    if (ret != 0)
+        return ret < 0 ? -1 : 0;
+    return c->closing ? -1 : 0;
+}
+
+/* handle one event of a connection, inline or as a tpool job */
+static void reactor_service(void* arg)
+{
+    conn_t* c = arg;
+    reactor_t* r = c->loop;
+    unsigned const revents = c->revents;
+
+    int ret = 0;
+    if (revents & EPOLLERR) {
+        ret = -1;
+    } else if (revents & EPOLLOUT) {
+        ret = reactor_on_writable(c);
+    } else if (revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        // EPOLLRDHUP still may carry the last request, recv() tells
+        ret = reactor_on_readable(r, c);
+    }
+    if (ret < 0) {
+        reactor_close(r, c);
+        return;
+    }
+
+    uint64_t const deadline = conn_deadline(c, &r->timeouts, timer_now_ms());
+    if (deadline < __atomic_load_n(&c->deadline, __ATOMIC_RELAXED)) {
+        // the timer may sit at the old deadline, too late for the new one
+        pthread_mutex_lock(&r->timer_lock);
+        __atomic_store_n(&c->deadline, deadline, __ATOMIC_RELAXED);
+        timer_wheel_cancel(&r->wheel, &c->timer);
+        timer_wheel_add(&r->wheel, &c->timer, deadline);
+        pthread_mutex_unlock(&r->timer_lock);
+    } else {
+        __atomic_store_n(&c->deadline, deadline, __ATOMIC_RELAXED);
+    }
+
+    // stop reading until the client drained what we owe it
+    unsigned const interest = conn_has_pending(c) ? EPOLLOUT : EPOLLIN;
+    if (r->pool != NULL || interest != c->interest) {
+        // last touch of c: once re-armed another worker may own it
+        if (reactor_watch(r, EPOLL_CTL_MOD, c, interest) != 0)
+            reactor_close(r, c);
+    }
+}
+
+/* timer_wheel expire callback, on the loop thread with timer_lock held */
+static void reactor_expire(timer_node_t* node, void* arg)
+{
+    reactor_t* r = arg;
+    conn_t* c = (conn_t*)((char*)node - offsetof(conn_t, timer));
+    uint64_t const deadline = __atomic_load_n(&c->deadline, __ATOMIC_RELAXED);
+    if (deadline > r->now) {
+        timer_wheel_add(&r->wheel, node, deadline);
+        return;
+    }
+    // c may be in service right now: don't free it here, the hang-up event
+    // it gets closes it the usual way (and c can't be freed while we hold the lock)
+    LOG_INFO("[reactor] connection %d timed out", c->fd);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+int reactor_run(int listen_fd, conn_handler_fn on_data, tpool_t* pool, conn_timeouts_t const* timeouts)
+{
+    if (set_nonblocking(listen_fd) != 0) {
+        LOG_ERROR("[reactor] set O_NONBLOCK failed: %s", strerror(errno));
+        return -1;
+    }
+
+    reactor_t r = { .epfd = -1, .on_data = on_data, .pool = pool, .timeouts = *timeouts };
+    if (timer_wheel_init(&r.wheel, TIMER_TICK_MS, TIMER_SLOTS, timer_now_ms()) != 0) {
+        LOG_ERROR("[reactor] malloc for timer wheel failed!");
+        return -1;
+    }
+    pthread_mutex_init(&r.timer_lock, NULL);
+    r.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r.epfd == -1) {
+        LOG_ERROR("[reactor] epoll_create1 failed: %s", strerror(errno));
+        goto HANDLE_ERROR;
+    }
+
+    // listening socket is the only entry without a connection object
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(r.epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        LOG_ERROR("[reactor] epoll_ctl listen fd failed: %s", strerror(errno));
+        goto HANDLE_ERROR;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        pthread_mutex_lock(&r.timer_lock);
+        int const timeout = timer_wheel_timeout_ms(&r.wheel);
+        pthread_mutex_unlock(&r.timer_lock);
+        int nfds = epoll_wait(r.epfd, events, MAX_EVENTS, timeout);
+        if (nfds == -1) {
+            if (errno != EINTR) {
+                LOG_ERROR("[reactor] epoll_wait failed: %s", strerror(errno));
+                break;
+            }
+            nfds = 0;
+        }
+
+        pthread_mutex_lock(&r.timer_lock);
+        r.now = timer_now_ms();
+        timer_wheel_advance(&r.wheel, r.now, reactor_expire, &r);
+        pthread_mutex_unlock(&r.timer_lock);
+
+        // a request's queueing delay starts here, whether it waits for the pool or for this batch
+        uint64_t const ready_ns = nfds > 0 ? metrics_now_ns() : 0;
+        for (int i = 0; i < nfds; ++i) {
+            conn_t* c = events[i].data.ptr;
+
+            if (c == NULL) {
+                if (reactor_draining()) {
+                    // the socket is shared with the process that accepts from it now
+                    epoll_ctl(r.epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+                    continue;
+                }
+                reactor_accept(&r, listen_fd);
+                continue;
+            }
+
+            c->revents = events[i].events;
+            c->ready_ns = ready_ns;
+            // queue full: run it here rather than drop the event
+            if (r.pool == NULL || tpool_add_work(r.pool, reactor_service, c) != 0)
+                reactor_service(c);
+        }
+    }
+
+HANDLE_ERROR:
+    if (r.epfd != -1)
+        close(r.epfd);
+    pthread_mutex_destroy(&r.timer_lock);
+    timer_wheel_destroy(&r.wheel);
+    return -1;
+}
+
+void reactor_drain(void)
+{
+    __atomic_store_n(&g_draining, 1, __ATOMIC_RELEASE);
+}
+
+int reactor_draining(void)
+{
+    return __atomic_load_n(&g_draining, __ATOMIC_ACQUIRE);
+}
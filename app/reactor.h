@@ -0,0 +1,28 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "conn.h"
+#include "tpool.h"
+
+/*
+ * Called whenever new bytes landed in c->recv_buf. The handler consumes
+ * what it can, queues replies with conn_write() and returns < 0 to drop
+ * the connection.
+ */
+typedef int (*conn_handler_fn)(conn_t* c);
+
+/*
+ * epoll(7) loop over a listening socket, returns on fatal error. With a pool
+ * the handler runs on its workers, otherwise inline on the calling thread.
+ * Connections that miss their conn_deadline() are shut down.
+ */
+int reactor_run(int listen_fd, conn_handler_fn on_data, tpool_t* pool, conn_timeouts_t const* timeouts);
+
+/*
+ * the listening sockets went to another process: every loop, epoll or
+ * io_uring, stops accepting and only finishes the connections it has
+ */
+void reactor_drain(void);
+int reactor_draining(void);
+
+#endif // REACTOR_H
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+
+#include "request.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_header.h"
+#include "log.h"
+#include "validator.h"
+
+/* terminate the value at p_line_beg in place and keep it as field _name */
+#define TAKE_FIELD(_name)                              \
+    data->_name = p_line_beg;                          \
+    data->_name##_len = p_line_end - p_line_beg;       \
+    *p_line_end = '\0';                                \
+    LOG_DEBUG("data->" #_name " = |%s|", data->_name);
+
+/* "1", "0.5", "1.000" (RFC 9110 12.4.2) to thousandths, up to p_end */
+static unsigned parse_qvalue(char const* p, char const* p_end)
+{
+    unsigned q = 0;
+    if (p < p_end && (*p == '0' || *p == '1'))
+        q = (*p++ - '0') * 1000;
+    if (p < p_end && *p == '.') {
+        ++p;
+        for (unsigned scale = 100; scale > 0 && p < p_end && *p >= '0' && *p <= '9'; scale /= 10)
+            q += (*p++ - '0') * scale;
+    }
+    return q > 1000 ? 1000 : q;
+}
+
+/*
+ * `gzip;q=0.8, br, *;q=0` into accept_q and the accept_encoding bits:
+ * codings without a q-value get 1, those not named at all the q of `*`
+ * (0 without one). Read-only and reentrant, the value stays as it is.
+ */
+static void parse_accept_encoding(char const* p, char const* p_end, headerData* data)
+{
+    static struct {
+        char const* name;
+        int bit;
+    } const codings[] = {
+        { "gzip", ENCODING_TYPE_GZIP },
+        { "x-gzip", ENCODING_TYPE_GZIP },
+        { "br", ENCODING_TYPE_BR },
+        { "zstd", ENCODING_TYPE_ZSTD },
+    };
+    int named = 0;
+    int wildcard_q = -1;
+    while (p < p_end) {
+        while (p < p_end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        char const* const p_name = p;
+        while (p < p_end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            ++p;
+        size_t const name_len = p - p_name;
+        if (name_len == 0)
+            continue;
+
+        // parameters, only q means anything
+        unsigned q = 1000;
+        while (p < p_end && *p != ',') {
+            if (*p == ';') {
+                ++p;
+                while (p < p_end && (*p == ' ' || *p == '\t'))
+                    ++p;
+                if (p_end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+                    q = parse_qvalue(p + 2, p_end);
+            } else {
+                ++p;
+            }
+        }
+
+        if (name_len == 1 && *p_name == '*') {
+            wildcard_q = q;
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(codings) / sizeof(codings[0]); ++i) {
+            if (strlen(codings[i].name) == name_len && strncasecmp(p_name, codings[i].name, name_len) == 0) {
+                data->accept_q[__builtin_ctz(codings[i].bit)] = q;
+                named |= codings[i].bit;
+            }
+        }
+    }
+    data->accept_encoding = ENCODING_TYPE_UNDEF;
+    for (int i = 0; i < ENCODING_TYPE_NUM; ++i) {
+        if (!(named & (1 << i)))
+            data->accept_q[i] = wildcard_q > 0 ? wildcard_q : 0;
+        if (data->accept_q[i] > 0)
+            data->accept_encoding |= 1 << i;
+    }
+}
+
+int parse_header(char* const request, scan_index_t const* idx, headerData* data)
+{
+    // lines[0] is the request line, the last one the empty line
+    for (size_t i = 1; i + 1 < idx->num_lines; ++i) {
+        scan_line_t const* const p_line = &idx->lines[i];
+        char const* const p_type_beg = request + p_line->beg;
+        char const* const p_type_end = request + p_line->colon;
+        char* const p_line_end = request + p_line->end;
+        if (p_type_end == p_line_end) {
+            continue; // no colon, the framing parser let it through
+        }
+
+        char* p_line_beg = (char*)p_type_end + 1;
+        while (p_line_beg < p_line_end && (*p_line_beg == ' ' || *p_line_beg == '\t')) {
+            ++p_line_beg;
+        }
+
+        switch (http_header_lookup(p_type_beg, p_type_end - p_type_beg)) {
+        case HTTP_HEADER_HOST:
+            TAKE_FIELD(host);
+            break;
+        case HTTP_HEADER_USER_AGENT:
+            TAKE_FIELD(user_agent);
+            break;
+        case HTTP_HEADER_ACCEPT:
+            TAKE_FIELD(accept);
+            break;
+        case HTTP_HEADER_ACCEPT_ENCODING:
+            parse_accept_encoding(p_line_beg, p_line_end, data);
+            LOG_DEBUG("data->accept_encoding = %#x, q gzip %u br %u zstd %u", data->accept_encoding,
+                data->accept_q[0], data->accept_q[1], data->accept_q[2]);
+            break;
+        case HTTP_HEADER_CONTENT_TYPE:
+            TAKE_FIELD(content_type);
+            break;
+        case HTTP_HEADER_RANGE:
+            TAKE_FIELD(range);
+            break;
+        case HTTP_HEADER_IF_RANGE:
+            TAKE_FIELD(if_range);
+            break;
+        case HTTP_HEADER_IF_NONE_MATCH:
+            TAKE_FIELD(if_none_match);
+            break;
+        case HTTP_HEADER_IF_MODIFIED_SINCE: {
+            *p_line_end = '\0';
+            time_t const t = http_date_parse(p_line_beg);
+            data->if_modified_since = t > 0 ? t : 0;
+            LOG_DEBUG("data->if_modified_since = %ld", (long)data->if_modified_since);
+            break;
+        }
+        case HTTP_HEADER_CONNECTION:
+            data->connection_close = p_line_end - p_line_beg == strlen("close")
+                && strncasecmp(p_line_beg, "close", strlen("close")) == 0;
+            break;
+        case HTTP_HEADER_CONTENT_LENGTH: {
+            int tmp_errno = errno;
+            errno = 0;
+            char* ptr;
+            data->content_length = strtoul(p_line_beg, &ptr, 10);
+            if (errno != 0) {
+                LOG_ERROR("[parse_header] content_length error: %s", strerror(errno));
+                errno = tmp_errno;
+                return -1;
+            }
+            errno = tmp_errno;
+            LOG_DEBUG("data->content_length = |%lu|", data->content_length);
+            break;
+        }
+        default: {
+            char tstr[32];
+            size_t tstr_len = (p_type_end - p_type_beg > 31) ? 31 : p_type_end - p_type_beg;
+            memcpy(tstr, p_type_beg, tstr_len);
+            tstr[tstr_len] = '\0';
+            LOG_DEBUG("[parse_header] unhandled header type: %s", tstr);
+            break;
+        }
+        }
+    }
+    return 0;
+}
+
+#undef TAKE_FIELD
+
+int parse_request(char* const request, size_t request_len, headerData* data)
+{
+    *data = (headerData) { 0 };
+
+    // one pass finds every line, colon and request line space
+    scan_index_t idx;
+    if (scan_head(request, request_len, &idx) != 0) {
+        LOG_INFO("[parse_request] head unterminated or over %d lines", SCAN_MAX_LINES);
+        return -1;
+    }
+    char* const p_line_end = request + idx.lines[0].end;
+
+    /* req_type */
+    {
+        if (idx.sp[0] == 0) {
+            LOG_ERROR("[parse_request] can't locate req_type");
+            return -1;
+        }
+        size_t const method_len = idx.sp[0];
+        if (method_len == strlen("GET") && memcmp(request, "GET", method_len) == 0) {
+            data->req_type = REQ_TYPE_GET;
+            LOG_DEBUG("data->req_type = REQ_TYPE_GET");
+        } else if (method_len == strlen("POST") && memcmp(request, "POST", method_len) == 0) {
+            data->req_type = REQ_TYPE_POST;
+            LOG_DEBUG("data->req_type = REQ_TYPE_POST");
+        } else {
+            LOG_WARNING("[parse_request] undefined REQ_TYPE_POST!");
+        }
+    }
+    /* request */
+    {
+        if (idx.sp[1] == 0) {
+            LOG_ERROR("[parse_request] can't locate request");
+            return -1;
+        }
+        data->request = request + idx.sp[0] + 1;
+        data->request_len = idx.sp[1] - idx.sp[0] - 1;
+        request[idx.sp[1]] = '\0';
+        LOG_DEBUG("data->request = |%s|", data->request);
+    }
+    /* http_ver */
+    {
+        char const* const p_beg = request + idx.sp[1] + 1;
+        if ((size_t)(p_line_end - p_beg) >= strlen("HTTP/1.1") && strncmp(p_beg, "HTTP/1.1", strlen("HTTP/1.1")) == 0) {
+            data->http_ver = HTTP_V11;
+        } else {
+            LOG_WARNING("[parse_request] http version undefined!");
+            data->http_ver = HTTP_VUNDEF;
+        }
+    }
+    /* headers */
+    {
+        if (parse_header(request, &idx, data) != 0) {
+            return -1;
+        }
+    }
+    /* body, the caller keeps request NUL-terminated behind it */
+    {
+        data->body = request + idx.head_len;
+        data->body_len = request_len - idx.head_len;
+        LOG_DEBUG("data->body: \n%s<end>", data->body);
+    }
+
+    return 0;
+}
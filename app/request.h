@@ -0,0 +1,71 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "scan.h"
+
+typedef enum {
+    REQ_TYPE_UNDEF,
+    REQ_TYPE_GET,
+    REQ_TYPE_POST,
+    REQ_TYPE_ENUM_LENGTH,
+} REQ_TYPE;
+
+typedef enum {
+    HTTP_VUNDEF,
+    HTTP_V11, /* HTTP/1.1 */
+} HTTP_VERSION;
+
+/* accept_encoding bits, bit number i is accept_q[i] */
+#define ENCODING_TYPE_UNDEF 0x0
+#define ENCODING_TYPE_GZIP 0x1
+#define ENCODING_TYPE_BR 0x2
+#define ENCODING_TYPE_ZSTD 0x4
+#define ENCODING_TYPE_NUM 3
+
+/*
+ * Fields of one request. Strings are views into the request in the
+ * connection's receive buffer, NUL-terminated in place by parse_request(),
+ * so they live exactly as long as the request is being served and parsing
+ * allocates nothing. Absent fields are NULL.
+ */
+typedef struct {
+    /* request line */
+    int req_type;
+    char* request;
+    size_t request_len;
+    int http_ver;
+    /* header */
+    char* host;
+    size_t host_len;
+    char* user_agent;
+    size_t user_agent_len;
+    char* accept;
+    size_t accept_len;
+    int accept_encoding; /* codings with a q-value above 0 */
+    unsigned short accept_q[ENCODING_TYPE_NUM]; /* in thousandths */
+    char* content_type;
+    size_t content_type_len;
+    size_t content_length;
+    int connection_close; /* Connection: close */
+    char* range;
+    size_t range_len;
+    char* if_range;
+    size_t if_range_len;
+    char* if_none_match;
+    size_t if_none_match_len;
+    time_t if_modified_since; /* 0 when absent or not a date */
+    /* request body */
+    char* body;
+    size_t body_len;
+} headerData;
+
+/* header lines of an indexed request, values are terminated in place */
+int parse_header(char* const request, scan_index_t const* idx, headerData* data);
+
+/* (*unsafe) split a complete request in place, data views into request afterwards */
+int parse_request(char* const request, size_t request_len, headerData* data);
+
+#endif // REQUEST_H
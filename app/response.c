@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+
+#include "response.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+char const* response_status_line(int status)
+{
+    switch (status) {
+    case 200:
+        return "HTTP/1.1 200 OK\r\n";
+    case 201:
+        return "HTTP/1.1 201 Created\r\n";
+    case 206:
+        return "HTTP/1.1 206 Partial Content\r\n";
+    case 304:
+        return "HTTP/1.1 304 Not Modified\r\n";
+    case 400:
+        return "HTTP/1.1 400 Bad Request\r\n";
+    case 404:
+        return "HTTP/1.1 404 Not Found\r\n";
+    case 413:
+        return "HTTP/1.1 413 Content Too Large\r\n";
+    case 416:
+        return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+    case 431:
+        return "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+    case 501:
+        return "HTTP/1.1 501 Not Implemented\r\n";
+    case 503:
+        return "HTTP/1.1 503 Service Unavailable\r\n";
+    default:
+        return "HTTP/1.1 500 Internal Server Error\r\n";
+    }
+}
+
+void response_init(response_t* r, int status)
+{
+    r->status = status;
+    r->overflow = 0;
+    r->num_iov = 2;
+    r->head_len = 0;
+    char const* const line = response_status_line(status);
+    r->iov[0].iov_base = (void*)line;
+    r->iov[0].iov_len = strlen(line);
+}
+
+static void head_append(response_t* r, char const* p, size_t len)
+{
+    if (r->overflow || RESPONSE_HEAD_SIZE - r->head_len < len) {
+        r->overflow = 1;
+        return;
+    }
+    memcpy(r->head + r->head_len, p, len);
+    r->head_len += len;
+}
+
+void response_header(response_t* r, char const* name, char const* value, size_t value_len)
+{
+    head_append(r, name, strlen(name));
+    head_append(r, ": ", 2);
+    head_append(r, value, value_len);
+    head_append(r, "\r\n", 2);
+}
+
+void response_header_num(response_t* r, char const* name, size_t value)
+{
+    char sz_value[24];
+    int const len = snprintf(sz_value, sizeof(sz_value), "%zu", value);
+    response_header(r, name, sz_value, len);
+}
+
+void response_body(response_t* r, void const* data, size_t len)
+{
+    if (r->num_iov == 2 + RESPONSE_BODY_IOV) {
+        r->overflow = 1;
+        return;
+    }
+    r->iov[r->num_iov].iov_base = (void*)data;
+    r->iov[r->num_iov].iov_len = len;
+    ++r->num_iov;
+}
+
+/* close the header block, -1 when the response could not be built */
+static int response_finish(response_t* r, conn_t const* c)
+{
+    if (c->closing)
+        response_header_str(r, "Connection", "close");
+    head_append(r, "\r\n", 2);
+    if (r->overflow) {
+        LOG_ERROR("[response] %d response exceeds %d header bytes or %d body pieces",
+            r->status, RESPONSE_HEAD_SIZE, RESPONSE_BODY_IOV);
+        return -1;
+    }
+    r->iov[1].iov_base = r->head;
+    r->iov[1].iov_len = r->head_len;
+    return 0;
+}
+
+int response_send(response_t* r, conn_t* c)
+{
+    if (response_finish(r, c) != 0)
+        return -1;
+    return conn_writev(c, r->iov, r->num_iov);
+}
+
+int response_send_ref(response_t* r, conn_t* c, void (*release)(void*), void* release_arg)
+{
+    if (response_finish(r, c) != 0) {
+        if (release != NULL)
+            release(release_arg);
+        return -1;
+    }
+    if (r->num_iov == 2) {
+        // no body, nothing to borrow
+        if (release != NULL)
+            release(release_arg);
+        return conn_writev(c, r->iov, r->num_iov);
+    }
+    return conn_writev_ref(c, r->iov, r->num_iov, release, release_arg);
+}
@@ -0,0 +1,54 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "conn.h"
+
+/* room for the header lines of one response */
+#define RESPONSE_HEAD_SIZE 1024
+/* body pieces of one response */
+#define RESPONSE_BODY_IOV 4
+
+/*
+ * A response kept as separate pieces, status line, header block and body,
+ * sent with a single sendmsg(2). Header lines are formatted into head[]
+ * with bounds checks; body pieces are only referenced, never copied unless
+ * the socket can't take them right away.
+ */
+typedef struct {
+    int status;
+    int overflow; /* a header did not fit, response_send() refuses */
+    int num_iov;
+    size_t head_len;
+    struct iovec iov[2 + RESPONSE_BODY_IOV]; /* status line, headers, body */
+    char head[RESPONSE_HEAD_SIZE];
+} response_t;
+
+/* "HTTP/1.1 <status> <reason>\r\n" */
+char const* response_status_line(int status);
+
+void response_init(response_t* r, int status);
+
+/* "name: value\r\n", value is value_len bytes */
+void response_header(response_t* r, char const* name, char const* value, size_t value_len);
+
+static inline void response_header_str(response_t* r, char const* name, char const* value)
+{
+    response_header(r, name, value, strlen(value));
+}
+
+void response_header_num(response_t* r, char const* name, size_t value);
+
+/* borrow data[0, len) as the next body piece, until response_send() returns */
+void response_body(response_t* r, void const* data, size_t len);
+
+/* status line, headers, the blank line and the body in one go, 0 or -1; Connection: close is added when c is closing */
+int response_send(response_t* r, conn_t* c);
+
+/* like response_send(), but the last body piece stays borrowed until release(release_arg) */
+int response_send_ref(response_t* r, conn_t* c, void (*release)(void*), void* release_arg);
+
+#endif // RESPONSE_H
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+
+#include "router.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct router_node_t {
+    char* label; /* edge from the parent, not terminated */
+    size_t label_len;
+    route_t exact[ROUTER_METHODS]; /* fn NULL when there is none */
+    route_t prefix[ROUTER_METHODS];
+    size_t num_children;
+    router_node_t** children; /* labels start with distinct bytes */
+};
+
+static router_node_t* node_new(char const* label, size_t label_len)
+{
+    router_node_t* node = calloc(1, sizeof(router_node_t));
+    if (node == NULL)
+        return NULL;
+    node->label = malloc(label_len + 1);
+    if (node->label == NULL) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, label_len);
+    node->label_len = label_len;
+    return node;
+}
+
+static void node_free(router_node_t* node)
+{
+    for (size_t i = 0; i < node->num_children; ++i)
+        node_free(node->children[i]);
+    free(node->children);
+    free(node->label);
+    free(node);
+}
+
+static router_node_t** node_child(router_node_t const* node, char ch)
+{
+    for (size_t i = 0; i < node->num_children; ++i) {
+        if (node->children[i]->label[0] == ch)
+            return &node->children[i];
+    }
+    return NULL;
+}
+
+static int node_append(router_node_t* node, router_node_t* child)
+{
+    router_node_t** children = realloc(node->children, (node->num_children + 1) * sizeof(router_node_t*));
+    if (children == NULL)
+        return -1;
+    children[node->num_children++] = child;
+    node->children = children;
+    return 0;
+}
+
+/* cut the edge to *pp_child after len bytes, the new node in between is returned */
+static router_node_t* node_split(router_node_t** pp_child, size_t len)
+{
+    router_node_t* child = *pp_child;
+    router_node_t* mid = node_new(child->label, len);
+    if (mid == NULL)
+        return NULL;
+    if (node_append(mid, child) != 0) {
+        node_free(mid);
+        return NULL;
+    }
+    memmove(child->label, child->label + len, child->label_len - len);
+    child->label_len -= len;
+    *pp_child = mid;
+    return mid;
+}
+
+int router_add(router_t* r, int method, char const* path, int match, route_fn fn, int id)
+{
+    if (method < 0 || method >= ROUTER_METHODS)
+        return -1;
+    if (r->root == NULL && (r->root = node_new("", 0)) == NULL)
+        return -1;
+
+    router_node_t* node = r->root;
+    size_t len = strlen(path);
+    while (len > 0) {
+        router_node_t** pp_child = node_child(node, *path);
+        if (pp_child == NULL) {
+            router_node_t* child = node_new(path, len);
+            if (child == NULL)
+                return -1;
+            if (node_append(node, child) != 0) {
+                node_free(child);
+                return -1;
+            }
+            node = child;
+            break;
+        }
+        router_node_t* child = *pp_child;
+        size_t common = 1;
+        while (common < child->label_len && common < len && child->label[common] == path[common])
+            ++common;
+        if (common < child->label_len && (child = node_split(pp_child, common)) == NULL)
+            return -1;
+        node = child;
+        path += common;
+        len -= common;
+    }
+
+    route_t* slot = match == ROUTE_PREFIX ? &node->prefix[method] : &node->exact[method];
+    if (slot->fn != NULL)
+        return -1;
+    slot->fn = fn;
+    slot->id = id;
+    return 0;
+}
+
+route_t const* router_find(router_t const* r, int method, char const* path, size_t len, size_t* p_rest_off)
+{
+    if (r->root == NULL || method < 0 || method >= ROUTER_METHODS)
+        return NULL;
+
+    route_t const* found = NULL;
+    size_t off = 0;
+    router_node_t const* node = r->root;
+    for (;;) {
+        if (node->prefix[method].fn != NULL) {
+            found = &node->prefix[method];
+            *p_rest_off = off;
+        }
+        if (off == len) {
+            if (node->exact[method].fn != NULL) {
+                *p_rest_off = off;
+                return &node->exact[method];
+            }
+            return found;
+        }
+        router_node_t** pp_child = node_child(node, path[off]);
+        if (pp_child == NULL)
+            return found;
+        node = *pp_child;
+        if (len - off < node->label_len || memcmp(path + off, node->label, node->label_len) != 0)
+            return found;
+        off += node->label_len;
+    }
+}
+
+void router_free(router_t* r)
+{
+    if (r->root != NULL)
+        node_free(r->root);
+    r->root = NULL;
+}
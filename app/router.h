@@ -0,0 +1,42 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+
+/* methods are small integers below this, the caller's enum */
+#define ROUTER_METHODS 4
+
+typedef enum {
+    ROUTE_EXACT, /* the whole path */
+    ROUTE_PREFIX, /* the path and everything below it, the longest prefix wins */
+} ROUTE_MATCH;
+
+/* rest is what follows the registered path, empty for exact routes */
+typedef int (*route_fn)(void* req, char const* rest, size_t rest_len);
+
+/* what a path resolves to */
+typedef struct {
+    route_fn fn;
+    int id; /* the caller's tag of the route, e.g. for metrics */
+} route_t;
+
+typedef struct router_node_t router_node_t;
+
+/*
+ * Paths to handlers in a radix trie: a lookup walks each byte of the path
+ * once, however many routes there are. Filled once before serving, read
+ * concurrently afterwards.
+ */
+typedef struct {
+    router_node_t* root;
+} router_t;
+
+/* 0, -1 when out of memory or the route exists already */
+int router_add(router_t* r, int method, char const* path, int match, route_fn fn, int id);
+
+/* route of path[0, len), NULL when none; *p_rest_off is where rest begins */
+route_t const* router_find(router_t const* r, int method, char const* path, size_t len, size_t* p_rest_off);
+
+void router_free(router_t* r);
+
+#endif // ROUTER_H
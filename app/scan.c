@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#define SCAN_NO_COLON UINT32_MAX
+
+static int g_scan_impl = -1;
+
+static void scan_reset(scan_index_t* idx)
+{
+    idx->num_lines = 0;
+    idx->head_len = 0;
+    idx->sp[0] = idx->sp[1] = 0;
+    idx->lines[0].beg = 0;
+    idx->lines[0].colon = SCAN_NO_COLON;
+}
+
+/* one structural byte at buf[i]: 1 once the head is complete, -1 when the index is full, 0 to go on */
+static inline int scan_hit(scan_index_t* idx, char const* buf, uint32_t i)
+{
+    scan_line_t* const line = &idx->lines[idx->num_lines];
+
+    if (buf[i] == '\n') {
+        line->end = (i > line->beg && buf[i - 1] == '\r') ? i - 1 : i;
+        if (line->colon == SCAN_NO_COLON)
+            line->colon = line->end;
+        ++idx->num_lines;
+        if (line->end == line->beg) {
+            idx->head_len = i + 1;
+            return 1;
+        }
+        if (idx->num_lines == SCAN_MAX_LINES)
+            return -1;
+        line[1].beg = i + 1;
+        line[1].colon = SCAN_NO_COLON;
+    } else if (buf[i] == ':') {
+        if (line->colon == SCAN_NO_COLON)
+            line->colon = i;
+    } else if (idx->num_lines == 0) {
+        // ' ', only asked for on the request line
+        if (idx->sp[0] == 0)
+            idx->sp[0] = i;
+        else if (idx->sp[1] == 0)
+            idx->sp[1] = i;
+    }
+    return 0;
+}
+
+static int scan_scalar(char const* buf, size_t len, scan_index_t* idx, size_t from)
+{
+    for (size_t i = from; i < len; ++i) {
+        char const ch = buf[i];
+        if (ch == '\n' || ch == ':' || (ch == ' ' && idx->num_lines == 0)) {
+            int const r = scan_hit(idx, buf, i);
+            if (r != 0)
+                return r > 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+#ifdef SCAN_X86
+
+/* hits of one block, lowest bit first; the scalar loop finishes the tail */
+#define SCAN_BLOCK_HITS(_mask, _base)                     \
+    while (_mask != 0) {                                  \
+        int const r = scan_hit(idx, buf, (_base) + __builtin_ctz(_mask)); \
+        if (r != 0)                                       \
+            return r > 0 ? 0 : -1;                        \
+        _mask &= _mask - 1;                               \
+    }
+
+__attribute__((target("sse2"))) static int scan_sse2(char const* buf, size_t len, scan_index_t* idx)
+{
+    __m128i const nl = _mm_set1_epi8('\n');
+    __m128i const colon = _mm_set1_epi8(':');
+    __m128i const sp = _mm_set1_epi8(' ');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i const v = _mm_loadu_si128((__m128i const*)(buf + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, colon)));
+        if (idx->num_lines == 0)
+            mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(v, sp));
+        SCAN_BLOCK_HITS(mask, i);
+    }
+    return scan_scalar(buf, len, idx, i);
+}
+
+__attribute__((target("avx2"))) static int scan_avx2(char const* buf, size_t len, scan_index_t* idx)
+{
+    __m256i const nl = _mm256_set1_epi8('\n');
+    __m256i const colon = _mm256_set1_epi8(':');
+    __m256i const sp = _mm256_set1_epi8(' ');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i const v = _mm256_loadu_si256((__m256i const*)(buf + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, colon)));
+        if (idx->num_lines == 0)
+            mask |= (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp));
+        SCAN_BLOCK_HITS(mask, i);
+    }
+    return scan_scalar(buf, len, idx, i);
+}
+
+#undef SCAN_BLOCK_HITS
+
+#endif // SCAN_X86
+
+static int scan_cpu_has(int impl)
+{
+#ifdef SCAN_X86
+    if (impl == SCAN_IMPL_AVX2)
+        return __builtin_cpu_supports("avx2");
+    if (impl == SCAN_IMPL_SSE2)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return impl == SCAN_IMPL_SCALAR;
+}
+
+int scan_set_impl(int impl)
+{
+    if (!scan_cpu_has(impl))
+        return -1;
+    __atomic_store_n(&g_scan_impl, impl, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int scan_impl(void)
+{
+    int impl = __atomic_load_n(&g_scan_impl, __ATOMIC_RELAXED);
+    if (impl < 0) {
+        // first call, racing threads pick the same answer
+        impl = scan_cpu_has(SCAN_IMPL_AVX2) ? SCAN_IMPL_AVX2
+            : scan_cpu_has(SCAN_IMPL_SSE2)  ? SCAN_IMPL_SSE2
+                                            : SCAN_IMPL_SCALAR;
+        __atomic_store_n(&g_scan_impl, impl, __ATOMIC_RELAXED);
+    }
+    return impl;
+}
+
+char const* scan_impl_name(void)
+{
+    static char const* const names[] = { "scalar", "sse2", "avx2" };
+    return names[scan_impl()];
+}
+
+int scan_head(char const* buf, size_t len, scan_index_t* idx)
+{
+    scan_reset(idx);
+    switch (scan_impl()) {
+#ifdef SCAN_X86
+    case SCAN_IMPL_AVX2:
+        return scan_avx2(buf, len, idx);
+    case SCAN_IMPL_SSE2:
+        return scan_sse2(buf, len, idx);
+#endif
+    default:
+        return scan_scalar(buf, len, idx, 0);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* request line plus header lines an index holds, more are refused */
+#define SCAN_MAX_LINES 128
+
+typedef enum {
+    SCAN_IMPL_SCALAR,
+    SCAN_IMPL_SSE2,
+    SCAN_IMPL_AVX2,
+} SCAN_IMPL;
+
+/* one line of a request head, offsets from the start of the request */
+typedef struct {
+    uint32_t beg;
+    uint32_t end; /* the '\r' of its CRLF */
+    uint32_t colon; /* first ':' of the line, end when there is none */
+} scan_line_t;
+
+/*
+ * Structural characters of a request head (LF, CR, ':' and the spaces of
+ * the request line), found in a single pass with the widest vector unit
+ * the cpu has. lines[0] is the request line, lines[num_lines - 1] the
+ * empty line closing the head.
+ */
+typedef struct {
+    size_t num_lines;
+    size_t head_len; /* bytes up to and including the empty line */
+    uint32_t sp[2]; /* first two spaces of the request line, 0 when missing */
+    scan_line_t lines[SCAN_MAX_LINES];
+} scan_index_t;
+
+/*
+ * index the head at buf[0, len), 0 on success, -1 when it does not end
+ * within len or has more than SCAN_MAX_LINES lines
+ */
+int scan_head(char const* buf, size_t len, scan_index_t* idx);
+
+/* pin the implementation (benchmarks), -1 when the cpu lacks it */
+int scan_set_impl(int impl);
+
+/* name of the implementation in use */
+char const* scan_impl_name(void);
+
+#endif // SCAN_H
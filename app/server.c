@@ -1,118 +1,197 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/select.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <zlib.h>
 
+#include "admission.h"
+#include "compress.h"
+#include "conn.h"
+#include "file_cache.h"
+#include "gzip_stream.h"
+#include "handoff.h"
+#include "http_parser.h"
+#include "log.h"
+#include "metrics.h"
+#include "range.h"
+#include "reactor.h"
+#include "request.h"
+#include "response.h"
+#include "router.h"
+#include "tpool.h"
+#include "upload.h"
+#include "uring.h"
+#include "validator.h"
+
 /*** defines ***/
 
-/* safe buffer size of a package */
-#define BUFFER_SIZE 1500
 #define MAX_PTHREAD_NUM 32
+#define JOB_QUEUE_SIZE 1024
+#define SERVER_PORT 4221
+/* static files are compressed once, so spend the cpu on the ratio */
+#define ENCODE_STATIC_LEVEL Z_BEST_COMPRESSION
+/* larger files are not compressed in memory but gzip streamed, or served from a sibling .gz (.br, .zst) */
+#define ENCODE_VARIANT_MAX (4 * 1024 * 1024)
+/* bodies compressed per request ask for this, compress_level() may go faster */
+#define GZIP_STREAM_LEVEL Z_DEFAULT_COMPRESSION
+/* longer bodies are not compressed in one go on the stack but gzip streamed */
+#define ENCODE_INLINE_MAX (4 * 1024)
+
+/* keep-alive defaults, all overridable on the command line */
+#define HEADER_TIMEOUT_SEC 10
+#define IDLE_TIMEOUT_SEC 30
+#define KEEPALIVE_TIMEOUT_SEC 15
+#define KEEPALIVE_MAX_REQUESTS 1000
+/* descriptors kept back from --max-connections' default for the log, listeners, uploads */
+#define RESERVED_FDS 64
+/* after an upgrade, how long the old process waits for its connections to finish */
+#define DRAIN_TIMEOUT_SEC 30
+/* how often a draining process counts its connections, and a polling accept loop looks up */
+#define DRAIN_POLL_MS 50
 
 #define REQ_USER_AGENT "/user-agent"
 #define REQ_FILE "/files/"
 #define REQ_ECHO "/echo/"
 #define REQ_ROOT "/"
+#define REQ_METRICS "/metrics"
 
 /*** constants ***/
 
-char const* const reply_200
-    = "HTTP/1.1 200 OK\r\n\r\n";
-char const* const reply_201 = "HTTP/1.1 201 Created\r\n\r\n";
-char const* const reply_404 = "HTTP/1.1 404 Not Found\r\n\r\n";
-
-char const* const fmt_reply_200 =
-    /* Statue line */
-    "HTTP/1.1 200 OK\r\n"
-    /* Headers */
-    "Content-Type: %s\r\n"
-    "Content-Length: %s\r\n"
-    "%s"
-    "\r\n"
-    /* Response body */
-    "%s";
-
-#define fill_fmt_reply_200(out_buf, content_type, content_length, extra_headers, body) \
-    sprintf(out_buf, fmt_reply_200, content_type, content_length, extra_headers, body);
-
 /*** enums ***/
 
 typedef enum {
-    REQ_TYPE_UNDEF,
-    REQ_TYPE_GET,
-    REQ_TYPE_POST,
-    REQ_TYPE_ENUM_LENGTH,
-} REQ_TYPE;
-
-typedef enum {
-    HTTP_VUNDEF,
-    HTTP_V11, /* HTTP/1.1 */
-} HTTP_VERSION;
-
-int const ENCODING_TYPE_UNDEF = 0x0;
-int const ENCODING_TYPE_GZIP = 0x1;
+    SERVE_MODE_EPOLL, /* epoll reactor, requests served by the worker pool */
+    SERVE_MODE_THREAD, /* one detached thread per connection */
+    SERVE_MODE_REUSEPORT, /* one pinned reactor per core, each on its own SO_REUSEPORT listener */
+    SERVE_MODE_URING, /* as SERVE_MODE_REUSEPORT, with an io_uring loop per core instead of epoll */
+} SERVE_MODE;
 
 /*** structs ***/
 
-typedef struct {
-    /* request line */
-    int req_type;
-    char* request;
-    int http_ver;
-    /* header */
-    char* host;
-    char* user_agent;
-    char* accept;
-    int accept_encoding;
-    char* content_type;
-    size_t content_length;
-    /* request body */
-    char* body;
-} headerData;
-
 typedef struct {
     int client_fd;
 } tParams;
 
+typedef struct {
+    int cpu;
+} shardParams;
+
+/* one request being served, the req of every route_fn */
+typedef struct {
+    conn_t* c;
+    headerData* hd;
+    int status; /* of the reply, answered without a body once the route returns unless sent */
+    int sent; /* the route queued its own response, with status */
+} requestCtx;
+
+/* the route is queueing a response with status itself */
+static void request_replied(requestCtx* req, int status)
+{
+    req->status = status;
+    req->sent = 1;
+}
+
 struct gArgs {
     char* file_path;
-} g_args = { 0 };
+    int port;
+    int serve_mode;
+    int threads; /* pool workers (or shards), -1 picks one per core, 0 serves on the reactor thread */
+    int backlog;
+    int file_cache; /* open files kept by the --directory cache */
+    int max_requests; /* per connection, 0 for no limit */
+    int max_conns; /* -1 until main() fits it in RLIMIT_NOFILE */
+    size_t max_upload; /* largest POST body taken, bigger ones get 413 */
+    admission_limits_t admission;
+    conn_timeouts_t timeouts;
+    char* upgrade_path; /* Unix socket listeners are handed over on, NULL for none */
+    unsigned drain_ms;
+} g_args = {
+    .port = SERVER_PORT,
+    .threads = -1,
+    .backlog = SOMAXCONN,
+    .file_cache = FILE_CACHE_CAPACITY,
+    .max_requests = KEEPALIVE_MAX_REQUESTS,
+    .max_conns = -1,
+    .max_upload = MAX_UPLOAD_SIZE,
+    .admission = {
+        .target_ms = ADMISSION_TARGET_MS,
+        .interval_ms = ADMISSION_INTERVAL_MS,
+        .retry_after_sec = ADMISSION_RETRY_AFTER_SEC,
+    },
+    .timeouts = {
+        .header_ms = HEADER_TIMEOUT_SEC * 1000,
+        .idle_ms = IDLE_TIMEOUT_SEC * 1000,
+        .keepalive_ms = KEEPALIVE_TIMEOUT_SEC * 1000,
+    },
+    .drain_ms = DRAIN_TIMEOUT_SEC * 1000,
+};
+
+/* listening sockets by shard (0 is the only one outside the shard modes), what an upgrade hands over */
+struct gListeners {
+    int fds[MAX_PTHREAD_NUM];
+    int num_inherited; /* fds[0, num_inherited) came from the process we took over from */
+} g_listeners;
+
+/* built from g_route_table before serving */
+router_t g_router;
 
 /*** free ***/
 
 void g_free_resource()
 {
+    file_cache_destroy();
+    router_free(&g_router);
     free(g_args.file_path);
+    free(g_args.upgrade_path);
+    log_shutdown();
 }
 
-void free_header_data(headerData* data)
+/*** args ***/
+
+/* a timeout option in (fractional) seconds to milliseconds, fallback when invalid */
+unsigned parse_seconds(char const* arg, unsigned fallback)
 {
-    if (data == NULL)
-        return;
-    if (data->request != NULL)
-        free(data->request);
-    if (data->host != NULL)
-        free(data->host);
-    if (data->user_agent != NULL)
-        free(data->user_agent);
-    if (data->accept != NULL)
-        free(data->accept);
-    if (data->content_type != NULL)
-        free(data->content_type);
-    if (data->body != NULL)
-        free(data->body);
-    free(data);
+    char* end;
+    double const sec = strtod(arg, &end);
+    if (end == arg || *end != '\0' || sec <= 0 || sec > 24 * 3600) {
+        LOG_WARNING("[parse_args] invalid timeout `%s`, keep %u ms", arg, fallback);
+        return fallback;
+    }
+    return (unsigned)(sec * 1000);
 }
 
-/*** args ***/
+/* a size option in bytes, with an optional k, m or g suffix, fallback when invalid */
+size_t parse_size(char const* arg, size_t fallback)
+{
+    char* end;
+    unsigned long long size = strtoull(arg, &end, 10);
+    int const shift = *end == 'k' ? 10 : *end == 'm' ? 20 : *end == 'g' ? 30 : 0;
+    if (shift != 0)
+        ++end;
+    if (end == arg || *end != '\0' || arg[0] == '-' || size == 0 || size > (MAX_UPLOAD_SIZE >> shift)) {
+        LOG_WARNING("[parse_args] invalid size `%s`, keep %lu bytes", arg, (unsigned long)fallback);
+        return fallback;
+    }
+    return (size_t)size << shift;
+}
 
 int parse_args(int argc, char* argv[])
 {
@@ -127,6 +206,110 @@ int parse_args(int argc, char* argv[])
                 memcpy(g_args.file_path, argv[i + 1], strlen(argv[i + 1]));
                 g_args.file_path[strlen(argv[i + 1])] = '\0';
                 ++i;
+            } else if (strcmp(argv[i] + 2, "mode") == 0 && i + 1 < argc) {
+                if (strcmp(argv[i + 1], "epoll") == 0) {
+                    g_args.serve_mode = SERVE_MODE_EPOLL;
+                } else if (strcmp(argv[i + 1], "thread") == 0) {
+                    g_args.serve_mode = SERVE_MODE_THREAD;
+                } else if (strcmp(argv[i + 1], "reuseport") == 0) {
+                    g_args.serve_mode = SERVE_MODE_REUSEPORT;
+                } else if (strcmp(argv[i + 1], "uring") == 0) {
+                    g_args.serve_mode = SERVE_MODE_URING;
+                } else {
+                    LOG_WARNING("[parse_args] unknown mode `%s`, keep default", argv[i + 1]);
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "port") == 0 && i + 1 < argc) {
+                int const port = atoi(argv[i + 1]);
+                if (port <= 0 || port > 65535) {
+                    LOG_WARNING("[parse_args] invalid port `%s`, keep %d", argv[i + 1], g_args.port);
+                } else {
+                    g_args.port = port;
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "threads") == 0 && i + 1 < argc) {
+                g_args.threads = atoi(argv[i + 1]);
+                if (g_args.threads < 0 || g_args.threads > MAX_PTHREAD_NUM) {
+                    LOG_WARNING("[parse_args] threads clamped to [0, %d]", MAX_PTHREAD_NUM);
+                    g_args.threads = g_args.threads < 0 ? 0 : MAX_PTHREAD_NUM;
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "file-cache") == 0 && i + 1 < argc) {
+                g_args.file_cache = atoi(argv[i + 1]);
+                if (g_args.file_cache < 0) {
+                    g_args.file_cache = 0;
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "log-level") == 0 && i + 1 < argc) {
+                int const level = log_parse_level(argv[i + 1]);
+                if (level < 0) {
+                    LOG_WARNING("[parse_args] unknown log level `%s`, keep default", argv[i + 1]);
+                } else {
+                    g_log_level = level;
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "access-log") == 0 && i + 1 < argc) {
+                int const every = atoi(argv[i + 1]);
+                g_log_access_every = every > 0 ? every : 0;
+                ++i;
+            } else if (strcmp(argv[i] + 2, "header-timeout") == 0 && i + 1 < argc) {
+                g_args.timeouts.header_ms = parse_seconds(argv[i + 1], g_args.timeouts.header_ms);
+                ++i;
+            } else if (strcmp(argv[i] + 2, "idle-timeout") == 0 && i + 1 < argc) {
+                g_args.timeouts.idle_ms = parse_seconds(argv[i + 1], g_args.timeouts.idle_ms);
+                ++i;
+            } else if (strcmp(argv[i] + 2, "keep-alive-timeout") == 0 && i + 1 < argc) {
+                g_args.timeouts.keepalive_ms = parse_seconds(argv[i + 1], g_args.timeouts.keepalive_ms);
+                ++i;
+            } else if (strcmp(argv[i] + 2, "max-requests") == 0 && i + 1 < argc) {
+                g_args.max_requests = atoi(argv[i + 1]);
+                if (g_args.max_requests < 0) {
+                    g_args.max_requests = 0;
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "backlog") == 0 && i + 1 < argc) {
+                g_args.backlog = atoi(argv[i + 1]);
+                if (g_args.backlog <= 0) {
+                    LOG_WARNING("[parse_args] invalid backlog `%s`, use %d", argv[i + 1], SOMAXCONN);
+                    g_args.backlog = SOMAXCONN;
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "max-connections") == 0 && i + 1 < argc) {
+                g_args.max_conns = atoi(argv[i + 1]);
+                if (g_args.max_conns < 0) {
+                    g_args.max_conns = 0;
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "max-upload") == 0 && i + 1 < argc) {
+                g_args.max_upload = parse_size(argv[i + 1], g_args.max_upload);
+                ++i;
+            } else if (strcmp(argv[i] + 2, "max-inflight") == 0 && i + 1 < argc) {
+                int const max = atoi(argv[i + 1]);
+                g_args.admission.max_inflight = max > 0 ? max : 0;
+                ++i;
+            } else if (strcmp(argv[i] + 2, "queue-target") == 0 && i + 1 < argc) {
+                int const ms = atoi(argv[i + 1]);
+                g_args.admission.target_ms = ms > 0 ? ms : 0;
+                ++i;
+            } else if (strcmp(argv[i] + 2, "queue-interval") == 0 && i + 1 < argc) {
+                int const ms = atoi(argv[i + 1]);
+                if (ms <= 0) {
+                    LOG_WARNING("[parse_args] invalid queue interval `%s`, keep %u ms", argv[i + 1], g_args.admission.interval_ms);
+                } else {
+                    g_args.admission.interval_ms = ms;
+                }
+                ++i;
+            } else if (strcmp(argv[i] + 2, "upgrade-socket") == 0 && i + 1 < argc) {
+                free(g_args.upgrade_path);
+                g_args.upgrade_path = strdup(argv[i + 1]);
+                ++i;
+            } else if (strcmp(argv[i] + 2, "drain-timeout") == 0 && i + 1 < argc) {
+                g_args.drain_ms = parse_seconds(argv[i + 1], g_args.drain_ms);
+                ++i;
+            } else if (strcmp(argv[i] + 2, "retry-after") == 0 && i + 1 < argc) {
+                int const sec = atoi(argv[i + 1]);
+                g_args.admission.retry_after_sec = sec > 0 ? sec : 0;
+                ++i;
             }
         }
     }
@@ -145,507 +328,1259 @@ int parse_args(int argc, char* argv[])
 
 #define LOCAL_STR_CONCAT(_s1, _s2, buffer_name)      \
     char buffer_name[strlen(_s1) + strlen(_s2) + 1]; \
-    strcat(buffer_name, _s1);                        \
-    strcat(buffer_name + strlen(_s1), _s2);          \
+    memcpy(buffer_name, _s1, strlen(_s1));           \
+    memcpy(buffer_name + strlen(_s1), _s2, strlen(_s2)); \
     buffer_name[strlen(_s1) + strlen(_s2)] = '\0';
 
-int file_exists(char* file_path)
+int read_file(int fd, char* buffer, size_t buf_size)
 {
-    return access(file_path, F_OK) == 0;
+    size_t off = 0;
+    while (off < buf_size) {
+        ssize_t n = pread(fd, buffer + off, buf_size - off, off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOG_ERROR("[read_file] %s", n == 0 ? "unexpected end of file" : strerror(errno));
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
 }
 
-size_t file_size(char* file_path)
+
+/*** replies ***/
+
+/* a response without a body */
+int reply_status(conn_t* c, int status)
 {
-    size_t buf_size = -1;
-    FILE* fp = fopen(file_path, "r");
-    if (fp != NULL) {
-        if (fseek(fp, 0L, SEEK_END) == 0) {
-            buf_size = ftell(fp);
-        }
-        fclose(fp);
+    response_t resp;
+    response_init(&resp, status);
+    response_header_num(&resp, "Content-Length", 0);
+    return response_send(&resp, c);
+}
+
+/* 503 of a shed request, closing the connection makes its client back off */
+int reply_unavailable(conn_t* c)
+{
+    c->closing = 1;
+    response_t resp;
+    response_init(&resp, 503);
+    response_header_num(&resp, "Retry-After", admission_retry_after());
+    response_header_num(&resp, "Content-Length", 0);
+    return response_send(&resp, c);
+}
+
+/* admission_enter() for a request of c that starts at now_ns: 0, or -1 when it is to be shed */
+int admit_request(conn_t* c, uint64_t now_ns)
+{
+    uint64_t const queued = c->ready_ns != 0 && now_ns > c->ready_ns ? now_ns - c->ready_ns : 0;
+    if (admission_enter(now_ns, queued) == 0)
+        return 0;
+    LOG_INFO("[admit_request] shed after %lu us in queue", (unsigned long)(queued / 1000));
+    return -1;
+}
+
+/* one more request on c, the last one allowed closes the connection after its response */
+void count_request(conn_t* c)
+{
+    ++c->requests;
+    if (g_args.max_requests > 0 && c->requests >= (unsigned)g_args.max_requests) {
+        c->closing = 1;
+    }
+    // draining after an upgrade: the client's next request goes to the new process
+    if (reactor_draining()) {
+        c->closing = 1;
     }
-    return buf_size;
 }
 
-int read_file(char* file_path, char* buffer, size_t buf_size)
+/*** file responses ***/
+
+/* release callback for variants that did not make it into the cache */
+static void free_release(void* p)
 {
-    FILE* fp = fopen(file_path, "r");
-    if (fp != NULL) {
-        fread(buffer, sizeof(char), buf_size, fp);
-        if (ferror(fp) != 0) {
-            fputs("[Error] read_file", stderr);
-            return -1;
-        }
-        fclose(fp);
+    free(p);
+}
+
+/* p_file compressed whole in encoding, malloc'ed for file_cache_set_variant(), NULL on failure */
+file_variant_t* encode_variant(file_entry_t* p_file, int encoding)
+{
+    char* palloc_raw = malloc(p_file->size + 1);
+    size_t const bound = compress_bound(encoding, p_file->size);
+    file_variant_t* palloc_variant = malloc(sizeof(file_variant_t) + bound);
+    if (palloc_raw == NULL || palloc_variant == NULL || read_file(p_file->fd, palloc_raw, p_file->size) != 0) {
+        free(palloc_raw);
+        free(palloc_variant);
+        return NULL;
     }
-    return 0;
+    int const len = compress_encode(encoding, palloc_raw, p_file->size, (char*)palloc_variant->data, bound, ENCODE_STATIC_LEVEL);
+    free(palloc_raw);
+    if (len < 0) {
+        free(palloc_variant);
+        return NULL;
+    }
+    palloc_variant->len = len;
+    LOG_INFO("[encode_variant] %s variant of %s: %lu -> %d bytes", compress_name(encoding), p_file->name, p_file->size, len);
+    return palloc_variant;
 }
 
-int write_file(char* file_path, char* buffer)
+/*
+ * queue resp, which has its status and the headers but the framing ones,
+ * and a chunked body compressed while the client reads it, takes gs
+ */
+int serve_gzip_stream(conn_t* c, response_t* resp, gzip_stream_t* gs)
 {
-    FILE* fp = fopen(file_path, "w");
-    if (fp != NULL) {
-        fprintf(fp, "%s", buffer);
-        fclose(fp);
+    response_header_str(resp, "Content-Encoding", "gzip");
+    response_header_str(resp, "Transfer-Encoding", "chunked");
+    if (response_send(resp, c) != 0) {
+        gzip_stream_free(gs);
+        return -1;
     }
-    return 0;
+    return gzip_stream_queue(c, gs);
 }
 
-/*** file compression ***/
+/* Content-Type, validators and Vary of a --directory file reply, etag names the representation sent */
+static void file_headers(response_t* r, file_entry_t const* p_file, char const* etag)
+{
+    response_header_str(r, "Content-Type", p_file->content_type);
+    response_header_str(r, "ETag", etag);
+    response_header_str(r, "Last-Modified", p_file->last_modified);
+    response_header_str(r, "Vary", "Accept-Encoding");
+}
 
-int compress_to_gzip(const char* input, int input_size, char* output, int output_size)
+/* 1 when the client's copy of the representation tagged etag is current, RFC 9110 13.2.2 */
+static int file_is_fresh(headerData const* hd, file_entry_t const* p_file, char const* etag)
 {
-    z_stream zs = {
-        .zalloc = Z_NULL,
-        .zfree = Z_NULL,
-        .opaque = Z_NULL,
-        .avail_in = (uInt)input_size,
-        .next_in = (Bytef*)input,
-        .avail_out = (uInt)output_size,
-        .next_out = (Bytef*)output,
-    };
-    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
-    deflate(&zs, Z_FINISH);
-    deflateEnd(&zs);
-    return zs.total_out;
+    if (hd->if_none_match != NULL) {
+        // If-Modified-Since only counts without If-None-Match
+        return etag_list_match(hd->if_none_match, hd->if_none_match_len, etag);
+    }
+    return hd->if_modified_since != 0 && p_file->mtime.tv_sec <= hd->if_modified_since;
 }
 
-size_t compress_body(char* request, int accept_encoding)
+/* 1 when a Range of hd applies to p_file: no If-Range, or one naming the current content */
+static int file_if_range(headerData const* hd, file_entry_t const* p_file)
 {
-    size_t new_size;
+    return hd->if_range == NULL || if_range_match(hd->if_range, p_file->etag, p_file->mtime.tv_sec);
+}
 
-    // insert header
-    {
-        char append_str[] = "Content-Encoding: gzip\r\n";
+/* the header-only answer to a conditional GET of a file the client has */
+int reply_not_modified(requestCtx* req, file_entry_t const* p_file, char const* etag)
+{
+    request_replied(req, 304);
+    response_t resp;
+    response_init(&resp, 304);
+    response_header_str(&resp, "ETag", etag);
+    response_header_str(&resp, "Last-Modified", p_file->last_modified);
+    response_header_str(&resp, "Vary", "Accept-Encoding");
+    return response_send(&resp, req->c);
+}
 
-        char* p_header_end = strstr(request, "\r\n\r\n") + 2; // to insert location
-        size_t body_len = strlen(request) - (p_header_end - request);
-        char tmp_str[body_len + 1];
+/* p_file's tag for its copy in encoding: the identity tag with the coding appended */
+static void file_etag_encoded(char* out, file_entry_t const* p_file, int encoding)
+{
+    int const n = strlen(p_file->etag) - 1; // without the closing quote
+    snprintf(out, FILE_ETAG_SIZE, "%.*s-%s\"", n, p_file->etag, compress_name(encoding));
+}
 
-        // insert Content-Encoding
-        strcpy(tmp_str, p_header_end);
-        strcpy(p_header_end, append_str);
-        strcpy(p_header_end + strlen(append_str), tmp_str);
-        printf("[INFO][compress_body] HTTP request with Content-Encoding:\n%s<end>\n", request);
-    }
+/*
+ * Queue an encoded reply for a --directory file: a sibling `<name>.gz`
+ * (.br, .zst) at least as new as the file is sent as is, otherwise the
+ * file is compressed once at ENCODE_STATIC_LEVEL and the variant kept in
+ * the file cache; files above ENCODE_VARIANT_MAX are gzip'ed on the fly
+ * instead. A client that has the representation gets a 304 before
+ * anything is read or compressed. Returns 1 when no such body is
+ * available (too large for a variant, unreadable, out of memory) so the
+ * caller tries another coding. The caller keeps its reference.
+ */
+int serve_file_encoded(requestCtx* req, file_entry_t* p_file, char const* file_name, int encoding)
+{
+    conn_t* const c = req->c;
+    headerData const* const hd = req->hd;
+    response_t resp;
+    response_init(&resp, 200);
 
-    // compression
+    // precompressed sibling; most files have none, the cache remembers that too
     {
-        char* p_body_start = strstr(request, "\r\n\r\n") + 4;
-        size_t body_start_off = p_body_start - request;
-        size_t body_len = strlen(p_body_start) - body_start_off;
-
-        char request_header[BUFFER_SIZE + 1];
-        char compressed_body[BUFFER_SIZE - body_start_off + 1];
-        strncpy(request_header, request, body_start_off); // copy from beg to body
-
-        printf("[INFO][compress_body] HTTP body before compression <length=%lu>\n", strlen(p_body_start));
-        size_t compressed_size;
-        if (accept_encoding & ENCODING_TYPE_GZIP) {
-            compressed_size = compress_to_gzip(p_body_start, strlen(p_body_start), compressed_body, (BUFFER_SIZE - body_start_off));
-        }
-        printf("[INFO][compress_body] HTTP body after compression  <length=%lu>\n", compressed_size);
-
-        // put Content-Length
-        sprintf(request, request_header, compressed_size);
-        printf("[INFO][compress_body] Append Content-Encoding to response:\n%s<end>\n", request);
-
-        // copy compressed body back to send buffer
-        p_body_start = strstr(request, "\r\n\r\n") + 4;
-        body_start_off = p_body_start - request;
-        memset(p_body_start, 0, BUFFER_SIZE - body_start_off);
-        memcpy(p_body_start, compressed_body, compressed_size);
-        printf("[INFO][compress_body] finished copy compressed body\n");
-
-        new_size = body_start_off + compressed_size;
-    }
-
-    return new_size;
-}
-
-/*** header parser ***/
-
-#define MATCH_STRING(_str) strncmp(p_type_beg, _str, p_type_end - p_type_beg) == 0
-
-int parse_header(char const* const header_beg, char** end_ptr, headerData* data)
-{
-    char const* p_line_beg = header_beg;
-
-    while (*p_line_beg != '\r' && *p_line_beg != '\n') {
-        char const* const p_line_end = strstr(p_line_beg, "\r\n");
-        char const* const p_type_beg = p_line_beg;
-        char const* const p_type_end = strchr(p_type_beg, ':');
-
-        p_line_beg = p_type_end + 2; // skip ": "
-
-        if (MATCH_STRING("Host")) {
-            data->host = malloc(sizeof(char) * (p_line_end - p_line_beg + 1));
-            memcpy(data->host, p_line_beg, (p_line_end - p_line_beg));
-            data->host[p_line_end - p_line_beg] = '\0';
-            printf("data->host = |%s|\n", data->host);
-        } else if (MATCH_STRING("User-Agent")) {
-            data->user_agent = malloc(sizeof(char) * (p_line_end - p_line_beg + 1));
-            memcpy(data->user_agent, p_line_beg, (p_line_end - p_line_beg));
-            data->user_agent[p_line_end - p_line_beg] = '\0';
-            printf("data->user_agent = |%s|\n", data->user_agent);
-        } else if (MATCH_STRING("Accept")) {
-            data->accept = malloc(sizeof(char) * (p_line_end - p_line_beg + 1));
-            memcpy(data->accept, p_line_beg, (p_line_end - p_line_beg));
-            data->accept[p_line_end - p_line_beg] = '\0';
-            printf("data->accept = |%s|\n", data->accept);
-        } else if (MATCH_STRING("Accept-Encoding")) {
-            char tmp_str[p_line_end - p_line_beg + 1];
-            memcpy(tmp_str, p_line_beg, (p_line_end - p_line_beg));
-            tmp_str[p_line_end - p_line_beg] = '\0';
-            char* token = strtok(tmp_str, ", ");
-            printf("data->accept_encoding = ");
-            while (token != NULL) {
-                if (strcmp(token, "gzip") == 0) {
-                    data->accept_encoding |= ENCODING_TYPE_GZIP;
-                    printf("ENCODING_TYPE_GZIP | ");
+        LOCAL_STR_CONCAT(file_name, compress_ext(encoding), sz_sibling_name);
+        file_entry_t* p_sibling = file_cache_probe(sz_sibling_name);
+        if (p_sibling != NULL) {
+            if (p_sibling->mtime.tv_sec > p_file->mtime.tv_sec
+                || (p_sibling->mtime.tv_sec == p_file->mtime.tv_sec && p_sibling->mtime.tv_nsec >= p_file->mtime.tv_nsec)) {
+                // its own tag: a new sibling is a new representation
+                if (file_is_fresh(hd, p_file, p_sibling->etag)) {
+                    int const ret = reply_not_modified(req, p_file, p_sibling->etag);
+                    file_cache_put(p_sibling);
+                    return ret;
+                }
+                file_headers(&resp, p_file, p_sibling->etag);
+                response_header_str(&resp, "Content-Encoding", compress_name(encoding));
+                response_header_num(&resp, "Content-Length", p_sibling->size);
+                LOG_INFO("[REQ_GET_FILE] serve precompressed %s", sz_sibling_name);
+                request_replied(req, 200);
+                if (response_send(&resp, c) != 0) {
+                    file_cache_put(p_sibling);
+                    return -1;
                 }
-                token = strtok(NULL, ", ");
+                return conn_sendfile(c, p_sibling->fd, 0, p_sibling->size, file_cache_put, p_sibling);
             }
-            if (data->accept_encoding == ENCODING_TYPE_UNDEF) {
-                printf("ENCODING_TYPE_UNDEF");
+            file_cache_put(p_sibling);
+        }
+    }
+
+    char etag[FILE_ETAG_SIZE];
+    file_etag_encoded(etag, p_file, encoding);
+    if (file_is_fresh(hd, p_file, etag)) {
+        return reply_not_modified(req, p_file, etag);
+    }
+    file_headers(&resp, p_file, etag);
+
+    // in-memory variant
+    int const slot = __builtin_ctz(encoding);
+    file_variant_t const* p_variant = file_cache_variant(p_file, slot);
+    file_variant_t* palloc_variant = NULL;
+    if (p_variant == NULL) {
+        if (p_file->size > ENCODE_VARIANT_MAX) {
+            if (encoding != ENCODING_TYPE_GZIP) {
+                return 1;
             }
-            printf("\n");
-        } else if (MATCH_STRING("Content-Type")) {
-            data->content_type = malloc(sizeof(char) * (p_line_end - p_line_beg + 1));
-            memcpy(data->content_type, p_line_beg, (p_line_end - p_line_beg));
-            data->content_type[p_line_end - p_line_beg] = '\0';
-            printf("data->content_type = |%s|\n", data->content_type);
-        } else if (MATCH_STRING("Content-Length")) {
-            int tmp_errno = errno;
-            errno = 0;
-            char* ptr;
-            data->content_length = strtoul(p_line_beg, &ptr, 10);
-            if (errno != 0) {
-                printf("[ERROR][parse_header] content_length error: %s\n", strerror(errno));
-                errno = tmp_errno;
-                return -1;
+            // the stream holds its own reference until the last chunk is out
+            file_cache_ref(p_file);
+            gzip_stream_t* gs = gzip_stream_new(p_file->fd, NULL, p_file->size,
+                compress_level(p_file->size, GZIP_STREAM_LEVEL), file_cache_put, p_file);
+            if (gs == NULL) {
+                file_cache_put(p_file);
+                return 1;
             }
-            errno = tmp_errno;
-            printf("data->content_length = |%lu|\n", data->content_length);
-        } else {
-            char tstr[32];
-            size_t tstr_len = (p_line_end - p_line_beg > 31) ? 31 : p_line_end - p_line_beg;
-            memcpy(tstr, p_line_beg, tstr_len);
-            tstr[tstr_len] = '\0';
-            printf("[WARNING][parse_header] unhandled header type: %s\n", tstr);
+            LOG_INFO("[REQ_GET_FILE] stream gzip of %s (%lu bytes)", file_name, p_file->size);
+            request_replied(req, 200);
+            return serve_gzip_stream(c, &resp, gs);
+        }
+        palloc_variant = encode_variant(p_file, encoding);
+        if (palloc_variant == NULL) {
+            return 1;
+        }
+        p_variant = file_cache_set_variant(p_file, slot, palloc_variant);
+        if (p_variant != NULL)
+            palloc_variant = NULL; // the cache owns it now
+        else
+            p_variant = palloc_variant; // over budget: serve it once, then drop it
+    }
+
+    response_header_str(&resp, "Content-Encoding", compress_name(encoding));
+    response_header_num(&resp, "Content-Length", p_variant->len);
+    response_body(&resp, p_variant->data, p_variant->len);
+    request_replied(req, 200);
+    if (palloc_variant != NULL) {
+        return response_send_ref(&resp, c, free_release, palloc_variant);
+    }
+    // an extra reference on the entry keeps the variant alive until the body is out
+    file_cache_ref(p_file);
+    return response_send_ref(&resp, c, file_cache_put, p_file);
+}
+
+/* "--<boundary>" and the headers of one multipart/byteranges part into buf, its length */
+static int format_range_part(char* buf, size_t buf_size, char const* boundary, char const* content_type,
+    byte_range_t const* r, size_t size)
+{
+    return snprintf(buf, buf_size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+        boundary, content_type, r->off, r->off + r->len - 1, size);
+}
+
+/*
+ * Queue a 206 for ranges[0, num) of a --directory file, each one sent with
+ * sendfile(2) from its offset: a single range as the body itself, several
+ * as a multipart/byteranges body. The caller keeps its reference.
+ */
+int serve_file_ranges(conn_t* c, file_entry_t* p_file, byte_range_t const* ranges, int num)
+{
+    response_t resp;
+    response_init(&resp, 206);
+    response_header_str(&resp, "Accept-Ranges", "bytes");
+    response_header_str(&resp, "ETag", p_file->etag);
+    response_header_str(&resp, "Last-Modified", p_file->last_modified);
+    // the 200 of the same URL varies, so does every part of it
+    response_header_str(&resp, "Vary", "Accept-Encoding");
+    if (num == 1) {
+        char sz_range[64];
+        int const n = snprintf(sz_range, sizeof(sz_range), "bytes %zu-%zu/%zu",
+            ranges[0].off, ranges[0].off + ranges[0].len - 1, p_file->size);
+        response_header_str(&resp, "Content-Type", p_file->content_type);
+        response_header(&resp, "Content-Range", sz_range, n);
+        response_header_num(&resp, "Content-Length", ranges[0].len);
+        file_cache_ref(p_file);
+        if (response_send(&resp, c) != 0) {
+            file_cache_put(p_file);
+            return -1;
         }
+        return conn_sendfile(c, p_file->fd, ranges[0].off, ranges[0].len, file_cache_put, p_file);
+    }
+
+    // a boundary the parts can't be mistaken for: unique per response
+    static unsigned long s_seq;
+    char boundary[48];
+    snprintf(boundary, sizeof(boundary), "byteranges_%lx_%lx", (unsigned long)p_file->ino,
+        __atomic_add_fetch(&s_seq, 1, __ATOMIC_RELAXED));
+    char part[256];
+    size_t body_len = 0;
+    for (int i = 0; i < num; ++i) {
+        body_len += format_range_part(part, sizeof(part), boundary, p_file->content_type, &ranges[i], p_file->size)
+            + ranges[i].len;
+    }
+    int const tail_len = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+    body_len += tail_len;
+
+    char sz_type[96];
+    snprintf(sz_type, sizeof(sz_type), "multipart/byteranges; boundary=%s", boundary);
+    response_header_str(&resp, "Content-Type", sz_type);
+    response_header_num(&resp, "Content-Length", body_len);
+    if (response_send(&resp, c) != 0)
+        return -1;
+    for (int i = 0; i < num; ++i) {
+        int const n = format_range_part(part, sizeof(part), boundary, p_file->content_type, &ranges[i], p_file->size);
+        if (conn_write(c, part, n) != 0)
+            return -1;
+        // every part holds the entry until its bytes are out
+        file_cache_ref(p_file);
+        if (conn_sendfile(c, p_file->fd, ranges[i].off, ranges[i].len, file_cache_put, p_file) != 0)
+            return -1;
+    }
+    snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+    return conn_write(c, part, tail_len);
+}
 
-        p_line_beg = p_line_end + 2;
+/*
+ * Queue the identity reply for a --directory file: a 304 when the client
+ * has it, a 206 or 416 when ranges[0, num) came from range_parse(), the
+ * whole file otherwise. The caller keeps its reference.
+ */
+int serve_file(requestCtx* req, file_entry_t* p_file, byte_range_t const* ranges, int num)
+{
+    conn_t* const c = req->c;
+    headerData const* const hd = req->hd;
+    if (file_is_fresh(hd, p_file, p_file->etag)) {
+        LOG_DEBUG("[REQ_GET_FILE] %s not modified", p_file->name);
+        return reply_not_modified(req, p_file, p_file->etag);
+    }
+    if (num < 0) {
+        LOG_INFO("[REQ_GET_FILE] unsatisfiable range `%s` of %lu bytes", hd->range, p_file->size);
+        char sz_range[32];
+        int const n = snprintf(sz_range, sizeof(sz_range), "bytes */%zu", p_file->size);
+        response_t resp;
+        response_init(&resp, 416);
+        response_header(&resp, "Content-Range", sz_range, n);
+        response_header_num(&resp, "Content-Length", 0);
+        request_replied(req, 416);
+        return response_send(&resp, c);
+    }
+    if (num > 0) {
+        LOG_DEBUG("[REQ_GET_FILE] %d range(s) of %s", num, p_file->name);
+        request_replied(req, 206);
+        return serve_file_ranges(c, p_file, ranges, num);
+    }
+
+    // headers from the send buffer, body straight from the page cache;
+    // the connection holds the cache entry until the body is out
+    response_t resp;
+    response_init(&resp, 200);
+    file_headers(&resp, p_file, p_file->etag);
+    response_header_str(&resp, "Accept-Ranges", "bytes");
+    response_header_num(&resp, "Content-Length", p_file->size);
+    LOG_DEBUG("[REQ_GET_FILE] sendfile %lu bytes", p_file->size);
+    request_replied(req, 200);
+    if (response_send(&resp, c) != 0) {
+        return -1;
+    }
+    file_cache_ref(p_file);
+    return conn_sendfile(c, p_file->fd, 0, p_file->size, file_cache_put, p_file);
+}
+
+/*** uploads ***/
+
+/* file a POST /files/ request writes to, -1 when it is not one we accept (reply 404) */
+int post_file_path(headerData const* hd, char* out, size_t out_size)
+{
+    if (strncmp(hd->request, REQ_FILE, strlen(REQ_FILE)) != 0 || hd->content_type == NULL
+        || strncmp(hd->content_type, "application/octet-stream", strlen("application/octet-stream")) != 0) {
+        return -1;
+    }
+    if (g_args.file_path == NULL) {
+        LOG_WARNING("[REQ_POST_FILE]: post files requires path arguments '--directory'");
+        return -1;
+    }
+    char const* const file_name = hd->request + strlen(REQ_FILE);
+    if (!file_cache_name_is_safe(file_name)) {
+        LOG_INFO("[REQ_POST_FILE]: refuse file name `%s`", file_name);
+        return -1;
+    }
+    if ((size_t)snprintf(out, out_size, "%s%s", g_args.file_path, file_name) >= out_size) {
+        return -1;
     }
-    *end_ptr = (char*)p_line_beg;
     return 0;
 }
 
-#undef MATCH_STRING
+/*
+ * c->sink of a streamed upload: what serve_request() keeps of a request
+ * for the whole of its body. It holds an admission_enter() slot.
+ */
+typedef struct {
+    upload_t* up;
+    uint64_t t_beg;
+    char request[PATH_MAX]; /* target, for the access log */
+} streamed_upload_t;
 
-/* (*unsafe) get alloc copy of request */
-headerData* parse_request(char const* const request)
+/* sink_release of a streamed upload whose connection died first */
+static void streamed_upload_abort(void* p)
 {
-    headerData* data = malloc(sizeof(headerData));
-    if (data == NULL) {
-        puts("[ERROR][parse_request] malloc for headerData failed!");
-        return NULL;
+    streamed_upload_t* su = p;
+    upload_abort(su->up);
+    admission_leave();
+    free(su);
+}
+
+/*
+ * Headers of the request at p_req are complete, its body is not. A POST to
+ * /files/ is taken over here: its body is streamed into the file as it
+ * arrives instead of being buffered (or drained, when the request is
+ * refused). It is admitted, timed and logged like the requests
+ * serve_request() answers, a body above --max-upload gets 413 unread.
+ * Returns 1 once the headers are consumed and c->sink is set, or the
+ * request got its 413 or 503, 0 to leave the request to the parser, -1 on
+ * failure.
+ */
+int begin_upload(conn_t* c, char* p_req, size_t* p_off)
+{
+    http_parser_t const* const p = &c->parser;
+    if (strncmp(p_req + p->skip, "POST " REQ_FILE, strlen("POST " REQ_FILE)) != 0) {
+        return 0;
+    }
+    if (p->content_length > g_args.max_upload) {
+        LOG_INFO("[REQ_POST_FILE]: refuse a body of %lu bytes", p->content_length);
+        // the body is never read, so the connection can't go on
+        c->closing = 1;
+        return reply_status(c, 413) != 0 ? -1 : 1;
     }
-    *data = (headerData) { 0 };
 
-    char const* p_beg = request;
-    /* req_type */
-    {
-        char const* const p_end = strchr(p_beg, ' ');
-        if (p_end == NULL) {
-            puts("[ERROR][parse_request] can't locate req_type");
-            goto HANDLE_ERROR;
-        }
-        if (strncmp(p_beg, "GET", p_end - p_beg) == 0) {
-            data->req_type = REQ_TYPE_GET;
-            puts("data->req_type = REQ_TYPE_GET");
-        } else if (strncmp(p_beg, "POST", p_end - p_beg) == 0) {
-            data->req_type = REQ_TYPE_POST;
-            puts("data->req_type = REQ_TYPE_POST");
-        } else {
-            puts("[WARNING][parse_request] undefined REQ_TYPE_POST!");
+    uint64_t const t_beg = metrics_now_ns();
+    if (admit_request(c, t_beg) != 0) {
+        // the body is never read, the connection closes behind the 503
+        return reply_unavailable(c) != 0 ? -1 : 1;
+    }
+    streamed_upload_t* su = malloc(sizeof(streamed_upload_t));
+    if (su == NULL) {
+        admission_leave();
+        return -1;
+    }
+    su->t_beg = t_beg;
+    strcpy(su->request, "-");
+
+    // parse_request() wants a terminated request, the body starts behind it
+    char sz_full_path[PATH_MAX];
+    char const* p_path = NULL;
+    char const saved = p_req[p->header_len];
+    p_req[p->header_len] = '\0';
+    headerData hd;
+    if (parse_request(p_req + p->skip, p->header_len - p->skip, &hd) == 0) {
+        snprintf(su->request, sizeof(su->request), "%s", hd.request);
+        if (post_file_path(&hd, sz_full_path, sizeof(sz_full_path)) == 0) {
+            p_path = sz_full_path;
         }
-        p_beg = p_end + 1;
     }
-    /* request */
-    {
-        char const* const p_end = strchr(p_beg, ' ');
-        if (p_end == NULL) {
-            puts("[ERROR][parse_request] can't locate request");
-            goto HANDLE_ERROR;
-        }
-        data->request = malloc(sizeof(char) * (p_end - p_beg + 1));
-        memcpy(data->request, p_beg, p_end - p_beg);
-        data->request[p_end - p_beg] = '\0';
-        printf("data->request = |%s|\n", data->request);
-        p_beg = p_end + 1;
-    }
-    /* http_ver */
-    {
-        char const* const p_end = strstr(p_beg, "\r\n");
-        if (p_end == NULL) {
-            puts("[ERROR][parse_request] can't locate http_ver");
-            goto HANDLE_ERROR;
+    p_req[p->header_len] = saved;
+    metrics_record(METRIC_PARSE, metrics_now_ns() - t_beg);
+
+    su->up = upload_begin(p_path, p->content_length);
+    if (su->up == NULL && p_path != NULL) {
+        // keep the framing: drain the body, answer 500 once it is in
+        su->up = upload_begin(NULL, p->content_length);
+        if (su->up != NULL) {
+            su->up->error = EIO;
+        }
+    }
+    if (su->up == NULL) {
+        admission_leave();
+        free(su);
+        return -1;
+    }
+    LOG_DEBUG("[REQ_POST_FILE]: stream %lu bytes to %s", p->content_length, p_path ? p_path : "(drain)");
+
+    c->sink = su;
+    c->sink_release = streamed_upload_abort;
+    *p_off += p->header_len;
+    http_parser_reset(&c->parser);
+    return 1;
+}
+
+/*
+ * Move body bytes of the upload in c->sink into its file: what is buffered
+ * at recv_buf[*p_off] first, then straight from the socket, but never past
+ * the body so a pipelined request stays where the parser finds it. Replies
+ * and clears c->sink once the body is complete.
+ */
+int feed_upload(conn_t* c, size_t* p_off)
+{
+    streamed_upload_t* su = c->sink;
+    upload_t* p_up = su->up;
+
+    size_t const buffered = c->recv_len - *p_off < p_up->left ? c->recv_len - *p_off : p_up->left;
+    upload_write(p_up, c->recv_buf + *p_off, buffered);
+    *p_off += buffered;
+
+    while (p_up->left > 0) {
+        size_t const want = p_up->left < UPLOAD_BUF_SIZE ? p_up->left : UPLOAD_BUF_SIZE;
+        ssize_t const got = conn_read(c, p_up->buf, want);
+        if (got == 0) {
+            return -1;
         }
-        if (strncmp(p_beg, "HTTP/1.1", strlen("HTTP/1.1")) == 0) {
-            data->http_ver = HTTP_V11;
+        if (got == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        upload_write(p_up, p_up->buf, got);
+    }
+
+    c->sink = NULL;
+    c->sink_release = NULL;
+    int status;
+    if (p_up->path == NULL && p_up->error == 0) {
+        upload_commit(p_up);
+        status = 404;
+    } else {
+        LOCAL_STR_COPY(p_up->path ? p_up->path + strlen(g_args.file_path) : "", file_name);
+        if (upload_commit(p_up) == 0) {
+            file_cache_invalidate(file_name);
+            status = 201;
         } else {
-            puts("[ERROR][parse_request] http version undefined!");
-            data->http_ver = HTTP_VUNDEF;
+            status = 500;
         }
-        p_beg = p_end + 2;
     }
-    /* headers */
-    {
-        char* end_ptr = NULL;
-        if (parse_header(p_beg, &end_ptr, data) != 0) {
-            goto HANDLE_ERROR;
+    count_request(c);
+    int const ret = reply_status(c, status);
+    metrics_record(METRIC_ROUTE_FILES, metrics_now_ns() - su->t_beg);
+    LOG_ACCESS("POST %s %d", su->request, status);
+    admission_leave();
+    free(su);
+    return ret;
+}
+
+/*** routes ***/
+
+/*
+ * text/plain body[0, len), encoded as the client prefers when it is worth
+ * it: in one go when short, gzip streamed otherwise
+ */
+int reply_text(requestCtx* req, char const* body, size_t len)
+{
+    request_replied(req, 200);
+    int const encoding = compress_worthwhile(len, "text/plain")
+        ? compress_pick(req->hd->accept_encoding, req->hd->accept_q,
+            len > ENCODE_INLINE_MAX ? ENCODING_TYPE_GZIP : compress_available())
+        : ENCODING_TYPE_UNDEF;
+    int const level = encoding != ENCODING_TYPE_UNDEF ? compress_level(len, GZIP_STREAM_LEVEL) : 0;
+    gzip_stream_t* gs = NULL;
+    if (encoding != ENCODING_TYPE_UNDEF && len > ENCODE_INLINE_MAX
+        && (gs = gzip_stream_new(-1, body, len, level, NULL, NULL)) != NULL) {
+        response_t resp;
+        response_init(&resp, 200);
+        response_header_str(&resp, "Content-Type", "text/plain");
+        return serve_gzip_stream(req->c, &resp, gs);
+    }
+
+    response_t resp;
+    response_init(&resp, 200);
+    response_header_str(&resp, "Content-Type", "text/plain");
+    char encoded[ENCODE_INLINE_MAX + 128]; // + framing and stored block overhead of any codec
+    int const encoded_len = encoding != ENCODING_TYPE_UNDEF && len <= ENCODE_INLINE_MAX
+        ? compress_encode(encoding, body, len, encoded, sizeof(encoded), level)
+        : -1;
+    if (encoded_len >= 0) {
+        response_header_str(&resp, "Content-Encoding", compress_name(encoding));
+        response_header_num(&resp, "Content-Length", encoded_len);
+        response_body(&resp, encoded, encoded_len);
+    } else {
+        response_header_num(&resp, "Content-Length", len);
+        response_body(&resp, body, len);
+    }
+    return response_send(&resp, req->c);
+}
+
+int route_root(void* arg, char const* rest, size_t rest_len)
+{
+    (void)rest;
+    (void)rest_len;
+    ((requestCtx*)arg)->status = 200;
+    return 0;
+}
+
+int route_user_agent(void* arg, char const* rest, size_t rest_len)
+{
+    (void)rest;
+    (void)rest_len;
+    requestCtx* const req = arg;
+    if (req->hd->user_agent == NULL) {
+        return reply_text(req, "", 0);
+    }
+    return reply_text(req, req->hd->user_agent, req->hd->user_agent_len);
+}
+
+int route_echo(void* arg, char const* rest, size_t rest_len)
+{
+    return reply_text(arg, rest, rest_len);
+}
+
+int route_get_file(void* arg, char const* file_name, size_t file_name_len)
+{
+    (void)file_name_len;
+    requestCtx* const req = arg;
+    if (g_args.file_path == NULL) {
+        LOG_WARNING("[REQ_GET_FILE]: target files requires path arguments '--directory'");
+        return 0;
+    }
+    LOG_DEBUG("[REQ_GET_FILE] load from file: %s", file_name);
+    file_entry_t* p_file = file_cache_get(file_name);
+    if (p_file == NULL) {
+        LOG_INFO("[REQ_GET_FILE]: file `%s` doesn't exists", file_name);
+        return 0;
+    }
+
+    // ranges are of the identity body, a ranged request is never compressed;
+    // otherwise the client's favourite coding we can make, the next one when that fails
+    byte_range_t ranges[RANGE_MAX];
+    int const num_ranges = req->hd->range != NULL && file_if_range(req->hd, p_file)
+        ? range_parse(req->hd->range, req->hd->range_len, p_file->size, ranges)
+        : 0;
+    int ret = 1;
+    int offered = num_ranges == 0 && compress_worthwhile(p_file->size, p_file->content_type)
+        ? compress_available()
+        : ENCODING_TYPE_UNDEF;
+    while (ret == 1) {
+        int const encoding = compress_pick(req->hd->accept_encoding, req->hd->accept_q, offered);
+        if (encoding == ENCODING_TYPE_UNDEF)
+            break;
+        ret = serve_file_encoded(req, p_file, file_name, encoding);
+        offered &= ~encoding;
+    }
+    if (ret == 1) {
+        ret = serve_file(req, p_file, ranges, num_ranges);
+    }
+    file_cache_put(p_file);
+    return ret;
+}
+
+int route_metrics(void* arg, char const* rest, size_t rest_len)
+{
+    (void)rest;
+    (void)rest_len;
+    requestCtx* const req = arg;
+    size_t len;
+    char* text = metrics_render(&len);
+    if (text == NULL) {
+        req->status = 500;
+        return 0;
+    }
+    request_replied(req, 200);
+    response_t resp;
+    response_init(&resp, 200);
+    response_header_str(&resp, "Content-Type", "text/plain; version=0.0.4");
+    response_header_num(&resp, "Content-Length", len);
+    response_body(&resp, text, len);
+    return response_send_ref(&resp, req->c, free, text);
+}
+
+/* a POST whose body was buffered whole, bigger ones are taken by begin_upload() */
+int route_post_file(void* arg, char const* rest, size_t rest_len)
+{
+    (void)rest;
+    (void)rest_len;
+    requestCtx* const req = arg;
+    char sz_full_path[PATH_MAX];
+    if (post_file_path(req->hd, sz_full_path, sizeof(sz_full_path)) != 0) {
+        return 0;
+    }
+    if (req->hd->body_len > g_args.max_upload) {
+        req->status = 413;
+        return 0;
+    }
+    LOG_DEBUG("[REQ_POST_FILE]: target file full path: %s, %lu bytes", sz_full_path, req->hd->body_len);
+    upload_t* p_up = upload_begin(sz_full_path, req->hd->body_len);
+    if (p_up != NULL) {
+        upload_write(p_up, req->hd->body, req->hd->body_len);
+    }
+    if (p_up != NULL && upload_commit(p_up) == 0) {
+        file_cache_invalidate(req->hd->request + strlen(REQ_FILE));
+        req->status = 201;
+    } else {
+        req->status = 500;
+    }
+    return 0;
+}
+
+/* a new endpoint is one more line here */
+static struct {
+    int method;
+    char const* path;
+    int match;
+    route_fn fn;
+    int metric; /* METRIC_ROUTE_* its latency is recorded under */
+} const g_route_table[] = {
+    { REQ_TYPE_GET, REQ_ROOT, ROUTE_EXACT, route_root, METRIC_ROUTE_ROOT },
+    { REQ_TYPE_GET, REQ_USER_AGENT, ROUTE_EXACT, route_user_agent, METRIC_ROUTE_USER_AGENT },
+    { REQ_TYPE_GET, REQ_ECHO, ROUTE_PREFIX, route_echo, METRIC_ROUTE_ECHO },
+    { REQ_TYPE_GET, REQ_FILE, ROUTE_PREFIX, route_get_file, METRIC_ROUTE_FILES },
+    { REQ_TYPE_GET, REQ_METRICS, ROUTE_EXACT, route_metrics, METRIC_ROUTE_METRICS },
+    { REQ_TYPE_POST, REQ_FILE, ROUTE_PREFIX, route_post_file, METRIC_ROUTE_FILES },
+};
+
+int init_routes(void)
+{
+    for (size_t i = 0; i < sizeof(g_route_table) / sizeof(g_route_table[0]); ++i) {
+        if (router_add(&g_router, g_route_table[i].method, g_route_table[i].path, g_route_table[i].match, g_route_table[i].fn, g_route_table[i].metric) != 0) {
+            LOG_ERROR("[init_routes] can't add route %s", g_route_table[i].path);
+            return -1;
         }
-        p_beg = end_ptr;
     }
-    /* body */
-    {
-        char const* const p_body_beg = strstr(request, "\r\n\r\n") + strlen("\r\n\r\n");
-        data->body = malloc(sizeof(char) * (strlen(p_body_beg) + 1));
-        memcpy(data->body, p_body_beg, strlen(p_body_beg));
-        data->body[strlen(p_body_beg)] = '\0';
-        printf("data->body: \n%s<end>\n\n", data->body);
+    return 0;
+}
+
+/*** connection ***/
+
+/* answer one complete, NUL-terminated request, which is parsed in place */
+int serve_request(conn_t* c, char* request, size_t request_len)
+{
+    int ret = 0;
+
+    LOG_DEBUG("Received message success:\n"
+              "<length=%ld>\n"
+              "/***content-beg***/\n"
+              "%s<end>\n"
+              "/***content-end***/",
+        (long)request_len, request);
+
+    uint64_t const t_beg = metrics_now_ns();
+    if (admit_request(c, t_beg) != 0) {
+        return reply_unavailable(c);
+    }
+
+    headerData hd;
+    int const parsed = parse_request(request, request_len, &hd);
+    uint64_t const t_parsed = metrics_now_ns();
+    metrics_record(METRIC_PARSE, t_parsed - t_beg);
+    if (parsed == 0) {
+        if (hd.connection_close) {
+            c->closing = 1;
+        }
+        count_request(c);
+        requestCtx req = {
+            .c = c,
+            .hd = &hd,
+            .status = 404,
+        };
+        size_t rest_off = 0;
+        route_t const* const route = router_find(&g_router, hd.req_type, hd.request, hd.request_len, &rest_off);
+        if (route != NULL) {
+            ret = route->fn(&req, hd.request + rest_off, hd.request_len - rest_off);
+        } else if (hd.req_type == REQ_TYPE_UNDEF) {
+            LOG_WARNING("[serve_request] Request type undefined");
+        }
+
+        // routes with a body queued their own response
+        if (!req.sent && reply_status(c, req.status) != 0) {
+            ret = -1;
+        }
+        metrics_record(route != NULL ? route->id : METRIC_ROUTE_NONE, metrics_now_ns() - t_beg);
+
+        LOG_ACCESS("%s %s %d",
+            hd.req_type == REQ_TYPE_GET ? "GET" : (hd.req_type == REQ_TYPE_POST ? "POST" : "-"),
+            hd.request, req.status);
+    } else {
+        // framed but unparseable, e.g. more header lines than the index holds
+        c->closing = 1;
+        ret = reply_status(c, 400);
     }
 
-    return data;
+    admission_leave();
+    return ret;
+}
+
+/* conn_handler_fn: answer every complete request buffered in c->recv_buf */
+int handle_request(conn_t* c)
+{
+    size_t off = 0;
+    int ret = 0;
+
+    conn_cork(c);
+    while (ret == 0 && !c->closing) {
+        if (c->sink != NULL) {
+            // body of a streamed upload, the next request starts behind it
+            ret = feed_upload(c, &off);
+            if (c->sink != NULL) {
+                break;
+            }
+            continue;
+        }
 
-HANDLE_ERROR:
-    free_header_data(data);
-    return NULL;
+        char* const p_req = c->recv_buf + off;
+        int status = http_parser_feed(&c->parser, p_req, c->recv_len - off);
+        if (status == HTTP_PARSE_HEADERS) {
+            int const taken = begin_upload(c, p_req, &off);
+            if (taken != 0) {
+                ret = taken < 0 ? -1 : 0;
+                continue;
+            }
+            // buffer the body after all, asking again refuses one that can never fit
+            status = http_parser_feed(&c->parser, p_req, c->recv_len - off);
+        }
+        if (status == HTTP_PARSE_AGAIN) {
+            break;
+        }
+        if (status == HTTP_PARSE_ERROR) {
+            LOG_INFO("[handle_request] malformed request, reply %d", c->parser.error);
+            // framing is lost, nothing after this point can be trusted
+            c->closing = 1;
+            ret = reply_status(c, c->parser.error);
+            break;
+        }
+
+        // pipelined requests follow right behind, cut this one out temporarily
+        size_t const req_len = http_parser_request_len(&c->parser);
+        char const saved = p_req[req_len];
+        p_req[req_len] = '\0';
+        ret = serve_request(c, p_req + c->parser.skip, req_len - c->parser.skip);
+        p_req[req_len] = saved;
+
+        off += req_len;
+        http_parser_reset(&c->parser);
+        c->head_since = 0;
+    }
+
+    conn_consume(c, off);
+    // the replies to everything this read brought leave together
+    if (conn_uncork(c) < 0) {
+        ret = -1;
+    }
+    return ret;
 }
 
 /*** threads ***/
 
-/* pthread func that handle one client request */
+/* pthread func that handle one client connection */
 void* handle_connection(void* p_tparams)
 {
-    int client_fd = ((tParams*)p_tparams)->client_fd;
+    conn_t* c = conn_new(((tParams*)p_tparams)->client_fd);
+    free(p_tparams);
+    if (c == NULL) {
+        pthread_exit(NULL);
+    }
+
+    // a stuck client blocks send(2) at most this long
+    struct timeval tv_send = {
+        .tv_sec = g_args.timeouts.idle_ms / 1000,
+        .tv_usec = g_args.timeouts.idle_ms % 1000 * 1000,
+    };
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv_send, sizeof(tv_send));
 
     while (1) {
-        char sz_recv_buf[BUFFER_SIZE + 1];
-        char sz_send_buf[BUFFER_SIZE + 1];
-        char const* sz_send_message = reply_404;
+        // no wheel here: recv(2) itself gives up at the deadline
+        uint64_t const now = timer_now_ms();
+        uint64_t const deadline = conn_deadline(c, &g_args.timeouts, now);
+        if (deadline <= now) {
+            LOG_INFO("[handle_connection] connection %d timed out", c->fd);
+            break;
+        }
+        struct timeval tv_recv = {
+            .tv_sec = (deadline - now) / 1000,
+            .tv_usec = (deadline - now) % 1000 * 1000,
+        };
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv_recv, sizeof(tv_recv));
 
-        ssize_t const recv_numbytes = recv(client_fd, sz_recv_buf, BUFFER_SIZE, 0);
+        ssize_t const recv_numbytes = conn_recv(c);
         if (recv_numbytes == -1) {
-            printf("Recv failed: %s \n", strerror(errno));
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                LOG_INFO("[handle_connection] connection %d timed out", c->fd);
+            } else {
+                LOG_WARNING("[handle_connection] recv failed: %s", strerror(errno));
+            }
             break;
         } else if (recv_numbytes == 0) {
-            printf("Connection %d closed\n", client_fd);
+            LOG_INFO("[handle_connection] connection %d closed", c->fd);
+            break;
+        }
+        if (handle_request(c) < 0 || c->closing)
+            break;
+        // blocking socket: output is only left pending when send(2) hit SO_SNDTIMEO
+        if (conn_has_pending(c)) {
+            LOG_INFO("[handle_connection] connection %d send timed out", c->fd);
             break;
-        } else {
-            printf("Received message success:\n"
-                   "<length=%ld>\n"
-                   "/***content-beg***/\n"
-                   "%s<end>\n"
-                   "/***content-end***/\n",
-                recv_numbytes, sz_recv_buf);
         }
+    }
 
-        headerData* palloc_hd = parse_request(sz_recv_buf);
-        if (palloc_hd != NULL) {
+    conn_free(c);
 
-            char sz_content_length[30] = "\%lu";
-            int b_need_compress = 0;
-            if (palloc_hd->accept_encoding != ENCODING_TYPE_UNDEF) {
-                b_need_compress = 1;
-            }
+    pthread_exit(NULL);
+}
 
-            if (palloc_hd->req_type == REQ_TYPE_GET) {
-                /* GET */
-                if (strcmp(palloc_hd->request, REQ_USER_AGENT) == 0) {
-                    if (!b_need_compress) {
-                        sprintf(sz_content_length, "%lu", strlen(palloc_hd->user_agent));
-                    }
-                    fill_fmt_reply_200(sz_send_buf, "text/plain", sz_content_length, "", palloc_hd->user_agent);
-                    sz_send_message = sz_send_buf;
-                } else if (strncmp(palloc_hd->request, REQ_FILE, strlen(REQ_FILE)) == 0) {
-                    if (g_args.file_path == NULL) {
-                        printf("[ERROR][REQ_GET_FILE]: target files requires path arguments '--directory'\n");
-                        sz_send_message = reply_404;
-                    } else {
-                        char const* const p_beg = palloc_hd->request + strlen(REQ_FILE);
-                        LOCAL_STR_COPY(p_beg, file_name);
-                        LOCAL_STR_CONCAT(g_args.file_path, file_name, sz_full_path);
-                        printf("[INFO][REQ_GET_FILE] load from file full path: %s\n", sz_full_path);
-                        size_t buf_size;
-                        if (file_exists(sz_full_path) && (buf_size = file_size(sz_full_path)) != (size_t)-1) {
-                            char sz_temp_buf[buf_size + 1];
-                            read_file(sz_full_path, sz_temp_buf, buf_size);
-                            sz_temp_buf[buf_size] = '\0';
-                            printf("=== read content: ===\n%s\n=====================\n", sz_temp_buf);
-
-                            if (!b_need_compress) {
-                                sprintf(sz_content_length, "%lu", strlen(sz_temp_buf));
-                            }
-                            fill_fmt_reply_200(sz_send_buf, "application/octet-stream", sz_content_length, "", sz_temp_buf);
-                            sz_send_message = sz_send_buf;
-                        } else {
-                            printf("[ERROR][REQ_GET_FILE]: file `%s` doesn't exists\n", file_name);
-                            sz_send_message = reply_404;
-                        }
-                    }
-                } else if (strncmp(palloc_hd->request, REQ_ECHO, strlen(REQ_ECHO)) == 0) {
-                    char const* const sz_echo_str = palloc_hd->request + strlen(REQ_ECHO);
-                    if (!b_need_compress) {
-                        sprintf(sz_content_length, "%lu", strlen(sz_echo_str));
-                    }
-                    fill_fmt_reply_200(sz_send_buf, "text/plain", sz_content_length, "", sz_echo_str);
-                    sz_send_message = sz_send_buf;
-                } else if (strcmp(palloc_hd->request, REQ_ROOT) == 0) {
-                    sz_send_message = reply_200;
-                } else {
-                    sz_send_message = reply_404;
-                }
-            } else if (palloc_hd->req_type == REQ_TYPE_POST) {
-                /* POST */
-                if (strncmp(palloc_hd->request, REQ_FILE, strlen(REQ_FILE)) == 0) {
-                    if (strncmp(palloc_hd->content_type, "application/octet-stream", strlen("application/octet-stream")) == 0) {
-                        /* request write to file */
-                        if (g_args.file_path == NULL) {
-                            printf("[ERROR][REQ_POST_FILE]: post files requires path arguments '--directory'\n");
-                            sz_send_message = reply_404;
-                        } else {
-                            char const* const p_beg = palloc_hd->request + strlen(REQ_FILE);
-                            LOCAL_STR_COPY(p_beg, file_name);
-                            LOCAL_STR_CONCAT(g_args.file_path, file_name, sz_full_path);
-                            printf("[INFO][REQ_POST_FILE]: target file full path: %s\ncontent: \n|%s|\n", sz_full_path, palloc_hd->body);
-                            write_file(sz_full_path, palloc_hd->body);
-                            sz_send_message = reply_201;
-                        }
-                    } else {
-                        sz_send_message = reply_404;
-                    }
-                } else {
-                    sz_send_message = reply_404;
-                }
-            } else {
-                puts("[ERROR]: Request type undefined");
-                sz_send_message = reply_404;
-            }
 
-            // http compression
-            if (b_need_compress) {
-                // only if send message has body
-                size_t new_size = strlen(palloc_hd->body);
-                if (sz_send_message == sz_send_buf) {
-                    new_size = compress_body(sz_send_buf, palloc_hd->accept_encoding);
-                    printf("[INFO] sz_send_message is:\n%s<end>\n", sz_send_message);
-                }
+/*** sockets ***/
 
-                // send
-                const int sent_numbytes = send(client_fd, sz_send_message, new_size, 0);
-                if (sent_numbytes == -1) {
-                    printf("Send failed: %s \n", strerror(errno));
-                } else {
-                    printf("Send message success:\n"
-                           "/***content-beg***/\n"
-                           "%s<end>\n"
-                           "/***content-end***/\n",
-                        sz_send_message);
-                }
-            } else {
-                // dont' need compression
-                const int sent_numbytes = send(client_fd, sz_send_message, strlen(sz_send_message), 0);
-                if (sent_numbytes == -1) {
-                    printf("Send failed: %s \n", strerror(errno));
-                } else {
-                    printf("Send message success:\n"
-                           "/***content-beg***/\n"
-                           "%s<end>\n"
-                           "/***content-end***/\n",
-                        sz_send_message);
-                }
+/* bound and listening TCP socket on --port, -1 on failure */
+int open_listener(int reuse_port)
+{
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        LOG_ERROR("[open_listener] socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // Since the tester restarts your program quite often, setting SO_REUSEADDR
+    // ensures that we don't run into 'Address already in use' errors
+    int reuse = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        LOG_ERROR("[open_listener] SO_REUSEADDR failed: %s", strerror(errno));
+        goto HANDLE_ERROR;
+    }
+    // every shard binds the same port, the kernel spreads new connections
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        LOG_ERROR("[open_listener] SO_REUSEPORT failed: %s", strerror(errno));
+        goto HANDLE_ERROR;
+    }
+    // inherited by accepted sockets; conn_flush() packs a batch itself, Nagle would only hold
+    // back the tail of a reply until the client's delayed ACK
+    int nodelay = 1;
+    if (setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
+        LOG_WARNING("[open_listener] TCP_NODELAY failed: %s", strerror(errno));
+    }
+
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(g_args.port),
+        .sin_addr = { htonl(INADDR_ANY) },
+    };
+
+    if (bind(server_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
+        LOG_ERROR("[open_listener] bind failed: %s", strerror(errno));
+        goto HANDLE_ERROR;
+    }
+
+    if (listen(server_fd, g_args.backlog) != 0) {
+        LOG_ERROR("[open_listener] listen failed: %s", strerror(errno));
+        goto HANDLE_ERROR;
+    }
+    return server_fd;
+
+HANDLE_ERROR:
+    close(server_fd);
+    return -1;
+}
+
+/* listener number index: the one inherited from the previous process, or a new one */
+int take_listener(int index, int reuse_port)
+{
+    int const server_fd = index < g_listeners.num_inherited ? g_listeners.fds[index] : open_listener(reuse_port);
+    if (server_fd != -1 && index < MAX_PTHREAD_NUM) {
+        __atomic_store_n(&g_listeners.fds[index], server_fd, __ATOMIC_RELEASE);
+    }
+    return server_fd;
+}
+
+/* handoff_fds_fn: every listener open so far */
+int list_listeners(int* fds, int max)
+{
+    int num = 0;
+    for (int i = 0; i < MAX_PTHREAD_NUM && num < max; ++i) {
+        int const fd = __atomic_load_n(&g_listeners.fds[i], __ATOMIC_ACQUIRE);
+        if (fd != -1) {
+            fds[num++] = fd;
+        }
+    }
+    return num;
+}
+
+/* pthread func of one SO_REUSEPORT shard: own listener, own reactor, pinned to a cpu */
+void* run_shard(void* p_sparams)
+{
+    int const cpu = ((shardParams*)p_sparams)->cpu;
+    free(p_sparams);
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu % tpool_default_threads(), &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+        LOG_WARNING("[run_shard] pin shard %d failed", cpu);
+    }
+
+    int server_fd = take_listener(cpu, 1);
+    if (server_fd != -1) {
+        LOG_INFO("[run_shard] shard %d waiting for a client to connect...", cpu);
+        if (g_args.serve_mode == SERVE_MODE_URING) {
+            uring_run(server_fd, handle_request, &g_args.timeouts);
+        } else {
+            reactor_run(server_fd, handle_request, NULL, &g_args.timeouts);
+        }
+        close(server_fd);
+    }
+    return NULL;
+}
+
+/*** upgrade ***/
+
+/* open the files the previous process had cached and rebuild their variants, before taking over */
+void warm_start(char* snapshot)
+{
+    size_t num_files = 0;
+    size_t num_variants = 0;
+    uint64_t const t_beg = metrics_now_ns();
+    char* save = NULL;
+    for (char* line = strtok_r(snapshot, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        char* name;
+        unsigned long const mask = strtoul(line, &name, 16);
+        if (*name != ' ') {
+            continue;
+        }
+        file_entry_t* p_file = file_cache_get(name + 1);
+        if (p_file == NULL) {
+            continue;
+        }
+        ++num_files;
+        // the page cache outlives us, unless the files were pushed out meanwhile
+        posix_fadvise(p_file->fd, 0, 0, POSIX_FADV_WILLNEED);
+        for (int slot = 0; slot < FILE_VARIANTS && p_file->size <= ENCODE_VARIANT_MAX; ++slot) {
+            int const encoding = 1 << slot;
+            if (!(mask & encoding) || !(compress_available() & encoding) || file_cache_variant(p_file, slot) != NULL) {
+                continue;
             }
+            file_variant_t* palloc_variant = encode_variant(p_file, encoding);
+            if (palloc_variant == NULL) {
+                continue;
+            }
+            if (file_cache_set_variant(p_file, slot, palloc_variant) == NULL) {
+                free(palloc_variant);
+                continue;
+            }
+            ++num_variants;
         }
-        free_header_data(palloc_hd);
+        file_cache_put(p_file);
     }
+    LOG_INFO("[warm_start] %zu file(s) and %zu variant(s) ready in %lu ms", num_files, num_variants,
+        (unsigned long)((metrics_now_ns() - t_beg) / 1000000));
+}
 
-    close(client_fd);
-    free(p_tparams);
+/* handoff_snapshot_fn */
+char* snapshot_files(size_t* p_len)
+{
+    return g_args.file_path != NULL ? file_cache_snapshot(p_len) : NULL;
+}
 
-    pthread_exit(NULL);
+/* after a handoff: the new process accepts now, finish the connections we have and exit */
+void drain_and_exit(void)
+{
+    reactor_drain();
+    uint64_t const deadline = timer_now_ms() + g_args.drain_ms;
+    // a connection accepted right before the drain began may not be counted yet, zero has to hold twice
+    int num_idle = 0;
+    while (num_idle < 2 && timer_now_ms() < deadline) {
+        num_idle = conn_live() == 0 ? num_idle + 1 : 0;
+        usleep(DRAIN_POLL_MS * 1000);
+    }
+    LOG_INFO("[main] drained, %u connection(s) cut, exit", conn_live());
+    log_shutdown();
+    _exit(EXIT_SUCCESS);
+}
+
+/*
+ * With --upgrade-socket, take the listeners and the hot files over from a
+ * server already there, then wait on the socket for the next upgrade.
+ * Returns 0 when serving may go on, -1 on failure.
+ */
+int upgrade_init(void)
+{
+    for (int i = 0; i < MAX_PTHREAD_NUM; ++i) {
+        g_listeners.fds[i] = -1;
+    }
+    if (g_args.upgrade_path == NULL) {
+        return 0;
+    }
+
+    handoff_t h;
+    if (handoff_receive(g_args.upgrade_path, &h) == 0) {
+        int const single = g_args.serve_mode == SERVE_MODE_EPOLL || g_args.serve_mode == SERVE_MODE_THREAD;
+        int const num_keep = single ? 1 : (h.num_fds < MAX_PTHREAD_NUM ? h.num_fds : MAX_PTHREAD_NUM);
+        for (int i = num_keep; i < h.num_fds; ++i) {
+            // nobody would accept from these, what is queued there is lost with the old process
+            LOG_WARNING("[main] listener %d of the old process dropped, keep the serve mode across upgrades", i);
+            close(h.fds[i]);
+        }
+        for (int i = 0; i < num_keep; ++i) {
+            g_listeners.fds[i] = h.fds[i];
+        }
+        g_listeners.num_inherited = num_keep;
+        if (h.snapshot != NULL && g_args.file_path != NULL) {
+            warm_start(h.snapshot);
+        }
+        handoff_done(&h);
+    }
+    return handoff_listen(g_args.upgrade_path, list_listeners, snapshot_files, drain_and_exit);
 }
 
 /*** exec ***/
 
+/* SIGINT / SIGTERM end the process here, after the buffered log lines are out */
+void* wait_signals(void* p_sigset)
+{
+    int sig = 0;
+    sigwait((sigset_t*)p_sigset, &sig);
+    LOG_INFO("[main] caught signal %d, exit", sig);
+    log_shutdown();
+    _exit(128 + sig);
+}
+
 int main(int argc, char* argv[])
 {
-    // Disable output buffering
-    setbuf(stdout, NULL);
-    setbuf(stderr, NULL);
+    // blocked before any other thread starts, so only wait_signals() sees them
+    static sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_t signal_thread;
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL) != 0
+        || pthread_create(&signal_thread, NULL, wait_signals, &sigset) != 0) {
+        pthread_sigmask(SIG_UNBLOCK, &sigset, NULL);
+    } else {
+        pthread_detach(signal_thread);
+    }
+    // sendfile(2) has no MSG_NOSIGNAL, a client gone mid-file must not end the process
+    signal(SIGPIPE, SIG_IGN);
 
     parse_args(argc, argv);
+    if (log_init() != 0) {
+        LOG_WARNING("[main] log flusher failed, log synchronously");
+    }
+    if (g_args.file_path != NULL && file_cache_init(g_args.file_path, g_args.file_cache) != 0) {
+        LOG_ERROR("[main] file cache init failed");
+        g_free_resource();
+        exit(EXIT_FAILURE);
+    }
+    if (init_routes() != 0) {
+        g_free_resource();
+        exit(EXIT_FAILURE);
+    }
+    if (upgrade_init() != 0) {
+        LOG_ERROR("[main] upgrade socket `%s` unusable", g_args.upgrade_path);
+        g_free_resource();
+        exit(EXIT_FAILURE);
+    }
 
     int server_fd,
         client_fd;
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        printf("Socket creation failed: %s...\n", strerror(errno));
-        goto SAFE_RETURN;
+    if (g_args.max_conns == -1) {
+        // running out of descriptors fails accept(2) with nobody told, refuse with 503 well before
+        struct rlimit rl;
+        rlim_t const reserved = RESERVED_FDS + g_args.file_cache;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > reserved + RESERVED_FDS) {
+            g_args.max_conns = rl.rlim_cur - reserved > INT_MAX ? INT_MAX : (int)(rl.rlim_cur - reserved);
+        } else {
+            g_args.max_conns = 0;
+        }
+    }
+    g_args.admission.max_conns = g_args.max_conns;
+    admission_init(&g_args.admission);
+    LOG_INFO("[main] admit %d connection(s), %u request(s) in flight (0: no limit), queue target %u ms",
+        g_args.max_conns, g_args.admission.max_inflight, g_args.admission.target_ms);
+
+    if (g_args.threads == -1) {
+        size_t const ncpu = tpool_default_threads();
+        g_args.threads = ncpu > MAX_PTHREAD_NUM ? MAX_PTHREAD_NUM : (int)ncpu;
     }
 
-    // Since the tester restarts your program quite often, setting SO_REUSEADDR
-    // ensures that we don't run into 'Address already in use' errors
-    int reuse = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        printf("SO_REUSEADDR failed: %s \n", strerror(errno));
+    if (g_args.serve_mode == SERVE_MODE_URING && !uring_supported()) {
+        LOG_WARNING("[main] io_uring unavailable, serve with epoll shards");
+        g_args.serve_mode = SERVE_MODE_REUSEPORT;
+    }
+    if (g_args.serve_mode == SERVE_MODE_REUSEPORT || g_args.serve_mode == SERVE_MODE_URING) {
+        int num_shards = g_args.threads > 0 ? g_args.threads : 1;
+        // every inherited listener has connections hashed to it, each needs a shard
+        if (num_shards < g_listeners.num_inherited) {
+            num_shards = g_listeners.num_inherited;
+        }
+        LOG_INFO("[main] serving with %d SO_REUSEPORT shard(s)", num_shards);
+        // shard 0 runs on the main thread
+        for (int i = 1; i < num_shards; ++i) {
+            shardParams* p_sparams = malloc(sizeof(shardParams));
+            p_sparams->cpu = i;
+            pthread_t thread_id;
+            int const err = pthread_create(&thread_id, NULL, run_shard, (void*)p_sparams);
+            if (err != 0) {
+                LOG_ERROR("[main] thread creation failed: %s", strerror(err));
+                free(p_sparams);
+                continue;
+            }
+            pthread_detach(thread_id);
+        }
+        shardParams* p_sparams = malloc(sizeof(shardParams));
+        p_sparams->cpu = 0;
+        run_shard(p_sparams);
+        server_fd = -1;
         goto SAFE_RETURN;
     }
 
-    struct sockaddr_in serv_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(4221),
-        .sin_addr = { htonl(INADDR_ANY) },
-    };
-
-    if (bind(server_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
-        printf("Bind failed: %s \n", strerror(errno));
+    server_fd = take_listener(0, 0);
+    if (server_fd == -1) {
         goto SAFE_RETURN;
     }
 
-    int connection_backlog = 5;
-    if (listen(server_fd, connection_backlog) != 0) {
-        printf("Listen failed: %s \n", strerror(errno));
+    LOG_INFO("[main] waiting for a client to connect...");
+
+    if (g_args.serve_mode == SERVE_MODE_EPOLL) {
+        tpool_t* pool = NULL;
+        if (g_args.threads > 0 && (pool = tpool_create(g_args.threads, JOB_QUEUE_SIZE)) == NULL) {
+            LOG_WARNING("[main] thread pool creation failed, serve on the reactor thread");
+        }
+        LOG_INFO("[main] serving with %d worker thread(s)", pool ? g_args.threads : 0);
+        reactor_run(server_fd, handle_request, pool, &g_args.timeouts);
+        tpool_destroy(pool);
         goto SAFE_RETURN;
     }
 
-    printf("Waiting for a client to connect...\n");
-
     // create pthread
 
-    while (1) {
+    if (g_args.upgrade_path != NULL) {
+        // shared with the next process some day: poll()ed, and an accept(2) may come away empty
+        fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    }
+    while (!reactor_draining()) {
+        if (g_args.upgrade_path != NULL) {
+            struct pollfd pfd = { .fd = server_fd, .events = POLLIN };
+            if (poll(&pfd, 1, DRAIN_POLL_MS) <= 0) {
+                continue;
+            }
+        }
         if ((client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_addr_len)) == -1) {
-            printf("Create client failed: %s \n", strerror(errno));
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("[main] accept failed: %s", strerror(errno));
             break;
-        } else {
+        } else if (admission_accept(client_fd) == 0) {
             tParams* p_tparams = malloc(sizeof(tParams));
             p_tparams->client_fd = client_fd;
 
             pthread_t thread_id;
-            if (pthread_create(&thread_id, NULL, handle_connection, (void*)p_tparams) != 0) {
-                perror("Tread creation failed\n");
+            int const err = pthread_create(&thread_id, NULL, handle_connection, (void*)p_tparams);
+            if (err != 0) {
+                LOG_ERROR("[main] thread creation failed: %s", strerror(err));
                 close(client_fd);
                 free(p_tparams);
                 continue;
             }
-            printf("Client %d connected\n", client_fd);
+            LOG_INFO("[main] client %d connected", client_fd);
             pthread_detach(thread_id);
         }
     }
+    if (reactor_draining()) {
+        // drain_and_exit() ends the process once the connection threads are done
+        pthread_exit(NULL);
+    }
 
     close(server_fd);
 
@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+int timer_wheel_init(timer_wheel_t* tw, unsigned tick_ms, size_t num_slots, uint64_t now_ms)
+{
+    tw->slots = malloc(num_slots * sizeof(timer_node_t));
+    if (tw->slots == NULL)
+        return -1;
+    for (size_t i = 0; i < num_slots; ++i)
+        tw->slots[i].prev = tw->slots[i].next = &tw->slots[i];
+    tw->tick_ms = tick_ms;
+    tw->mask = num_slots - 1;
+    tw->tick = now_ms / tick_ms;
+    tw->count = 0;
+    return 0;
+}
+
+void timer_wheel_destroy(timer_wheel_t* tw)
+{
+    free(tw->slots);
+    tw->slots = NULL;
+}
+
+void timer_wheel_add(timer_wheel_t* tw, timer_node_t* node, uint64_t at_ms)
+{
+    uint64_t expires = (at_ms + tw->tick_ms - 1) / tw->tick_ms;
+    if (expires < tw->tick)
+        expires = tw->tick;
+    node->expires = expires;
+
+    timer_node_t* const head = &tw->slots[expires & tw->mask];
+    node->prev = head;
+    node->next = head->next;
+    head->next->prev = node;
+    head->next = node;
+    ++tw->count;
+}
+
+void timer_wheel_cancel(timer_wheel_t* tw, timer_node_t* node)
+{
+    if (node->next == NULL)
+        return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    --tw->count;
+}
+
+void timer_wheel_advance(timer_wheel_t* tw, uint64_t now_ms, void (*expire)(timer_node_t*, void*), void* arg)
+{
+    uint64_t const target = now_ms / tw->tick_ms;
+    if (target < tw->tick)
+        return;
+
+    // after a long sleep one lap over all slots sees every due timer
+    uint64_t steps = target - tw->tick + 1;
+    if (steps > tw->mask + 1)
+        steps = tw->mask + 1;
+    for (uint64_t i = 0; i < steps; ++i) {
+        timer_node_t* const head = &tw->slots[(tw->tick + i) & tw->mask];
+        timer_node_t* node = head->next;
+        while (node != head) {
+            timer_node_t* const next = node->next;
+            // re-armed timers land at the front or in a later tick, so they are not seen twice
+            if (node->expires <= target) {
+                timer_wheel_cancel(tw, node);
+                expire(node, arg);
+            }
+            node = next;
+        }
+    }
+    tw->tick = target + 1;
+}
+
+uint64_t timer_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
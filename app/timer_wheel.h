@@ -0,0 +1,53 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* embedded in the object a timer belongs to */
+typedef struct timer_node_t {
+    struct timer_node_t* prev;
+    struct timer_node_t* next; /* NULL while not armed */
+    uint64_t expires; /* tick it is due at */
+} timer_node_t;
+
+/*
+ * Hashed timing wheel: timers hang in the slot of their tick modulo the
+ * number of slots, so arming and cancelling are O(1) and advancing only
+ * looks at the slots of the ticks that passed. Timers further out than one
+ * rotation just stay put for another lap. Not thread-safe.
+ */
+typedef struct {
+    unsigned tick_ms;
+    size_t mask; /* slots - 1 */
+    uint64_t tick; /* next tick to process */
+    size_t count; /* armed timers */
+    timer_node_t* slots; /* list heads */
+} timer_wheel_t;
+
+/* num_slots is a power of two, 0 or -1 when out of memory */
+int timer_wheel_init(timer_wheel_t* tw, unsigned tick_ms, size_t num_slots, uint64_t now_ms);
+void timer_wheel_destroy(timer_wheel_t* tw);
+
+/* arm node to fire at at_ms (rounded up to the tick), node must not be armed */
+void timer_wheel_add(timer_wheel_t* tw, timer_node_t* node, uint64_t at_ms);
+
+/* disarm node, fine when it is not armed */
+void timer_wheel_cancel(timer_wheel_t* tw, timer_node_t* node);
+
+/*
+ * fire every timer due by now_ms: expire(node, arg) runs with node already
+ * disarmed and may arm it again, but must not cancel other timers
+ */
+void timer_wheel_advance(timer_wheel_t* tw, uint64_t now_ms, void (*expire)(timer_node_t*, void*), void* arg);
+
+/* how long a poller may sleep before the wheel needs advancing, -1 when nothing is armed */
+static inline int timer_wheel_timeout_ms(timer_wheel_t const* tw)
+{
+    return tw->count > 0 ? (int)tw->tick_ms : -1;
+}
+
+/* coarse monotonic clock the deadlines are measured on */
+uint64_t timer_now_ms(void);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+
+#include "tpool.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define CACHE_LINE 64
+
+/*
+ * Bounded MPMC ring (D. Vyukov): every slot carries a sequence number that
+ * tells producers and consumers whose turn it is, so head and tail are the
+ * only contended words and each is touched by a single CAS.
+ */
+typedef struct {
+    size_t seq;
+    tpool_work_t work;
+} tpool_slot_t;
+
+struct tpool_t {
+    tpool_slot_t* slots;
+    size_t mask;
+    pthread_t* threads;
+    size_t num_threads;
+    sem_t items; /* counts published jobs, idle workers sleep here */
+
+    _Alignas(CACHE_LINE) size_t head;
+    _Alignas(CACHE_LINE) size_t tail;
+};
+
+static int queue_push(tpool_t* tp, tpool_work_t work)
+{
+    size_t pos = __atomic_load_n(&tp->tail, __ATOMIC_RELAXED);
+    tpool_slot_t* slot;
+    while (1) {
+        slot = &tp->slots[pos & tp->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long dif = (long)seq - (long)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&tp->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1; // full
+        } else {
+            pos = __atomic_load_n(&tp->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->work = work;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int queue_pop(tpool_t* tp, tpool_work_t* out)
+{
+    size_t pos = __atomic_load_n(&tp->head, __ATOMIC_RELAXED);
+    tpool_slot_t* slot;
+    while (1) {
+        slot = &tp->slots[pos & tp->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long dif = (long)seq - (long)(pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&tp->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1; // empty
+        } else {
+            pos = __atomic_load_n(&tp->head, __ATOMIC_RELAXED);
+        }
+    }
+    *out = slot->work;
+    __atomic_store_n(&slot->seq, pos + tp->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void* tpool_worker(void* arg)
+{
+    tpool_t* tp = arg;
+    while (1) {
+        while (sem_wait(&tp->items) == -1 && errno == EINTR)
+            ;
+        // the semaphore reserved a job, but a producer ahead of it may not
+        // have published its slot yet
+        tpool_work_t work;
+        while (queue_pop(tp, &work) != 0)
+            sched_yield();
+        if (work.func == NULL)
+            break;
+        work.func(work.arg);
+    }
+    return NULL;
+}
+
+size_t tpool_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+tpool_t* tpool_create(size_t num_threads, size_t queue_size)
+{
+    size_t cap = 2;
+    while (cap < queue_size)
+        cap <<= 1;
+
+    tpool_t* tp = aligned_alloc(CACHE_LINE, (sizeof(tpool_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if (tp == NULL) {
+        LOG_ERROR("[tpool_create] malloc for tpool_t failed!");
+        return NULL;
+    }
+    memset(tp, 0, sizeof(tpool_t));
+    tp->slots = malloc(sizeof(tpool_slot_t) * cap);
+    tp->threads = malloc(sizeof(pthread_t) * num_threads);
+    if (tp->slots == NULL || tp->threads == NULL) {
+        LOG_ERROR("[tpool_create] malloc for queue failed!");
+        free(tp->slots);
+        free(tp->threads);
+        free(tp);
+        return NULL;
+    }
+    for (size_t i = 0; i < cap; ++i)
+        tp->slots[i].seq = i;
+    tp->mask = cap - 1;
+    sem_init(&tp->items, 0, 0);
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        int const err = pthread_create(&tp->threads[i], NULL, tpool_worker, tp);
+        if (err != 0) {
+            LOG_ERROR("[tpool_create] thread creation failed: %s", strerror(err));
+            break;
+        }
+        ++tp->num_threads;
+    }
+    if (tp->num_threads == 0) {
+        tpool_destroy(tp);
+        return NULL;
+    }
+    return tp;
+}
+
+int tpool_add_work(tpool_t* tp, tpool_func_t func, void* arg)
+{
+    if (queue_push(tp, (tpool_work_t) { .func = func, .arg = arg }) != 0)
+        return -1;
+    sem_post(&tp->items);
+    return 0;
+}
+
+void tpool_destroy(tpool_t* tp)
+{
+    if (tp == NULL)
+        return;
+    // one quit job per worker, queued behind the real work
+    for (size_t i = 0; i < tp->num_threads; ++i) {
+        while (queue_push(tp, (tpool_work_t) { .func = NULL, .arg = NULL }) != 0)
+            sched_yield();
+        sem_post(&tp->items);
+    }
+    for (size_t i = 0; i < tp->num_threads; ++i)
+        pthread_join(tp->threads[i], NULL);
+    sem_destroy(&tp->items);
+    free(tp->slots);
+    free(tp->threads);
+    free(tp);
+}
@@ -2,9 +2,28 @@
 #define TPOOL_H
 
 #include <pthread.h>
+#include <stddef.h>
 
+typedef void (*tpool_func_t)(void* arg);
+
+/* one queued job, func == NULL asks a worker to quit */
 typedef struct tpool_work_t {
-    pthread_t thread;
+    tpool_func_t func;
+    void* arg;
 } tpool_work_t;
 
+typedef struct tpool_t tpool_t;
+
+/* fixed number of workers over a bounded lock-free queue (queue_size rounds up to a power of 2) */
+tpool_t* tpool_create(size_t num_threads, size_t queue_size);
+
+/* 0 on success, -1 when the queue is full, the caller decides what to do then */
+int tpool_add_work(tpool_t* tp, tpool_func_t func, void* arg);
+
+/* runs the queued jobs to completion, then joins and frees the workers */
+void tpool_destroy(tpool_t* tp);
+
+/* number of online cores, at least 1 */
+size_t tpool_default_threads(void);
+
 #endif // TPOOL_H
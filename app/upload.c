@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+
+#include "upload.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static unsigned g_upload_seq;
+
+/* first failure wins, the temporary file goes right away */
+static void upload_fail(upload_t* up, int err)
+{
+    if (up->error == 0)
+        up->error = err;
+    if (up->fd != -1) {
+        close(up->fd);
+        up->fd = -1;
+        unlink(up->tmp_path);
+    }
+}
+
+/*
+ * reserve the blocks up to written + len and a bit beyond, ahead of the
+ * writes: a full disk fails here, not halfway through a write. -1 when it
+ * failed, up is failed then
+ */
+static int upload_reserve(upload_t* up, size_t len)
+{
+    size_t const end = up->written + up->left;
+    // topped up once less than half of the reserve is left ahead
+    if (up->fd == -1 || up->reserved >= end || up->written + len + UPLOAD_RESERVE_SIZE / 2 <= up->reserved)
+        return 0;
+    size_t want = up->written + len + UPLOAD_RESERVE_SIZE;
+    if (want > end)
+        want = end;
+    if (fallocate(up->fd, 0, up->reserved, want - up->reserved) != 0) {
+        if (errno == EOPNOTSUPP) {
+            // nothing to reserve with, just write
+            up->reserved = end;
+            return 0;
+        }
+        int const err = errno;
+        LOG_ERROR("[upload_reserve] fallocate %lu bytes failed: %s", want, strerror(err));
+        upload_fail(up, err);
+        return -1;
+    }
+    up->reserved = want;
+    return 0;
+}
+
+upload_t* upload_begin(char const* path, size_t size)
+{
+    upload_t* up = malloc(sizeof(upload_t));
+    if (up == NULL) {
+        LOG_ERROR("[upload_begin] malloc for upload_t failed!");
+        return NULL;
+    }
+    up->fd = -1;
+    up->error = 0;
+    up->left = size;
+    up->written = 0;
+    up->reserved = 0;
+    up->path = NULL;
+    up->tmp_path = NULL;
+    if (path == NULL)
+        return up;
+
+    // same directory as the target, so the final rename never crosses a filesystem
+    size_t const tmp_size = strlen(path) + 32;
+    up->path = strdup(path);
+    up->tmp_path = malloc(tmp_size);
+    if (up->path == NULL || up->tmp_path == NULL) {
+        LOG_ERROR("[upload_begin] malloc for paths failed!");
+        goto HANDLE_ERROR;
+    }
+    snprintf(up->tmp_path, tmp_size, "%s.%d.%u.part", path, (int)getpid(),
+        __atomic_add_fetch(&g_upload_seq, 1, __ATOMIC_RELAXED));
+    up->fd = open(up->tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (up->fd == -1) {
+        LOG_ERROR("[upload_begin] open %s failed: %s", up->tmp_path, strerror(errno));
+        goto HANDLE_ERROR;
+    }
+
+    if (upload_reserve(up, 0) != 0)
+        goto HANDLE_ERROR;
+    return up;
+
+HANDLE_ERROR:
+    free(up->path);
+    free(up->tmp_path);
+    free(up);
+    return NULL;
+}
+
+void upload_write(upload_t* up, void const* data, size_t len)
+{
+    upload_reserve(up, len);
+    up->left -= len;
+    up->written += len;
+    char const* p = data;
+    while (up->fd != -1 && len > 0) {
+        ssize_t n = write(up->fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            int const err = errno;
+            LOG_ERROR("[upload_write] %s: %s", up->tmp_path, strerror(err));
+            upload_fail(up, err);
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+int upload_commit(upload_t* up)
+{
+    if (up->path != NULL) {
+        if (up->fd != -1 && close(up->fd) != 0)
+            up->error = errno;
+        up->fd = -1;
+        if (up->error == 0 && rename(up->tmp_path, up->path) != 0) {
+            up->error = errno;
+            LOG_ERROR("[upload_commit] rename to %s failed: %s", up->path, strerror(up->error));
+        }
+        if (up->error != 0)
+            unlink(up->tmp_path);
+    }
+    int const ret = up->error == 0 ? 0 : -1;
+    free(up->path);
+    free(up->tmp_path);
+    free(up);
+    return ret;
+}
+
+void upload_abort(void* arg)
+{
+    upload_t* up = arg;
+    if (up == NULL)
+        return;
+    upload_fail(up, ECANCELED);
+    free(up->path);
+    free(up->tmp_path);
+    free(up);
+}
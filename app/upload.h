@@ -0,0 +1,43 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stddef.h>
+
+/* body bytes moved from the socket to the file per read */
+#define UPLOAD_BUF_SIZE (64 * 1024)
+/* disk blocks reserved ahead of the body bytes written, not the whole Content-Length */
+#define UPLOAD_RESERVE_SIZE (8 * 1024 * 1024)
+
+/*
+ * A request body written to a temporary file next to its target as it
+ * arrives and renamed over the target once complete, so readers see either
+ * the old file or the whole new one. Without a path the body is drained.
+ */
+typedef struct {
+    int fd; /* -1 when draining, or once a write failed */
+    int error; /* errno of the first failure, later bytes are drained */
+    size_t left; /* body bytes still expected */
+    size_t written; /* body bytes seen so far */
+    size_t reserved; /* file bytes fallocate(2)'d, at most UPLOAD_RESERVE_SIZE past written */
+    char* path;
+    char* tmp_path;
+    char buf[UPLOAD_BUF_SIZE]; /* for the caller's reads */
+} upload_t;
+
+/*
+ * size is the whole body; path NULL drains. NULL on failure. Disk space is
+ * reserved as the body arrives, a client that only claims a large body
+ * holds at most UPLOAD_RESERVE_SIZE of it.
+ */
+upload_t* upload_begin(char const* path, size_t size);
+
+/* the next len (<= up->left) body bytes */
+void upload_write(upload_t* up, void const* data, size_t len);
+
+/* once up->left is 0: rename into place and free up. 0 or -1 when it failed */
+int upload_commit(upload_t* up);
+
+/* drop the temporary file and free up; void* so it can be a release callback */
+void upload_abort(void* up);
+
+#endif // UPLOAD_H
@@ -0,0 +1,717 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "log.h"
+#include "metrics.h"
+
+#define URING_SQ_ENTRIES 512
+#define URING_CQ_ENTRIES 4096
+/* provided buffers (group 0) the receives pick from, a power of two */
+#define URING_RECV_BUFS 512
+#define URING_RECV_BUF_SIZE 4096
+/* registered buffers file chunks pass through, one chunk in flight per connection */
+#define URING_FILE_BUFS 32
+#define URING_FILE_BUF_SIZE (64 * 1024)
+/* same deadline resolution as the reactor */
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS 512
+
+/* what a completion belongs to, in the low bits of user_data under the uconn_t pointer */
+typedef enum {
+    UOP_IGNORE,
+    UOP_ACCEPT,
+    UOP_RECV,
+    UOP_POLLOUT,
+    UOP_READ,
+    UOP_SEND,
+} UOP;
+
+#define UOP_MASK 7u
+
+/* io state of one connection, c->io */
+typedef struct {
+    conn_t* c;
+    unsigned ops; /* submitted and not finished, a multishot one counts until its last completion */
+    int dead; /* closed, freed together with c once ops is 0 */
+    int recv_armed;
+    int pollout_armed;
+    int file_buf; /* registered buffer of the file chunk underway, -1 when none */
+    size_t file_len; /* bytes of that chunk */
+    int file_err; /* its read came up short */
+} uconn_t;
+
+typedef struct {
+    int fd;
+    int enter_fd; /* registered index of fd with IORING_ENTER_REGISTERED_RING, fd otherwise */
+    unsigned enter_flags;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned sq_tail; /* local, published by ring_enter() */
+    unsigned sq_pending; /* filled since the last ring_enter() */
+    unsigned* sq_khead;
+    unsigned* sq_ktail;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned cq_mask;
+    unsigned* cq_khead;
+    unsigned* cq_ktail;
+    struct io_uring_cqe* cqes;
+    void* ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+} uring_ring_t;
+
+typedef struct {
+    uring_ring_t ring;
+    conn_handler_fn on_data;
+    conn_timeouts_t timeouts;
+    int listen_fd;
+    int listen_fixed; /* listen_fd is registered file 0 */
+    int multishot_accept;
+    int multishot_recv;
+    /* provided buffers */
+    struct io_uring_buf_ring* br;
+    size_t br_size;
+    char* recv_bufs;
+    /* registered buffers, none when registering failed: files go by sendfile(2) then */
+    char* file_bufs;
+    int num_free_file_bufs;
+    int free_file_bufs[URING_FILE_BUFS];
+    uint64_t now; /* of the current wheel advance */
+    uint64_t reaped_ns; /* metrics_now_ns() the completions being handled were reaped at */
+    timer_wheel_t wheel;
+} uring_t;
+
+/*** ring ***/
+
+static int sys_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_register(int fd, unsigned op, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+static void ring_exit(uring_ring_t* ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_ptr != NULL)
+        munmap(ring->ring_ptr, ring->ring_size);
+    if (ring->fd != -1)
+        close(ring->fd);
+}
+
+static int ring_init(uring_ring_t* ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    // one thread submits and reaps, completions run when it asks for them
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        .cq_entries = URING_CQ_ENTRIES,
+    };
+    ring->fd = sys_setup(URING_SQ_ENTRIES, &p);
+    if (ring->fd == -1 && errno == EINVAL) {
+        // before 6.1
+        p = (struct io_uring_params) { .flags = IORING_SETUP_CQSIZE, .cq_entries = URING_CQ_ENTRIES };
+        ring->fd = sys_setup(URING_SQ_ENTRIES, &p);
+    }
+    if (ring->fd == -1)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)
+        || !(p.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        ring->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t const sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t const cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    char* ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->ring_ptr = ptr == MAP_FAILED ? NULL : ptr;
+    if (ring->sqes == MAP_FAILED)
+        ring->sqes = NULL;
+    if (ring->ring_ptr == NULL || ring->sqes == NULL) {
+        int const err = errno;
+        ring_exit(ring);
+        errno = err;
+        return -1;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_mask = *(unsigned*)(ptr + p.sq_off.ring_mask);
+    ring->sq_khead = (unsigned*)(ptr + p.sq_off.head);
+    ring->sq_ktail = (unsigned*)(ptr + p.sq_off.tail);
+    ring->sq_array = (unsigned*)(ptr + p.sq_off.array);
+    ring->sq_tail = *ring->sq_ktail;
+    ring->cq_mask = *(unsigned*)(ptr + p.cq_off.ring_mask);
+    ring->cq_khead = (unsigned*)(ptr + p.cq_off.head);
+    ring->cq_ktail = (unsigned*)(ptr + p.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe*)(ptr + p.cq_off.cqes);
+
+    // io_uring_enter() then skips looking up the ring's file every call
+    ring->enter_fd = ring->fd;
+    struct io_uring_rsrc_update reg = { .offset = -1U, .data = (uint64_t)ring->fd };
+    if (sys_register(ring->fd, IORING_REGISTER_RING_FDS, &reg, 1) == 1) {
+        ring->enter_fd = (int)reg.offset;
+        ring->enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+    return 0;
+}
+
+/* submit what is queued, and wait for min_complete completions or ts */
+static int ring_enter(uring_ring_t* ring, unsigned min_complete, struct __kernel_timespec* ts)
+{
+    __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)ts };
+    int const ret = sys_enter(ring->enter_fd, ring->sq_pending, min_complete,
+        ring->enter_flags | IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret > 0)
+        ring->sq_pending -= (unsigned)ret;
+    return ret;
+}
+
+/* a zeroed entry queued for the next ring_enter(), NULL when the kernel takes none */
+static struct io_uring_sqe* ring_sqe(uring_ring_t* ring)
+{
+    if (ring->sq_tail - __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        if (ring_enter(ring, 0, NULL) < 0 && errno != EBUSY)
+            return NULL;
+        if (ring->sq_tail - __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE) == ring->sq_entries)
+            return NULL;
+    }
+    unsigned const idx = ring->sq_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ++ring->sq_tail;
+    ++ring->sq_pending;
+    return sqe;
+}
+
+/* free entries, so linked ones are queued together */
+static unsigned ring_room(uring_ring_t* ring)
+{
+    unsigned room = ring->sq_entries - (ring->sq_tail - __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE));
+    if (room < 2 && ring_enter(ring, 0, NULL) >= 0)
+        room = ring->sq_entries - (ring->sq_tail - __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE));
+    return room;
+}
+
+/*** buffers ***/
+
+/* a provided buffer ring of entries (a power of two) as group 0 of ring_fd */
+static struct io_uring_buf_ring* buf_ring_register(int ring_fd, unsigned entries, size_t* p_size)
+{
+    size_t const size = entries * sizeof(struct io_uring_buf);
+    void* br = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED)
+        return NULL;
+    struct io_uring_buf_reg reg = { .ring_addr = (uint64_t)(uintptr_t)br, .ring_entries = entries, .bgid = 0 };
+    if (sys_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        int const err = errno;
+        munmap(br, size);
+        errno = err;
+        return NULL;
+    }
+    *p_size = size;
+    return br;
+}
+
+/* hand receive buffer bid back to the kernel */
+static void recv_buf_recycle(uring_t* ur, unsigned bid)
+{
+    unsigned short const tail = ur->br->tail;
+    // field by field: the ring's tail shares its first entry
+    struct io_uring_buf* buf = &ur->br->bufs[tail & (URING_RECV_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ur->recv_bufs + (size_t)bid * URING_RECV_BUF_SIZE);
+    buf->len = URING_RECV_BUF_SIZE;
+    buf->bid = (unsigned short)bid;
+    __atomic_store_n(&ur->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static int uring_buffers_init(uring_t* ur)
+{
+    ur->recv_bufs = malloc((size_t)URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+    ur->br = ur->recv_bufs ? buf_ring_register(ur->ring.fd, URING_RECV_BUFS, &ur->br_size) : NULL;
+    if (ur->br == NULL) {
+        LOG_ERROR("[uring] provided buffers failed: %s", strerror(errno));
+        return -1;
+    }
+    for (unsigned i = 0; i < URING_RECV_BUFS; ++i)
+        recv_buf_recycle(ur, i);
+
+    // pinned memory may be capped (RLIMIT_MEMLOCK), then files just take sendfile(2)
+    ur->file_bufs = malloc((size_t)URING_FILE_BUFS * URING_FILE_BUF_SIZE);
+    if (ur->file_bufs != NULL) {
+        struct iovec iov[URING_FILE_BUFS];
+        for (int i = 0; i < URING_FILE_BUFS; ++i) {
+            iov[i].iov_base = ur->file_bufs + (size_t)i * URING_FILE_BUF_SIZE;
+            iov[i].iov_len = URING_FILE_BUF_SIZE;
+        }
+        if (sys_register(ur->ring.fd, IORING_REGISTER_BUFFERS, iov, URING_FILE_BUFS) == 0) {
+            for (int i = 0; i < URING_FILE_BUFS; ++i)
+                ur->free_file_bufs[i] = i;
+            ur->num_free_file_bufs = URING_FILE_BUFS;
+        } else {
+            LOG_WARNING("[uring] registered buffers failed, files go by sendfile: %s", strerror(errno));
+            free(ur->file_bufs);
+            ur->file_bufs = NULL;
+        }
+    }
+    return 0;
+}
+
+/*** connections ***/
+
+static void uconn_free(uconn_t* uc)
+{
+    conn_free(uc->c);
+    free(uc);
+}
+
+static void uring_close(uring_t* ur, uconn_t* uc)
+{
+    if (uc->dead)
+        return;
+    uc->dead = 1;
+    timer_wheel_cancel(&ur->wheel, &uc->c->timer);
+    LOG_INFO("[uring] connection %d closed", uc->c->fd);
+    if (uc->ops == 0) {
+        uconn_free(uc);
+        return;
+    }
+    // what is still pending on the socket ends now, the last completion frees it
+    shutdown(uc->c->fd, SHUT_RDWR);
+    struct io_uring_sqe* sqe = ring_sqe(&ur->ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = uc->c->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = UOP_IGNORE;
+    }
+}
+
+static int uring_arm_accept(uring_t* ur)
+{
+    struct io_uring_sqe* sqe = ring_sqe(&ur->ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ur->listen_fixed ? 0 : ur->listen_fd;
+    sqe->flags = ur->listen_fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = ur->multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = UOP_ACCEPT;
+    return 0;
+}
+
+static void uring_cancel_accept(uring_t* ur)
+{
+    struct io_uring_sqe* sqe = ring_sqe(&ur->ring);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UOP_ACCEPT;
+    sqe->user_data = UOP_IGNORE;
+}
+
+static int uring_arm(uring_t* ur, uconn_t* uc, int op)
+{
+    struct io_uring_sqe* sqe = ring_sqe(&ur->ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->fd = uc->c->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)uc | op;
+    if (op == UOP_RECV) {
+        // the kernel picks a buffer once data is there, idle connections hold none
+        sqe->opcode = IORING_OP_RECV;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio = ur->multishot_recv ? IORING_RECV_MULTISHOT : 0;
+        uc->recv_armed = 1;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLOUT;
+        uc->pollout_armed = 1;
+    }
+    ++uc->ops;
+    return 0;
+}
+
+/* conn_file_fn: the next chunk of seg as a read into a registered buffer linked to its send */
+static int uring_send_file(conn_t* c, conn_seg_t* seg)
+{
+    uring_t* ur = c->loop;
+    uconn_t* uc = c->io;
+    if (uc->file_buf != -1)
+        return 1;
+    if (ur->num_free_file_bufs == 0 || ring_room(&ur->ring) < 2)
+        return CONN_FILE_FALLBACK;
+
+    int const b = ur->free_file_bufs[--ur->num_free_file_bufs];
+    char* const buf = ur->file_bufs + (size_t)b * URING_FILE_BUF_SIZE;
+    uc->file_buf = b;
+    uc->file_len = seg->len < URING_FILE_BUF_SIZE ? seg->len : URING_FILE_BUF_SIZE;
+    uc->file_err = 0;
+
+    // a short read breaks the link, the send then completes with -ECANCELED
+    struct io_uring_sqe* sqe = ring_sqe(&ur->ring);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = seg->file_fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)uc->file_len;
+    sqe->off = (uint64_t)seg->off;
+    sqe->buf_index = (unsigned short)b;
+    sqe->user_data = (uint64_t)(uintptr_t)uc | UOP_READ;
+
+    sqe = ring_sqe(&ur->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)uc->file_len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)(uintptr_t)uc | UOP_SEND;
+    uc->ops += 2;
+    return 1;
+}
+
+/* after c moved on: close it, or wait for what it needs next */
+static void uring_settle(uring_t* ur, uconn_t* uc, int ret)
+{
+    conn_t* c = uc->c;
+    if (ret < 0 || (c->closing && !conn_has_pending(c))) {
+        uring_close(ur, uc);
+        return;
+    }
+    if (conn_has_pending(c) && uc->file_buf == -1 && !uc->pollout_armed && uring_arm(ur, uc, UOP_POLLOUT) != 0) {
+        uring_close(ur, uc);
+        return;
+    }
+    if (!uc->recv_armed && uring_arm(ur, uc, UOP_RECV) != 0) {
+        uring_close(ur, uc);
+        return;
+    }
+
+    uint64_t const deadline = conn_deadline(c, &ur->timeouts, timer_now_ms());
+    if (deadline < c->deadline) {
+        timer_wheel_cancel(&ur->wheel, &c->timer);
+        timer_wheel_add(&ur->wheel, &c->timer, deadline);
+    }
+    c->deadline = deadline;
+}
+
+/* bytes received for c: buffer them, serve them unless earlier output still waits */
+static int uring_feed(uring_t* ur, conn_t* c, char const* data, size_t len)
+{
+    c->ready_ns = ur->reaped_ns;
+    while (len > 0) {
+        ssize_t const n = conn_append(c, data, len);
+        if (n < 0) {
+            LOG_WARNING("[uring] connection %d: %s", c->fd, strerror(errno));
+            return -1;
+        }
+        data += n;
+        len -= n;
+        // like the reactor, which stops reading until the client drained our output
+        if (!conn_has_pending(c) && !c->closing && ur->on_data(c) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* c's output moved on: push the rest, then serve the requests that waited for it */
+static void uring_output(uring_t* ur, uconn_t* uc)
+{
+    conn_t* c = uc->c;
+    int ret = conn_flush(c);
+    if (ret == 0 && c->recv_len > 0 && !c->closing)
+        ret = ur->on_data(c);
+    uring_settle(ur, uc, ret < 0 ? -1 : 0);
+}
+
+static void uring_on_accept(uring_t* ur, struct io_uring_cqe const* cqe)
+{
+    if (cqe->res == -EINVAL && ur->multishot_accept) {
+        LOG_INFO("[uring] no multishot accept, re-arm per connection");
+        ur->multishot_accept = 0;
+    }
+    if (reactor_draining()) {
+        // the socket is shared with the process that accepts from it now, what we got is still served
+        if (cqe->flags & IORING_CQE_F_MORE)
+            uring_cancel_accept(ur);
+    } else if (!(cqe->flags & IORING_CQE_F_MORE) && uring_arm_accept(ur) != 0) {
+        LOG_ERROR("[uring] can't re-arm accept");
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EINVAL && cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED
+            && cqe->res != -ECANCELED)
+            LOG_ERROR("[uring] accept failed: %s", strerror(-cqe->res));
+        return;
+    }
+
+    int const client_fd = cqe->res;
+    if (admission_accept(client_fd) != 0)
+        return;
+    conn_t* c = conn_new(client_fd);
+    uconn_t* uc = c ? calloc(1, sizeof(uconn_t)) : NULL;
+    if (uc == NULL) {
+        if (c != NULL)
+            conn_free(c);
+        else
+            close(client_fd);
+        return;
+    }
+    uc->c = c;
+    uc->file_buf = -1;
+    c->loop = ur;
+    c->io = uc;
+    c->send_file = ur->file_bufs != NULL ? uring_send_file : NULL;
+    c->deadline = conn_deadline(c, &ur->timeouts, timer_now_ms());
+    timer_wheel_add(&ur->wheel, &c->timer, c->deadline);
+    if (uring_arm(ur, uc, UOP_RECV) != 0) {
+        uring_close(ur, uc);
+        return;
+    }
+    LOG_INFO("[uring] client %d connected", client_fd);
+}
+
+static void uring_on_recv(uring_t* ur, uconn_t* uc, struct io_uring_cqe const* cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uc->recv_armed = 0;
+    if (cqe->res == -ENOBUFS) {
+        // every buffer is taken, they come back as the completions ahead are handled
+        uring_settle(ur, uc, 0);
+        return;
+    }
+    if (cqe->res == -EINVAL && ur->multishot_recv) {
+        LOG_INFO("[uring] no multishot recv, re-arm per completion");
+        ur->multishot_recv = 0;
+        uring_settle(ur, uc, 0);
+        return;
+    }
+    if (cqe->res <= 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res < 0 && cqe->res != -ECONNRESET)
+            LOG_WARNING("[uring] recv failed: %s", strerror(-cqe->res));
+        uring_close(ur, uc);
+        return;
+    }
+
+    unsigned const bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    int const ret = uring_feed(ur, uc->c, ur->recv_bufs + (size_t)bid * URING_RECV_BUF_SIZE, cqe->res);
+    recv_buf_recycle(ur, bid);
+    uring_settle(ur, uc, ret);
+}
+
+static void uring_on_send(uring_t* ur, uconn_t* uc, int res)
+{
+    conn_t* c = uc->c;
+    if (res < 0 || uc->file_err) {
+        LOG_WARNING("[uring] file send failed: %s", uc->file_err ? "unexpected end of file" : strerror(-res));
+        uring_close(ur, uc);
+        return;
+    }
+    conn_seg_t* seg = c->out_head;
+    seg->off += res;
+    seg->len -= res;
+    metrics_count(METRIC_BYTES_SENT, res);
+    uring_output(ur, uc);
+}
+
+static void uring_complete(uring_t* ur, struct io_uring_cqe const* cqe)
+{
+    unsigned const op = (unsigned)(cqe->user_data & UOP_MASK);
+    uconn_t* uc = (uconn_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)UOP_MASK);
+    if (op == UOP_IGNORE)
+        return;
+    if (op == UOP_ACCEPT) {
+        uring_on_accept(ur, cqe);
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        --uc->ops;
+    if (op == UOP_SEND) {
+        ur->free_file_bufs[ur->num_free_file_bufs++] = uc->file_buf;
+        uc->file_buf = -1;
+    }
+    if (uc->dead) {
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            recv_buf_recycle(ur, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (uc->ops == 0)
+            uconn_free(uc);
+        return;
+    }
+
+    switch (op) {
+    case UOP_RECV:
+        uring_on_recv(ur, uc, cqe);
+        break;
+    case UOP_POLLOUT:
+        uc->pollout_armed = 0;
+        uring_output(ur, uc);
+        break;
+    case UOP_READ:
+        if (cqe->res < 0 || (size_t)cqe->res != uc->file_len)
+            uc->file_err = 1;
+        break;
+    case UOP_SEND:
+        uring_on_send(ur, uc, cqe->res);
+        break;
+    }
+}
+
+/* timer_wheel expire callback */
+static void uring_expire(timer_node_t* node, void* arg)
+{
+    uring_t* ur = arg;
+    conn_t* c = (conn_t*)((char*)node - offsetof(conn_t, timer));
+    if (c->deadline > ur->now) {
+        timer_wheel_add(&ur->wheel, node, c->deadline);
+        return;
+    }
+    // the receive pending on it ends, its completion closes c the usual way
+    LOG_INFO("[uring] connection %d timed out", c->fd);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+/*** exec ***/
+
+static int g_uring_supported;
+static pthread_once_t g_uring_once = PTHREAD_ONCE_INIT;
+
+static void uring_probe(void)
+{
+    static int const ops[] = {
+        IORING_OP_ACCEPT,
+        IORING_OP_RECV,
+        IORING_OP_SEND,
+        IORING_OP_READ_FIXED,
+        IORING_OP_POLL_ADD,
+        IORING_OP_ASYNC_CANCEL,
+    };
+    uring_ring_t ring;
+    if (ring_init(&ring) != 0) {
+        LOG_INFO("[uring] io_uring unavailable: %s", strerror(errno));
+        return;
+    }
+
+    size_t const probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_size);
+    int ok = probe != NULL && sys_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+        if (!ok)
+            LOG_INFO("[uring] io_uring lacks opcode %d", ops[i]);
+    }
+    free(probe);
+
+    // provided buffer rings came with 5.19, as did the multishot requests
+    size_t br_size;
+    struct io_uring_buf_ring* br = ok ? buf_ring_register(ring.fd, 1, &br_size) : NULL;
+    if (br != NULL) {
+        munmap(br, br_size);
+    } else if (ok) {
+        LOG_INFO("[uring] io_uring lacks provided buffer rings: %s", strerror(errno));
+        ok = 0;
+    }
+    ring_exit(&ring);
+    g_uring_supported = ok;
+}
+
+int uring_supported(void)
+{
+    pthread_once(&g_uring_once, uring_probe);
+    return g_uring_supported;
+}
+
+int uring_run(int listen_fd, conn_handler_fn on_data, conn_timeouts_t const* timeouts)
+{
+    uring_t* ur = calloc(1, sizeof(uring_t));
+    if (ur == NULL) {
+        LOG_ERROR("[uring] malloc for uring_t failed!");
+        return -1;
+    }
+    ur->ring.fd = -1;
+    ur->on_data = on_data;
+    ur->timeouts = *timeouts;
+    ur->listen_fd = listen_fd;
+    ur->multishot_accept = 1;
+    ur->multishot_recv = 1;
+    if (ring_init(&ur->ring) != 0) {
+        LOG_ERROR("[uring] io_uring_setup failed: %s", strerror(errno));
+        free(ur);
+        return -1;
+    }
+    if (timer_wheel_init(&ur->wheel, TIMER_TICK_MS, TIMER_SLOTS, timer_now_ms()) != 0) {
+        LOG_ERROR("[uring] malloc for timer wheel failed!");
+        goto HANDLE_ERROR;
+    }
+    if (uring_buffers_init(ur) != 0)
+        goto HANDLE_ERROR;
+    ur->listen_fixed = sys_register(ur->ring.fd, IORING_REGISTER_FILES, &listen_fd, 1) == 0;
+    if (uring_arm_accept(ur) != 0)
+        goto HANDLE_ERROR;
+
+    while (1) {
+        int const timeout = timer_wheel_timeout_ms(&ur->wheel);
+        struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = timeout % 1000 * 1000000L };
+        if (ring_enter(&ur->ring, 1, timeout >= 0 ? &ts : NULL) < 0
+            && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            LOG_ERROR("[uring] io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+
+        ur->now = timer_now_ms();
+        timer_wheel_advance(&ur->wheel, ur->now, uring_expire, ur);
+
+        ur->reaped_ns = metrics_now_ns();
+        unsigned head = *ur->ring.cq_khead;
+        while (head != __atomic_load_n(ur->ring.cq_ktail, __ATOMIC_ACQUIRE)) {
+            // copied out and released first, handling it may queue more
+            struct io_uring_cqe const cqe = ur->ring.cqes[head & ur->ring.cq_mask];
+            __atomic_store_n(ur->ring.cq_khead, ++head, __ATOMIC_RELEASE);
+            uring_complete(ur, &cqe);
+        }
+    }
+
+HANDLE_ERROR:
+    // connections still open are dropped along with the process
+    ring_exit(&ur->ring);
+    if (ur->br != NULL)
+        munmap(ur->br, ur->br_size);
+    free(ur->recv_bufs);
+    free(ur->file_bufs);
+    timer_wheel_destroy(&ur->wheel);
+    free(ur);
+    return -1;
+}
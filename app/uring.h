@@ -0,0 +1,20 @@
+#ifndef URING_H
+#define URING_H
+
+#include "conn.h"
+#include "reactor.h"
+
+/* 1 when the kernel has what uring_run() needs, probed once */
+int uring_supported(void);
+
+/*
+ * io_uring(7) counterpart of reactor_run() without a pool, on the calling
+ * thread: a multishot accept on the listening socket, multishot receives
+ * into a ring of provided buffers, and file segments sent as a read into a
+ * registered buffer linked to a send. Replies still leave by conn_write()
+ * right away, the ring only waits for a socket that would block.
+ * Returns on fatal error.
+ */
+int uring_run(int listen_fd, conn_handler_fn on_data, conn_timeouts_t const* timeouts);
+
+#endif // URING_H
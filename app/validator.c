@@ -0,0 +1,69 @@
+#define _GNU_SOURCE
+
+#include "validator.h"
+
+#include <string.h>
+
+void http_date_format(char* out, time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(out, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+time_t http_date_parse(char const* s)
+{
+    // recipients must take all three formats, servers only send the first
+    static char const* const formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y",
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        struct tm tm = { 0 };
+        char const* end = strptime(s, formats[i], &tm);
+        if (end != NULL && *end == '\0')
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+int etag_list_match(char const* list, size_t len, char const* etag)
+{
+    char const* p = list;
+    char const* const p_end = list + len;
+    if (etag[0] == 'W' && etag[1] == '/')
+        etag += 2;
+    size_t const etag_len = strlen(etag);
+
+    while (p < p_end) {
+        while (p < p_end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        if (p == p_end)
+            break;
+        if (*p == '*')
+            return 1;
+        if (p_end - p >= 2 && p[0] == 'W' && p[1] == '/')
+            p += 2;
+        // one quoted tag, commas may appear inside the quotes
+        char const* const p_tag = p;
+        if (p < p_end && *p == '"') {
+            char const* const p_close = memchr(p + 1, '"', p_end - p - 1);
+            p = p_close != NULL ? p_close + 1 : p_end;
+        } else {
+            while (p < p_end && *p != ',')
+                ++p;
+        }
+        if ((size_t)(p - p_tag) == etag_len && memcmp(p_tag, etag, etag_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int if_range_match(char const* value, char const* etag, time_t mtime)
+{
+    // a date may well start with a W ("Wed,"), a weak tag starts with W/
+    if (value[0] == '"' || (value[0] == 'W' && value[1] == '/'))
+        return strcmp(value, etag) == 0;
+    return http_date_parse(value) == mtime;
+}
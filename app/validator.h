@@ -0,0 +1,30 @@
+#ifndef VALIDATOR_H
+#define VALIDATOR_H
+
+#include <stddef.h>
+#include <time.h>
+
+/* "Sun, 06 Nov 1994 08:49:37 GMT" and the NUL */
+#define HTTP_DATE_SIZE 30
+
+/* t as an IMF-fixdate into out[HTTP_DATE_SIZE] */
+void http_date_format(char* out, time_t t);
+
+/* an HTTP-date (IMF-fixdate, RFC 850 or asctime) to seconds since the epoch, -1 when it is none */
+time_t http_date_parse(char const* s);
+
+/*
+ * 1 when the If-None-Match value list[0, len) is "*" or has etag among its
+ * entity-tags, compared weakly as RFC 9110 13.1.2 asks: a W/ prefix on
+ * either side is ignored
+ */
+int etag_list_match(char const* list, size_t len, char const* etag);
+
+/*
+ * 1 when the If-Range value names the representation tagged etag, last
+ * modified at mtime: an entity-tag compared strongly (a weak one never
+ * matches), otherwise an HTTP-date equal to mtime, RFC 9110 13.1.5
+ */
+int if_range_match(char const* value, char const* etag, time_t mtime);
+
+#endif // VALIDATOR_H
@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * HTTP/1.1 load generator. Every thread drives its share of keep-alive
+ * connections from its own epoll set, either closed-loop (each connection
+ * keeps --depth requests in flight, depth > 1 pipelines) or open-loop
+ * (--rate requests per second on a fixed schedule, latency measured from
+ * the scheduled time so a stalled server is not hidden). Prints one JSON
+ * object per run on stdout.
+ */
+
+#define LOAD_MAX_DEPTH 64
+#define LOAD_BUF_SIZE (64 * 1024)
+/* open-loop requests due but not yet on a connection, more count as dropped */
+#define LOAD_BACKLOG 65536
+#define LOAD_CONNECT_WAIT_MS 3000
+
+/* log-linear latency buckets, 2^HIST_SUB_BITS per power of two (~3%) */
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+
+/*** args ***/
+
+struct {
+    char const* name;
+    char const* host;
+    int port;
+    char const* path;
+    char const* headers; /* extra header lines, each ending in CRLF */
+    int threads;
+    int connections;
+    int depth;
+    double rate; /* open-loop requests per second, 0 runs closed-loop */
+    double duration;
+    double warmup;
+} g_args = {
+    .name = "load",
+    .host = "127.0.0.1",
+    .port = 4221,
+    .path = "/",
+    .headers = "",
+    .threads = 1,
+    .connections = 1,
+    .depth = 1,
+    .duration = 5,
+    .warmup = 1,
+};
+
+/* the request, LOAD_MAX_DEPTH times back to back so pipelined sends are one write */
+static char* g_req;
+static size_t g_req_len;
+static struct sockaddr_in g_addr;
+static uint64_t g_measure_beg;
+static uint64_t g_measure_end;
+
+/*** histogram ***/
+
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+static unsigned hist_bucket(uint64_t v)
+{
+    if (v < (1u << HIST_SUB_BITS))
+        return (unsigned)v;
+    unsigned const msb = 63 - __builtin_clzll(v);
+    if (msb > HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    unsigned const shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (unsigned)((v >> shift) - (1u << HIST_SUB_BITS));
+}
+
+/* largest value of a bucket */
+static uint64_t hist_bucket_max(unsigned b)
+{
+    if (b < (1u << HIST_SUB_BITS))
+        return b;
+    unsigned const shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t const mantissa = (1u << HIST_SUB_BITS) + (b & ((1u << HIST_SUB_BITS) - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static void hist_add(hist_t* h, uint64_t v)
+{
+    ++h->buckets[hist_bucket(v)];
+    ++h->count;
+    if (v > h->max)
+        h->max = v;
+}
+
+static uint64_t hist_quantile(hist_t const* h, double q)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t const rank = (uint64_t)(q * (h->count - 1)) + 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= rank)
+            return hist_bucket_max(b) < h->max ? hist_bucket_max(b) : h->max;
+    }
+    return h->max;
+}
+
+/*** connections ***/
+
+typedef enum {
+    RESP_HEAD,
+    RESP_BODY,
+    RESP_CHUNK_SIZE,
+    RESP_CHUNK_DATA,
+    RESP_TRAILER,
+} RESP_STATE;
+
+typedef struct {
+    int fd;
+    unsigned inflight; /* requests sent or to be sent, not yet answered */
+    unsigned unsent; /* of inflight, not completely written yet */
+    size_t sent_off; /* bytes of the first unsent request already written */
+    unsigned t_head; /* t_start ring, the oldest inflight request */
+    uint64_t t_start[LOAD_MAX_DEPTH];
+    /* response parser */
+    int state;
+    int status;
+    int close; /* Connection: close, reconnect after this response */
+    size_t need; /* body or chunk bytes still to skip */
+    size_t len;
+    char buf[LOAD_BUF_SIZE];
+} lconn_t;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int epfd;
+    int num_conns;
+    lconn_t* conns;
+    double rate; /* this thread's share */
+    /* open-loop schedule */
+    uint64_t next_due;
+    uint64_t backlog[LOAD_BACKLOG];
+    size_t backlog_head;
+    size_t backlog_len;
+    /* results, only inside the measuring window */
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t dropped;
+    uint64_t reconnects;
+    uint64_t bytes;
+    hist_t hist;
+} worker_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int measuring(uint64_t t)
+{
+    return t >= g_measure_beg && t < g_measure_end;
+}
+
+static int lconn_open(worker_t* w, lconn_t* lc)
+{
+    uint64_t const give_up = now_ns() + LOAD_CONNECT_WAIT_MS * 1000000ull;
+    for (;;) {
+        lc->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (lc->fd == -1)
+            return -1;
+        if (connect(lc->fd, (struct sockaddr*)&g_addr, sizeof(g_addr)) == 0)
+            break;
+        // the server may still be starting up
+        int const err = errno;
+        close(lc->fd);
+        lc->fd = -1;
+        if (err != ECONNREFUSED || now_ns() > give_up) {
+            fprintf(stderr, "[load] connect: %s\n", strerror(err));
+            return -1;
+        }
+        usleep(10 * 1000);
+    }
+    int one = 1;
+    setsockopt(lc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(lc->fd, F_SETFL, fcntl(lc->fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = lc };
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, lc->fd, &ev) != 0) {
+        close(lc->fd);
+        lc->fd = -1;
+        return -1;
+    }
+    lc->state = RESP_HEAD;
+    lc->len = 0;
+    lc->close = 0;
+    return 0;
+}
+
+/* write as much of the unsent requests as the socket takes, -1 on a dead connection */
+static int lconn_flush(lconn_t* lc)
+{
+    while (lc->unsent > 0) {
+        size_t const len = lc->unsent * g_req_len - lc->sent_off;
+        ssize_t const n = send(lc->fd, g_req + lc->sent_off, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        lc->sent_off += n;
+        lc->unsent -= lc->sent_off / g_req_len;
+        lc->sent_off %= g_req_len;
+    }
+    return 0;
+}
+
+/* one more request on lc, started (or scheduled) at t */
+static void lconn_push(lconn_t* lc, uint64_t t)
+{
+    lc->t_start[(lc->t_head + lc->inflight) % LOAD_MAX_DEPTH] = t;
+    ++lc->inflight;
+    ++lc->unsent;
+}
+
+/* closed-loop: keep depth requests in flight */
+static void top_up(lconn_t* lc, uint64_t now)
+{
+    while (lc->inflight < (unsigned)g_args.depth)
+        lconn_push(lc, now);
+}
+
+/*
+ * reconnect after the server closed; with keep_inflight the requests it did
+ * not answer are sent again, otherwise they count as errors
+ */
+static int lconn_reopen(worker_t* w, lconn_t* lc, int keep_inflight)
+{
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, lc->fd, NULL);
+    close(lc->fd);
+    if (measuring(now_ns())) {
+        ++w->reconnects;
+        if (!keep_inflight)
+            w->errors += lc->inflight;
+    }
+    if (!keep_inflight)
+        lc->inflight = 0;
+    lc->unsent = lc->inflight;
+    lc->sent_off = 0;
+    if (lconn_open(w, lc) != 0)
+        return -1;
+    uint64_t const now = now_ns();
+    if (g_args.rate == 0 && now < g_measure_end)
+        top_up(lc, now);
+    return lconn_flush(lc);
+}
+
+static void lconn_done(worker_t* w, lconn_t* lc)
+{
+    uint64_t const now = now_ns();
+    uint64_t const t_start = lc->t_start[lc->t_head];
+    lc->t_head = (lc->t_head + 1) % LOAD_MAX_DEPTH;
+    --lc->inflight;
+    if (measuring(now)) {
+        ++w->requests;
+        if (lc->status < 200 || lc->status >= 400)
+            ++w->errors;
+        hist_add(&w->hist, now - t_start);
+    }
+}
+
+/* the status line and the framing headers of a complete head */
+static void parse_head(lconn_t* lc, char const* head, size_t head_len)
+{
+    lc->status = head_len > 12 ? atoi(head + 9) : 0;
+    lc->state = RESP_BODY;
+    lc->need = 0;
+    char const* p = memchr(head, '\n', head_len);
+    while (p != NULL && (size_t)(++p - head) < head_len) {
+        char const* const eol = memchr(p, '\n', head_len - (p - head));
+        if (eol == NULL)
+            break;
+        if (strncasecmp(p, "Content-Length:", 15) == 0) {
+            lc->need = strtoull(p + 15, NULL, 10);
+        } else if (strncasecmp(p, "Transfer-Encoding:", 18) == 0 && memmem(p, eol - p, "chunked", 7) != NULL) {
+            lc->state = RESP_CHUNK_SIZE;
+        } else if (strncasecmp(p, "Connection:", 11) == 0 && memmem(p, eol - p, "close", 5) != NULL) {
+            lc->close = 1;
+        }
+        p = eol;
+    }
+}
+
+/* consume what is buffered: 1 for each complete response in *done, -1 on garbage */
+static int lconn_parse(lconn_t* lc, unsigned* done)
+{
+    size_t off = 0;
+    int ret = 0;
+    while (off < lc->len && ret == 0) {
+        char* const p = lc->buf + off;
+        size_t const avail = lc->len - off;
+        switch (lc->state) {
+        case RESP_HEAD: {
+            char const* const end = memmem(p, avail, "\r\n\r\n", 4);
+            if (end == NULL) {
+                if (avail == LOAD_BUF_SIZE)
+                    ret = -1;
+                goto SAFE_RETURN;
+            }
+            size_t const head_len = end + 4 - p;
+            parse_head(lc, p, head_len);
+            off += head_len;
+            break;
+        }
+        case RESP_BODY:
+        case RESP_CHUNK_DATA: {
+            size_t const take = avail < lc->need ? avail : lc->need;
+            off += take;
+            lc->need -= take;
+            break;
+        }
+        case RESP_CHUNK_SIZE:
+        case RESP_TRAILER: {
+            char const* const eol = memmem(p, avail, "\r\n", 2);
+            if (eol == NULL)
+                goto SAFE_RETURN;
+            off += eol + 2 - p;
+            if (lc->state == RESP_TRAILER) {
+                if (eol == p)
+                    lc->state = RESP_BODY; // with need 0, done below
+                break;
+            }
+            size_t const size = strtoull(p, NULL, 16);
+            lc->state = size == 0 ? RESP_TRAILER : RESP_CHUNK_DATA;
+            lc->need = size + 2; // the CRLF after the data
+            break;
+        }
+        }
+        if (lc->state == RESP_CHUNK_DATA && lc->need == 0) {
+            lc->state = RESP_CHUNK_SIZE;
+        } else if (lc->state == RESP_BODY && lc->need == 0) {
+            lc->state = RESP_HEAD;
+            ++*done;
+            if (lc->close)
+                break;
+        }
+    }
+
+SAFE_RETURN:
+    memmove(lc->buf, lc->buf + off, lc->len - off);
+    lc->len -= off;
+    return ret;
+}
+
+/*** workers ***/
+
+/* hand due open-loop requests to connections with room, oldest first */
+static void dispatch_backlog(worker_t* w)
+{
+    for (int i = 0; i < w->num_conns && w->backlog_len > 0; ++i) {
+        lconn_t* const lc = &w->conns[i];
+        if (lc->fd == -1 || lc->close)
+            continue;
+        int const queued = lc->inflight < (unsigned)g_args.depth && w->backlog_len > 0;
+        while (lc->inflight < (unsigned)g_args.depth && w->backlog_len > 0) {
+            lconn_push(lc, w->backlog[w->backlog_head]);
+            w->backlog_head = (w->backlog_head + 1) % LOAD_BACKLOG;
+            --w->backlog_len;
+        }
+        if (queued && lconn_flush(lc) != 0)
+            lconn_reopen(w, lc, 1);
+    }
+}
+
+static void on_event(worker_t* w, lconn_t* lc, uint32_t events, uint64_t end)
+{
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        if (lconn_flush(lc) != 0) {
+            lconn_reopen(w, lc, 0);
+            return;
+        }
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+
+    for (;;) {
+        ssize_t const n = recv(lc->fd, lc->buf + lc->len, LOAD_BUF_SIZE - lc->len, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            return;
+        if (n <= 0) {
+            lconn_reopen(w, lc, 0);
+            return;
+        }
+        if (measuring(now_ns()))
+            w->bytes += n;
+        lc->len += n;
+
+        unsigned done = 0;
+        int const err = lconn_parse(lc, &done);
+        for (unsigned i = 0; i < done && lc->inflight > 0; ++i)
+            lconn_done(w, lc);
+        if (err != 0 || lc->close) {
+            // requests pipelined behind a closing response go out again
+            if (err != 0 && measuring(now_ns()))
+                ++w->errors;
+            lconn_reopen(w, lc, err == 0);
+            return;
+        }
+        uint64_t const now = now_ns();
+        if (done > 0 && now < end) {
+            if (g_args.rate > 0) {
+                dispatch_backlog(w);
+            } else {
+                top_up(lc, now);
+                if (lconn_flush(lc) != 0) {
+                    lconn_reopen(w, lc, 0);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void* run_worker(void* arg)
+{
+    worker_t* w = arg;
+    uint64_t const interval = w->rate > 0 ? (uint64_t)(1e9 / w->rate) : 0;
+    uint64_t now = now_ns();
+    for (int i = 0; i < w->num_conns; ++i) {
+        lconn_t* const lc = &w->conns[i];
+        if (lconn_open(w, lc) != 0)
+            continue;
+        if (interval == 0) {
+            top_up(lc, now);
+            lconn_flush(lc);
+        }
+    }
+    // spread the threads' schedules over one interval
+    w->next_due = now + interval * w->id / g_args.threads;
+
+    struct epoll_event events[64];
+    while ((now = now_ns()) < g_measure_end) {
+        int timeout_ms = 100;
+        if (interval > 0) {
+            while (w->next_due <= now) {
+                if (w->backlog_len == LOAD_BACKLOG) {
+                    if (measuring(now))
+                        ++w->dropped;
+                } else {
+                    w->backlog[(w->backlog_head + w->backlog_len) % LOAD_BACKLOG] = w->next_due;
+                    ++w->backlog_len;
+                }
+                w->next_due += interval;
+            }
+            dispatch_backlog(w);
+            timeout_ms = (int)((w->next_due - now + 999999) / 1000000);
+        }
+        int const n = epoll_wait(w->epfd, events, 64, timeout_ms);
+        for (int i = 0; i < n; ++i)
+            on_event(w, events[i].data.ptr, events[i].events, g_measure_end);
+    }
+    for (int i = 0; i < w->num_conns; ++i) {
+        if (w->conns[i].fd != -1)
+            close(w->conns[i].fd);
+    }
+    return NULL;
+}
+
+/*** report ***/
+
+static void report(worker_t* workers, int num_workers)
+{
+    hist_t* const h = calloc(1, sizeof(hist_t));
+    if (h == NULL)
+        return;
+    uint64_t requests = 0, errors = 0, dropped = 0, reconnects = 0, bytes = 0;
+    for (int i = 0; i < num_workers; ++i) {
+        worker_t const* const w = &workers[i];
+        requests += w->requests;
+        errors += w->errors;
+        dropped += w->dropped;
+        reconnects += w->reconnects;
+        bytes += w->bytes;
+        for (unsigned b = 0; b < HIST_BUCKETS; ++b)
+            h->buckets[b] += w->hist.buckets[b];
+        h->count += w->hist.count;
+        if (w->hist.max > h->max)
+            h->max = w->hist.max;
+    }
+    double const sec = g_args.duration;
+    printf("{\"suite\":\"load\",\"name\":\"%s\",\"mode\":\"%s\",\"path\":\"%s\",\"threads\":%d,\"connections\":%d,"
+           "\"depth\":%d,\"rate\":%.0f,\"duration_s\":%.1f,\"requests\":%llu,\"errors\":%llu,\"dropped\":%llu,"
+           "\"reconnects\":%llu,\"rps\":%.1f,\"mb_per_s\":%.2f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,"
+           "\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+        g_args.name, g_args.rate > 0 ? "open" : "closed", g_args.path, num_workers, g_args.connections,
+        g_args.depth, g_args.rate, sec, (unsigned long long)requests, (unsigned long long)errors,
+        (unsigned long long)dropped, (unsigned long long)reconnects, requests / sec, bytes / sec / 1e6,
+        hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.9) / 1e3, hist_quantile(h, 0.99) / 1e3,
+        hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+    fflush(stdout);
+    free(h);
+}
+
+/*** exec ***/
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: load [--name N] [--host ADDR] [--port P] [--path PATH] [--header 'K: V']...\n"
+        "            [--threads T] [--connections C] [--depth D] [--rate R]\n"
+        "            [--duration SEC] [--warmup SEC]\n");
+}
+
+int main(int argc, char* argv[])
+{
+    static char headers[4096];
+    size_t headers_len = 0;
+    for (int i = 1; i < argc; ++i) {
+        char const* const opt = argv[i];
+        char const* const val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strncmp(opt, "--", 2) != 0 || val == NULL) {
+            usage();
+            return 2;
+        }
+        if (strcmp(opt + 2, "name") == 0) {
+            g_args.name = val;
+        } else if (strcmp(opt + 2, "host") == 0) {
+            g_args.host = val;
+        } else if (strcmp(opt + 2, "port") == 0) {
+            g_args.port = atoi(val);
+        } else if (strcmp(opt + 2, "path") == 0) {
+            g_args.path = val;
+        } else if (strcmp(opt + 2, "header") == 0) {
+            int const n = snprintf(headers + headers_len, sizeof(headers) - headers_len, "%s\r\n", val);
+            if (n > 0 && (size_t)n < sizeof(headers) - headers_len)
+                headers_len += n;
+            g_args.headers = headers;
+        } else if (strcmp(opt + 2, "threads") == 0) {
+            g_args.threads = atoi(val);
+        } else if (strcmp(opt + 2, "connections") == 0) {
+            g_args.connections = atoi(val);
+        } else if (strcmp(opt + 2, "depth") == 0) {
+            g_args.depth = atoi(val);
+        } else if (strcmp(opt + 2, "rate") == 0) {
+            g_args.rate = atof(val);
+        } else if (strcmp(opt + 2, "duration") == 0) {
+            g_args.duration = atof(val);
+        } else if (strcmp(opt + 2, "warmup") == 0) {
+            g_args.warmup = atof(val);
+        } else {
+            usage();
+            return 2;
+        }
+        ++i;
+    }
+    if (g_args.connections < 1)
+        g_args.connections = 1;
+    if (g_args.threads < 1)
+        g_args.threads = 1;
+    if (g_args.threads > g_args.connections)
+        g_args.threads = g_args.connections;
+    if (g_args.depth < 1 || g_args.depth > LOAD_MAX_DEPTH)
+        g_args.depth = g_args.depth < 1 ? 1 : LOAD_MAX_DEPTH;
+    if (g_args.duration <= 0 || g_args.warmup < 0) {
+        usage();
+        return 2;
+    }
+
+    g_addr.sin_family = AF_INET;
+    g_addr.sin_port = htons(g_args.port);
+    if (inet_pton(AF_INET, g_args.host, &g_addr.sin_addr) != 1) {
+        fprintf(stderr, "[load] bad host `%s`, IPv4 address expected\n", g_args.host);
+        return 2;
+    }
+
+    char one[8192];
+    int const one_len = snprintf(one, sizeof(one), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: load\r\n%s\r\n",
+        g_args.path, g_args.host, g_args.port, g_args.headers);
+    if (one_len <= 0 || (size_t)one_len >= sizeof(one)) {
+        fprintf(stderr, "[load] request too long\n");
+        return 2;
+    }
+    g_req_len = one_len;
+    g_req = malloc(g_req_len * LOAD_MAX_DEPTH);
+    worker_t* workers = calloc(g_args.threads, sizeof(worker_t));
+    lconn_t* conns = calloc(g_args.connections, sizeof(lconn_t));
+    if (g_req == NULL || workers == NULL || conns == NULL) {
+        fprintf(stderr, "[load] out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < LOAD_MAX_DEPTH; ++i)
+        memcpy(g_req + i * g_req_len, one, g_req_len);
+
+    g_measure_beg = now_ns() + (uint64_t)(g_args.warmup * 1e9);
+    g_measure_end = g_measure_beg + (uint64_t)(g_args.duration * 1e9);
+    int started = 0;
+    for (int i = 0, first = 0; i < g_args.threads; ++i) {
+        worker_t* const w = &workers[i];
+        w->id = i;
+        w->num_conns = g_args.connections / g_args.threads + (i < g_args.connections % g_args.threads);
+        w->conns = conns + first;
+        first += w->num_conns;
+        w->rate = g_args.rate / g_args.threads;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        for (int j = 0; j < w->num_conns; ++j)
+            w->conns[j].fd = -1;
+        if (w->epfd == -1 || pthread_create(&w->thread, NULL, run_worker, w) != 0) {
+            fprintf(stderr, "[load] worker %d failed to start\n", i);
+            break;
+        }
+        ++started;
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].epfd);
+    }
+    report(workers, started);
+    free(conns);
+    free(workers);
+    free(g_req);
+    return started == g_args.threads ? 0 : 1;
+}
@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "log.h"
+#include "request.h"
+#include "scan.h"
+
+/*
+ * Microbenchmarks of the request path: head scan, header and request
+ * parsing, one-shot compression with every codec. One JSON object per line on stdout, per case the
+ * median and the best of MICRO_RUNS timed runs.
+ */
+
+#define MICRO_RUNS 5
+/* a run repeats the case until it took at least this long */
+#define MICRO_RUN_NS (100 * 1000 * 1000ull)
+
+/*** corpora ***/
+
+static struct {
+    char const* name;
+    char const* text;
+} const g_heads[] = {
+    { "curl",
+        "GET /echo/abc HTTP/1.1\r\n"
+        "Host: localhost:4221\r\n"
+        "User-Agent: curl/8.5.0\r\n"
+        "Accept: */*\r\n"
+        "\r\n" },
+    { "browser",
+        "GET /files/index.html HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+        "Sec-Fetch-Site: none\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-User: ?1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+        "Cookie: session=6f1c2a9be04d4e3f8a7b5c6d9e0f1a2b; theme=dark; _ga=GA1.1.1234567890.1700000000\r\n"
+        "If-None-Match: \"5f3c-1a2b3c4d\"\r\n"
+        "\r\n" },
+    { "upload",
+        "POST /files/report.json HTTP/1.1\r\n"
+        "Host: localhost:4221\r\n"
+        "User-Agent: python-requests/2.31.0\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Accept: */*\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: 27\r\n"
+        "\r\n"
+        "{\"status\":\"ok\",\"items\":[]}\n" },
+};
+
+#define NUM_HEADS (sizeof(g_heads) / sizeof(g_heads[0]))
+
+/* deterministic bodies of the kinds the server compresses */
+static char* make_body(char const* kind, size_t size)
+{
+    char* p = malloc(size);
+    if (p == NULL)
+        return NULL;
+    size_t off = 0;
+    unsigned seed = 42;
+    while (off < size) {
+        char chunk[256];
+        int n;
+        seed = seed * 1103515245 + 12345;
+        if (strcmp(kind, "html") == 0) {
+            n = snprintf(chunk, sizeof(chunk),
+                "<li class=\"item item-%u\"><a href=\"/files/doc-%u.html\">Document %u</a> <span>%u KiB</span></li>\n",
+                seed % 7, seed % 1000, seed % 1000, seed % 512);
+        } else if (strcmp(kind, "json") == 0) {
+            n = snprintf(chunk, sizeof(chunk),
+                "{\"id\":%u,\"name\":\"user-%u\",\"active\":%s,\"score\":%u.%02u,\"tags\":[\"a%u\",\"b%u\"]},\n",
+                seed % 100000, seed % 977, (seed & 1) ? "true" : "false", seed % 100, seed % 97, seed % 13, seed % 11);
+        } else {
+            // incompressible
+            n = sizeof(chunk);
+            for (int i = 0; i < n; ++i) {
+                seed = seed * 1103515245 + 12345;
+                chunk[i] = (char)(seed >> 16);
+            }
+        }
+        size_t const take = (size_t)n < size - off ? (size_t)n : size - off;
+        memcpy(p + off, chunk, take);
+        off += take;
+    }
+    return p;
+}
+
+/*** timing ***/
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+typedef void (*bench_fn)(void* arg);
+
+typedef struct {
+    uint64_t ops;
+    double ns_median;
+    double ns_min;
+} bench_result_t;
+
+static int cmp_double(void const* a, void const* b)
+{
+    double const x = *(double const*)a, y = *(double const*)b;
+    return (x > y) - (x < y);
+}
+
+static bench_result_t bench_run(bench_fn fn, void* arg)
+{
+    // find a batch that takes about a tenth of a run
+    uint64_t batch = 1;
+    for (;;) {
+        uint64_t const t_beg = now_ns();
+        for (uint64_t i = 0; i < batch; ++i)
+            fn(arg);
+        if (now_ns() - t_beg >= MICRO_RUN_NS / 10 || batch >= (1ull << 40))
+            break;
+        batch *= 2;
+    }
+
+    bench_result_t res = { 0 };
+    double ns[MICRO_RUNS];
+    for (int r = 0; r < MICRO_RUNS; ++r) {
+        uint64_t ops = 0;
+        uint64_t const t_beg = now_ns();
+        uint64_t elapsed;
+        do {
+            for (uint64_t i = 0; i < batch; ++i)
+                fn(arg);
+            ops += batch;
+            elapsed = now_ns() - t_beg;
+        } while (elapsed < MICRO_RUN_NS);
+        ns[r] = (double)elapsed / ops;
+        res.ops += ops;
+    }
+    qsort(ns, MICRO_RUNS, sizeof(double), cmp_double);
+    res.ns_median = ns[MICRO_RUNS / 2];
+    res.ns_min = ns[0];
+    return res;
+}
+
+static void print_result(char const* bench, char const* corpus, char const* extra, bench_result_t const* res)
+{
+    printf("{\"suite\":\"micro\",\"bench\":\"%s\",\"corpus\":\"%s\"%s,\"ops\":%llu,\"ns_per_op\":%.1f,\"ns_per_op_min\":%.1f}\n",
+        bench, corpus, extra, (unsigned long long)res->ops, res->ns_median, res->ns_min);
+    fflush(stdout);
+}
+
+/*** cases ***/
+
+/* parsing works in place, every op starts from a fresh copy of the corpus */
+typedef struct {
+    char const* text;
+    size_t len;
+    char buf[4096];
+    scan_index_t idx;
+    headerData hd;
+} parse_case_t;
+
+static void case_copy(void* arg)
+{
+    parse_case_t* pc = arg;
+    memcpy(pc->buf, pc->text, pc->len + 1);
+    __asm__ volatile("" : : "r"(pc->buf) : "memory");
+}
+
+static void case_scan(void* arg)
+{
+    parse_case_t* pc = arg;
+    scan_head(pc->text, pc->len, &pc->idx);
+    __asm__ volatile("" : : "r"(&pc->idx) : "memory");
+}
+
+static void case_parse_header(void* arg)
+{
+    parse_case_t* pc = arg;
+    memcpy(pc->buf, pc->text, pc->len + 1);
+    pc->hd = (headerData) { 0 };
+    parse_header(pc->buf, &pc->idx, &pc->hd);
+    __asm__ volatile("" : : "r"(&pc->hd) : "memory");
+}
+
+static void case_parse_request(void* arg)
+{
+    parse_case_t* pc = arg;
+    memcpy(pc->buf, pc->text, pc->len + 1);
+    parse_request(pc->buf, pc->len, &pc->hd);
+    __asm__ volatile("" : : "r"(&pc->hd) : "memory");
+}
+
+typedef struct {
+    int encoding;
+    char const* in;
+    size_t in_len;
+    char* out;
+    size_t out_size;
+    int level;
+    int out_len;
+} compress_case_t;
+
+static void case_compress(void* arg)
+{
+    compress_case_t* cc = arg;
+    cc->out_len = compress_encode(cc->encoding, cc->in, cc->in_len, cc->out, cc->out_size, cc->level);
+}
+
+static void bench_parsing(void)
+{
+    static char const* const impl_names[] = { "scalar", "sse2", "avx2" };
+    parse_case_t* pc = malloc(sizeof(parse_case_t));
+    if (pc == NULL)
+        return;
+    // what the server would pick, restored after each sweep
+    int impl_default = SCAN_IMPL_SCALAR;
+    while (strcmp(impl_names[impl_default], scan_impl_name()) != 0)
+        ++impl_default;
+
+    for (size_t i = 0; i < NUM_HEADS; ++i) {
+        pc->text = g_heads[i].text;
+        pc->len = strlen(pc->text);
+        char extra[64];
+        bench_result_t res;
+
+        // baseline of the copy the parse cases include
+        res = bench_run(case_copy, pc);
+        print_result("copy", g_heads[i].name, "", &res);
+
+        for (int impl = SCAN_IMPL_SCALAR; impl <= SCAN_IMPL_AVX2; ++impl) {
+            if (scan_set_impl(impl) != 0)
+                continue;
+            res = bench_run(case_scan, pc);
+            snprintf(extra, sizeof(extra), ",\"impl\":\"%s\"", impl_names[impl]);
+            print_result("scan_head", g_heads[i].name, extra, &res);
+        }
+        scan_set_impl(impl_default);
+        snprintf(extra, sizeof(extra), ",\"impl\":\"%s\"", scan_impl_name());
+
+        scan_head(pc->text, pc->len, &pc->idx);
+        res = bench_run(case_parse_header, pc);
+        print_result("parse_header", g_heads[i].name, extra, &res);
+
+        res = bench_run(case_parse_request, pc);
+        print_result("parse_request", g_heads[i].name, extra, &res);
+    }
+    free(pc);
+}
+
+static void bench_compress(void)
+{
+    static char const* const kinds[] = { "html", "json", "random" };
+    static size_t const sizes[] = { 1024, 4 * 1024, 64 * 1024 };
+    static int const levels[] = { 1, Z_DEFAULT_COMPRESSION, Z_BEST_COMPRESSION };
+    static int const encodings[] = { ENCODING_TYPE_GZIP, ENCODING_TYPE_BR, ENCODING_TYPE_ZSTD };
+    for (size_t e = 0; e < sizeof(encodings) / sizeof(encodings[0]); ++e) {
+        if (!(compress_available() & encodings[e]))
+            continue;
+        for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+                compress_case_t cc = {
+                    .encoding = encodings[e],
+                    .in = make_body(kinds[k], sizes[s]),
+                    .in_len = sizes[s],
+                    .out_size = compress_bound(encodings[e], sizes[s]),
+                };
+                cc.out = malloc(cc.out_size);
+                if (cc.in == NULL || cc.out == NULL) {
+                    free((char*)cc.in);
+                    free(cc.out);
+                    return;
+                }
+                for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); ++l) {
+                    cc.level = levels[l];
+                    bench_result_t const res = bench_run(case_compress, &cc);
+                    char corpus[32];
+                    char extra[160];
+                    snprintf(corpus, sizeof(corpus), "%s-%zu", kinds[k], sizes[s]);
+                    snprintf(extra, sizeof(extra), ",\"codec\":\"%s\",\"level\":%d,\"bytes\":%zu,\"ratio\":%.3f,\"mb_per_s\":%.1f",
+                        compress_name(cc.encoding), cc.level, sizes[s], cc.out_len > 0 ? (double)cc.out_len / sizes[s] : -1.0,
+                        sizes[s] / res.ns_median * 1000.0);
+                    print_result("compress", corpus, extra, &res);
+                }
+                free((char*)cc.in);
+                free(cc.out);
+            }
+        }
+    }
+}
+
+/*** exec ***/
+
+int main(int argc, char* argv[])
+{
+    // parse_request logs nothing worth timing
+    g_log_level = LOG_LEVEL_ERROR;
+    char const* only = argc > 1 ? argv[1] : NULL;
+    if (only == NULL || strcmp(only, "parse") == 0)
+        bench_parsing();
+    if (only == NULL || strcmp(only, "compress") == 0)
+        bench_compress();
+    return 0;
+}
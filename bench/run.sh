@@ -0,0 +1,55 @@
+#!/bin/sh
+# make bench: microbenchmarks, then the load generator against a server on
+# loopback. JSON lines on stdout, progress on stderr.
+#   usage: run.sh SERVER MICRO LOAD
+#   env:   BENCH_PORT (4222), BENCH_DURATION (5), BENCH_WARMUP (1),
+#          BENCH_THREADS (cpus), BENCH_SERVER_ARGS (extra server options)
+
+set -e
+
+SERVER=$1
+MICRO=$2
+LOAD=$3
+PORT=${BENCH_PORT:-4222}
+DURATION=${BENCH_DURATION:-5}
+WARMUP=${BENCH_WARMUP:-1}
+THREADS=${BENCH_THREADS:-$(nproc)}
+
+echo "[bench] micro" >&2
+"$MICRO"
+
+dir=$(mktemp -d)
+server_pid=
+cleanup() {
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null || true
+        wait "$server_pid" 2>/dev/null || true
+    fi
+    rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+head -c 4096 /dev/urandom >"$dir/4k.bin"
+head -c 1048576 /dev/urandom >"$dir/1m.bin"
+
+# no per-connection request limit, the load generator keeps its connections
+# shellcheck disable=SC2086
+"$SERVER" --port "$PORT" --directory "$dir/" --max-requests 0 --log-level error $BENCH_SERVER_ARGS >/dev/null &
+server_pid=$!
+
+load() {
+    echo "[bench] load $1" >&2
+    name=$1
+    shift
+    "$LOAD" --name "$name" --port "$PORT" --threads "$THREADS" --duration "$DURATION" --warmup "$WARMUP" "$@"
+}
+
+load keepalive --path /echo/bench --connections 64
+load pipelined --path /echo/bench --connections 16 --depth 16
+load file-4k --path /files/4k.bin --connections 64
+load file-1m --path /files/1m.bin --connections 8
+# a body long enough to be compressed per request
+text=$(awk 'BEGIN { for (i = 0; i < 64; ++i) printf "item-%d_of_the_list-", i * 7 }')
+load gzip --path "/echo/$text" --connections 64 --header "Accept-Encoding: gzip"
+load zstd --path "/echo/$text" --connections 64 --header "Accept-Encoding: gzip, br, zstd"
+load open-loop --path /echo/bench --connections 64 --rate 20000
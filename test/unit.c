@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_parser.h"
+#include "validator.h"
+
+/*
+ * Unit tests of the parts of the request path that decide on bytes from
+ * the client. Every failed check prints its line, any of them fails the
+ * run.
+ */
+
+static int g_failed;
+
+#define CHECK(cond)                                                    \
+    do {                                                               \
+        if (!(cond)) {                                                 \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++g_failed;                                                \
+        }                                                              \
+    } while (0)
+
+/*** framing ***/
+
+/* what http_parser_feed() makes of the whole request text, the error status on HTTP_PARSE_ERROR */
+static int parse_whole(char const* text, http_parser_t* p)
+{
+    http_parser_reset(p);
+    int const status = http_parser_feed(p, text, strlen(text));
+    return status == HTTP_PARSE_ERROR ? p->error : status;
+}
+
+static void test_content_length(void)
+{
+    http_parser_t p;
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc", &p) == HTTP_PARSE_DONE);
+    CHECK(http_parser_request_len(&p) == strlen("POST /files/a HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"));
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 3 \t\r\n\r\nabc", &p) == HTTP_PARSE_DONE);
+
+    // trailing garbage after the digits
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 12 34\r\n\r\n", &p) == 400);
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 3 x\r\n\r\nabc", &p) == 400);
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 3,3\r\n\r\nabc", &p) == 400);
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: \r\n\r\n", &p) == 400);
+
+    // repeated: the same value is harmless, a different one is refused
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc", &p)
+        == HTTP_PARSE_DONE);
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 5\r\n\r\nabcde", &p) == 400);
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\ncontent-length: 5\r\nContent-Length: 0\r\n\r\n", &p) == 400);
+
+    // the state does not leak into the next request on the connection
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc", &p) == HTTP_PARSE_DONE);
+    CHECK(parse_whole("POST /files/a HTTP/1.1\r\nContent-Length: 4\r\n\r\nabcd", &p) == HTTP_PARSE_DONE);
+}
+
+/*** validators ***/
+
+static void test_if_range(void)
+{
+    char const* const etag = "\"ce8016-a-18df91939e4d8acd\"";
+    // Wed, 14 Oct 2026 08:13:59 GMT: a date that starts like a weak tag
+    struct tm tm = { .tm_year = 2026 - 1900, .tm_mon = 9, .tm_mday = 14, .tm_hour = 8, .tm_min = 13, .tm_sec = 59 };
+    time_t const mtime = timegm(&tm);
+    char date[HTTP_DATE_SIZE];
+    http_date_format(date, mtime);
+    CHECK(strncmp(date, "Wed,", 4) == 0);
+
+    CHECK(if_range_match(date, etag, mtime));
+    CHECK(!if_range_match(date, etag, mtime + 1));
+    CHECK(!if_range_match("Wed, 14 Oct 2026 08:14:00 GMT", etag, mtime));
+    CHECK(if_range_match(etag, etag, mtime));
+    CHECK(!if_range_match("\"other\"", etag, mtime));
+    // a weak tag never matches, not even the same opaque value
+    CHECK(!if_range_match("W/\"ce8016-a-18df91939e4d8acd\"", etag, mtime));
+    CHECK(!if_range_match("Wednesday", etag, mtime));
+}
+
+int main(void)
+{
+    test_content_length();
+    test_if_range();
+    if (g_failed > 0) {
+        fprintf(stderr, "%d check(s) failed\n", g_failed);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}